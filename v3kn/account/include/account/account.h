@@ -4,20 +4,23 @@
 #pragma once
 
 #include <httplib.h>
+#include <utils/endpoint.h>
+
+#include <string>
 
 void update_profile_timestamp(const std::string &online_id);
 
 void register_account_endpoints(httplib::Server &server);
 
-void handle_check_connection(const httplib::Request &req, httplib::Response &res);
-void handle_get_quota(const httplib::Request &req, httplib::Response &res);
-void handle_create_account(const httplib::Request &req, httplib::Response &res);
-void handle_delete_account(const httplib::Request &req, httplib::Response &res);
-void handle_login(const httplib::Request &req, httplib::Response &res);
-void handle_change_online_id(const httplib::Request &req, httplib::Response &res);
-void handle_change_password(const httplib::Request &req, httplib::Response &res);
-void handle_change_about_me(const httplib::Request &req, httplib::Response &res);
-void handle_upload_avatar(const httplib::Request &req, httplib::Response &res);
-void handle_get_avatar(const httplib::Request &req, httplib::Response &res);
-void handle_upload_panel(const httplib::Request &req, httplib::Response &res);
-void handle_get_panel(const httplib::Request &req, httplib::Response &res);
+std::string handle_check_connection(const EndpointContext &ctx);
+std::string handle_get_quota(const EndpointContext &ctx);
+std::string handle_create_account(const EndpointContext &ctx, const std::string &base64_password);
+std::string handle_delete_account(const EndpointContext &ctx, const std::string &base64_password);
+std::string handle_login(const EndpointContext &ctx, const std::string &base64_password);
+std::string handle_change_online_id(const EndpointContext &ctx);
+std::string handle_change_password(const EndpointContext &ctx, const std::string &base64_old_password, const std::string &base64_new_password);
+std::string handle_change_about_me(const EndpointContext &ctx, const std::string &about_me);
+std::string handle_upload_avatar(const EndpointContext &ctx);
+std::string handle_get_avatar(const EndpointContext &ctx, const std::string &target_online_id);
+std::string handle_upload_panel(const EndpointContext &ctx);
+std::string handle_get_panel(const EndpointContext &ctx, const std::string &target_online_id);
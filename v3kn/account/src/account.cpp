@@ -3,14 +3,31 @@
 
 #include "account/account.h"
 #include "friend/friend.h"
+#include "messages/messages.h"
+#include "stats/stats.h"
+#include "storage/storage.h"
+#include "utils/params.h"
 #include "utils/utils.h"
 
 #include <algorithm>
 #include <cctype>
+#include <condition_variable>
 #include <cstring>
 #include <ctime>
 #include <fstream>
+#include <functional>
 #include <sstream>
+#include <thread>
+
+// Accounts waiting for their data to be reclaimed, persisted in v3kn/deletions.json so deletions resume after a restart
+static std::mutex account_deletion_mutex;
+static std::condition_variable account_deletion_cv;
+
+constexpr size_t DELETION_FILES_PER_BATCH = 64;
+constexpr auto DELETION_BATCH_DELAY = std::chrono::milliseconds(20);
+constexpr auto DELETION_STEP_DELAY = std::chrono::milliseconds(200);
+constexpr int64_t DELETION_RETRY_DELAY = 600; // Seconds before a failed job is retried, multiplied by its attempts
+constexpr int64_t MAX_DELETION_ATTEMPTS = 5; // Then the job is marked as failed and left for the administrator
 
 static std::string generate_account_id(const time_t timestamp) {
     uint64_t ts = static_cast<uint64_t>(timestamp);
@@ -37,6 +54,220 @@ static std::optional<UserAccount> find_existing_online_id_case_insensitive(const
     return std::nullopt;
 }
 
+static json load_account_deletions() {
+    std::ifstream f("v3kn/deletions.json");
+    if (!f.is_open())
+        return json::array();
+
+    try {
+        json deletions;
+        f >> deletions;
+        return deletions.is_array() ? deletions : json::array();
+    } catch (...) {
+        log("Corrupted deletions.json, pending account deletions will be retried from users.json tombstones");
+        return json::array();
+    }
+}
+
+static void save_account_deletions(const json &deletions) {
+    write_file_atomic("v3kn/deletions.json", deletions.dump(2));
+}
+
+static void queue_account_deletion(const std::string &account_id, const std::string &online_id) {
+    {
+        std::lock_guard<std::mutex> lock(account_deletion_mutex);
+        json deletions = load_account_deletions();
+        json job;
+        job["account_id"] = account_id;
+        job["online_id"] = online_id;
+        job["queued_at"] = std::time(0);
+        deletions.push_back(job);
+        save_account_deletions(deletions);
+    }
+    account_deletion_cv.notify_one();
+}
+
+// Helper: Remove a directory tree in small batches so a large savedata tree does not saturate the disk
+static void remove_directory_throttled(const fs::path &path) {
+    std::error_code ec;
+    while (fs::exists(path, ec)) {
+        std::vector<fs::path> files;
+        for (auto it = fs::recursive_directory_iterator(path, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            if (!it->is_directory(ec))
+                files.push_back(it->path());
+            if (files.size() >= DELETION_FILES_PER_BATCH)
+                break;
+        }
+
+        if (files.empty()) {
+            fs::remove_all(path, ec);
+            return;
+        }
+
+        for (const auto &file : files)
+            fs::remove(file, ec);
+
+        std::this_thread::sleep_for(DELETION_BATCH_DELAY);
+    }
+}
+
+// Helper: Run one step of an account deletion, an exception is logged and reported as a failed step
+static bool run_deletion_step(const std::string &step, const std::function<void()> &fn) {
+    try {
+        fn();
+        return true;
+    } catch (const std::exception &e) {
+        log("Account deletion step failed (" + step + "): " + e.what());
+    } catch (...) {
+        log("Account deletion step failed (" + step + ")");
+    }
+    return false;
+}
+
+// Helper: Pending job that can run now (account_deletion_mutex must be held)
+static std::optional<json> get_runnable_account_deletion(const json &deletions) {
+    const int64_t now = std::time(0);
+    for (const auto &job : deletions) {
+        if (!job.value("failed", false) && job.value("retry_at", int64_t{ 0 }) <= now)
+            return job;
+    }
+    return std::nullopt;
+}
+
+// Helper: Move a job whose step failed to the back of the queue with a growing delay, or mark it as failed
+static void postpone_account_deletion(const std::string &account_id, const std::string &online_id) {
+    std::lock_guard<std::mutex> lock(account_deletion_mutex);
+    json deletions = load_account_deletions();
+    const auto it = std::find_if(deletions.begin(), deletions.end(), [&](const json &pending) {
+        return pending.value("account_id", "") == account_id;
+    });
+    if (it == deletions.end())
+        return;
+
+    json job = *it;
+    deletions.erase(it);
+    const int64_t attempts = job.value("attempts", int64_t{ 0 }) + 1;
+    job["attempts"] = attempts;
+    if (attempts >= MAX_DELETION_ATTEMPTS) {
+        job["failed"] = true;
+        log("Account deletion of online ID " + online_id + " failed " + std::to_string(attempts) + " times, giving up until the job is reset in deletions.json");
+    } else
+        job["retry_at"] = std::time(0) + DELETION_RETRY_DELAY * attempts;
+    deletions.push_back(job);
+    save_account_deletions(deletions);
+}
+
+static void run_next_account_deletion() {
+    json job;
+    {
+        std::unique_lock<std::mutex> lock(account_deletion_mutex);
+        account_deletion_cv.wait_for(lock, std::chrono::minutes(1), [] { return get_runnable_account_deletion(load_account_deletions()).has_value(); });
+        const auto runnable = get_runnable_account_deletion(load_account_deletions());
+        if (!runnable)
+            return;
+        job = *runnable;
+    }
+
+    const std::string account_id = job.value("account_id", "");
+    const std::string online_id = job.value("online_id", "");
+    log("Reclaiming data of deleted online ID " + online_id);
+
+    if (!online_id.empty()) {
+        // Friend and conversation files are shared with live handlers, hold the request lock only per step
+        const std::vector<std::pair<std::string, std::function<void()>>> steps = {
+            { "friend links", [&] {
+                 std::lock_guard<std::mutex> req_lock(request_mutex);
+                 purge_account_friend_links(account_id, online_id);
+             } },
+            { "conversations", [&] {
+                 std::lock_guard<std::mutex> req_lock(request_mutex);
+                 purge_account_conversations(online_id);
+             } },
+            { "trophies rarity", [&] { purge_account_trophies_rarity(online_id); } },
+            { "files", [&] {
+                 remove_directory_throttled(get_user_dir(online_id));
+                 invalidate_profile_cache(online_id);
+             } },
+        };
+
+        bool purged = true;
+        for (const auto &[step, fn] : steps) {
+            purged = run_deletion_step(step + " of online ID " + online_id, fn);
+            if (!purged)
+                break;
+            std::this_thread::sleep_for(DELETION_STEP_DELAY);
+        }
+
+        // Every step is idempotent, the retry replays the job from the start
+        if (!purged) {
+            postpone_account_deletion(account_id, online_id);
+            return;
+        }
+    }
+
+    // Finally forget the account, which frees its online IDs
+    {
+        std::lock_guard<std::mutex> lock_db(account_mutex);
+        json db = load_users();
+        if (db["users"].contains(account_id) && db["users"][account_id].contains("deleted_at")) {
+            db["users"].erase(account_id);
+            save_users(db);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(account_deletion_mutex);
+        json deletions = load_account_deletions();
+        deletions.erase(std::remove_if(deletions.begin(), deletions.end(), [&](const json &pending) {
+            return pending.value("account_id", "") == account_id;
+        }),
+            deletions.end());
+        save_account_deletions(deletions);
+    }
+
+    log("Account deletion completed for online ID " + online_id);
+}
+
+// Background job reclaiming the data of tombstoned accounts, every step is idempotent so an interrupted job is simply replayed
+static void account_deletion_worker() {
+    // Tombstones whose job was lost (e.g. crash between users.json and deletions.json writes) are queued again
+    run_deletion_step("resuming pending deletions", [] {
+        std::lock_guard<std::mutex> lock_db(account_mutex);
+        const json db = load_users();
+        std::lock_guard<std::mutex> lock(account_deletion_mutex);
+        json deletions = load_account_deletions();
+        bool changed = false;
+        for (const auto &[account_id, user] : db["users"].items()) {
+            if (!user.contains("deleted_at"))
+                continue;
+            const bool queued = std::any_of(deletions.begin(), deletions.end(), [&](const json &job) {
+                return job.value("account_id", "") == account_id;
+            });
+            if (!queued) {
+                deletions.push_back(json{ { "account_id", account_id }, { "online_id", user.value("online_id", "") }, { "queued_at", std::time(0) } });
+                changed = true;
+            }
+        }
+        if (changed)
+            save_account_deletions(deletions);
+        if (!deletions.empty())
+            log("Resuming " + std::to_string(deletions.size()) + " pending account deletion(s)");
+    });
+
+    while (true) {
+        // Nothing may escape this detached thread, an uncaught exception would terminate the server
+        try {
+            run_next_account_deletion();
+        } catch (const std::exception &e) {
+            log(std::string("Account deletion worker error: ") + e.what());
+            std::this_thread::sleep_for(std::chrono::minutes(1));
+        } catch (...) {
+            log("Account deletion worker error");
+            std::this_thread::sleep_for(std::chrono::minutes(1));
+        }
+    }
+}
+
 void update_profile_timestamp(const std::string &online_id) {
     json profile = load_profile(online_id);
 
@@ -46,19 +277,42 @@ void update_profile_timestamp(const std::string &online_id) {
     save_profile(online_id, profile);
 }
 
+using PasswordParam = RequiredParam<"password", std::string, "Password">;
+using TargetOnlineIdParam = RequiredParam<"target_online_id", std::string, "TargetOnlineID">;
+
+// Online IDs are trimmed and checked by the handlers, their errors depend on the request
+using CheckConnection = Endpoint<"/v3kn/check", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using GetQuota = Endpoint<"/v3kn/quota", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using CreateAccount = Endpoint<"/v3kn/create", EndpointMethod::Post, EndpointAuth::None, EndpointLock::Request, EndpointResponse::Text, PasswordParam>;
+using DeleteAccount = Endpoint<"/v3kn/delete", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text, PasswordParam>;
+using Login = Endpoint<"/v3kn/login", EndpointMethod::Post, EndpointAuth::None, EndpointLock::Request, EndpointResponse::Text, PasswordParam>;
+using ChangeOnlineId = Endpoint<"/v3kn/change_online_id", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using ChangePassword = Endpoint<"/v3kn/change_password", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text,
+    RequiredParam<"old_password", std::string, "OldPassword">, RequiredParam<"new_password", std::string, "NewPassword">>;
+using ChangeAboutMe = Endpoint<"/v3kn/change_about_me", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text,
+    RequiredParam<"about_me", std::string, "AboutMe">>;
+using UploadAvatar = Endpoint<"/v3kn/avatar", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using GetAvatar = Endpoint<"/v3kn/avatar", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Custom, TargetOnlineIdParam>;
+using UploadPanel = Endpoint<"/v3kn/panel", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using GetPanel = Endpoint<"/v3kn/panel", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Custom, TargetOnlineIdParam>;
+
 void register_account_endpoints(httplib::Server &server) {
-    server.Get("/v3kn/check", handle_check_connection);
-    server.Get("/v3kn/quota", handle_get_quota);
-    server.Post("/v3kn/create", handle_create_account);
-    server.Post("/v3kn/delete", handle_delete_account);
-    server.Post("/v3kn/login", handle_login);
-    server.Post("/v3kn/change_online_id", handle_change_online_id);
-    server.Post("/v3kn/change_password", handle_change_password);
-    server.Post("/v3kn/change_about_me", handle_change_about_me);
-    server.Post("/v3kn/avatar", handle_upload_avatar);
-    server.Get("/v3kn/avatar", handle_get_avatar);
-    server.Post("/v3kn/panel", handle_upload_panel);
-    server.Get("/v3kn/panel", handle_get_panel);
+    CheckConnection::register_handler<handle_check_connection>(server);
+    GetQuota::register_handler<handle_get_quota>(server);
+    CreateAccount::register_handler<handle_create_account>(server);
+    DeleteAccount::register_handler<handle_delete_account>(server);
+    Login::register_handler<handle_login>(server);
+    ChangeOnlineId::register_handler<handle_change_online_id>(server);
+    ChangePassword::register_handler<handle_change_password>(server);
+    ChangeAboutMe::register_handler<handle_change_about_me>(server);
+    UploadAvatar::register_handler<handle_upload_avatar>(server);
+    GetAvatar::register_handler<handle_get_avatar>(server);
+    UploadPanel::register_handler<handle_upload_panel>(server);
+    GetPanel::register_handler<handle_get_panel>(server);
+
+    // Start the account deletion thread
+    static std::thread deletion_thread(account_deletion_worker);
+    deletion_thread.detach();
 }
 
 static bool is_valid_online_id(const std::string &online_id, const std::string &request, std::string &err) {
@@ -68,8 +322,7 @@ static bool is_valid_online_id(const std::string &online_id, const std::string &
         return false;
     }
 
-    static const std::regex valid_online_id("^[A-Za-z][A-Za-z0-9_-]{2,15}$");
-    if (!std::regex_match(online_id, valid_online_id)) {
+    if (!is_online_id_format(online_id)) {
         log(request + " with invalid online ID: " + online_id);
         err = "ERR:InvalidOnlineID";
         return false;
@@ -81,45 +334,37 @@ static bool is_valid_online_id(const std::string &online_id, const std::string &
 constexpr double SERVER_VERSION = 0.01;
 
 static bool check_client_version(const httplib::Request &req, const std::string &request, std::string &err) {
-    const auto version_str = req.get_param_value("version");
+    const auto version_str = get_param_view(req, "version");
     if (version_str.empty()) {
         log(request + " with missing version parameter");
         err = "ERR:MissingVersion";
         return false;
     }
-    try {
-        const double version = std::stod(version_str);
-        if (version < SERVER_VERSION) {
-            log(request + " with outdated client version: " + version_str);
-            err = "ERR:OutdatedClient";
-            return false;
-        }
-    } catch (...) {
-        log(request + " with invalid version parameter: " + version_str);
+
+    const auto version = parse_decimal(version_str);
+    if (!version) {
+        log(request + " with invalid version parameter: " + std::string(version_str));
         err = "ERR:InvalidVersion";
         return false;
     }
+
+    if (*version < SERVER_VERSION) {
+        log(request + " with outdated client version: " + std::string(version_str));
+        err = "ERR:OutdatedClient";
+        return false;
+    }
     return true;
 }
 
-void handle_check_connection(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
+std::string handle_check_connection(const EndpointContext &ctx) {
     std::string err;
-    const auto account = get_valid_account(req, "connection check", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
-    if (!check_client_version(req, "connection check", err)) {
-        res.set_content(err, "text/plain");
-        return;
+    if (!check_client_version(ctx.req, "connection check", err)) {
+        return err;
     }
 
     std::lock_guard<std::mutex> lock_db(account_mutex);
@@ -129,7 +374,7 @@ void handle_check_connection(const httplib::Request &req, httplib::Response &res
     const uint64_t used = user["quota_used"];
     const uint64_t total = DEFAULT_QUOTA_TOTAL;
 
-    std::string user_agent = req.get_header_value("User-Agent");
+    std::string user_agent = ctx.req.get_header_value("User-Agent");
     if (user_agent.empty()) {
         user_agent = "Unknown";
     }
@@ -182,9 +427,9 @@ void handle_check_connection(const httplib::Request &req, httplib::Response &res
         user["online_ids"].push_back(fixed_online_id);
         user["online_id"] = fixed_online_id;
         save_users(db);
-        const fs::path users_path = fs::path("v3kn") / "Users";
-        if (fs::exists(users_path / online_id)) {
-            fs::rename(users_path / online_id, users_path / fixed_online_id);
+        if (rename_data_entry(DataTree::Users, online_id, fixed_online_id)) {
+            invalidate_profile_cache(online_id);
+            invalidate_profile_cache(fixed_online_id);
         } else {
             log("Online ID directory for " + online_id + " does not exist, cannot rename to " + fixed_online_id);
         }
@@ -206,20 +451,12 @@ void handle_check_connection(const httplib::Request &req, httplib::Response &res
 
     const std::string current_online_id = user["online_id"].get<std::string>();
     log("Connection check OK for online ID " + current_online_id + " from " + user_agent);
-    res.set_content("OK:Connected:" + current_online_id + ":" + std::to_string(created_at) + ":" + std::to_string(used) + ":" + std::to_string(total), "text/plain");
+    return "OK:Connected:" + current_online_id + ":" + std::to_string(created_at) + ":" + std::to_string(used) + ":" + std::to_string(total);
 }
 
-void handle_get_quota(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "quota retrieval", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+std::string handle_get_quota(const EndpointContext &ctx) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
     json db = load_users();
     auto &user = db["users"][account_id];
@@ -227,32 +464,21 @@ void handle_get_quota(const httplib::Request &req, httplib::Response &res) {
     const uint64_t total = DEFAULT_QUOTA_TOTAL;
 
     log("Quota for online ID " + online_id + ": " + std::to_string(used) + " / " + std::to_string(total));
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
-    res.set_content("OK:" + std::to_string(used) + ":" + std::to_string(total), "text/plain");
+    return "OK:" + std::to_string(used) + ":" + std::to_string(total);
 }
 
-void handle_create_account(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    const std::string online_id = trim_online_id(req.get_param_value("online_id"));
+std::string handle_create_account(const EndpointContext &ctx, const std::string &base64_password) {
+    const std::string online_id = trim_online_id(std::string(get_param_view(ctx.req, "online_id")));
 
     std::string err;
-    if (!check_client_version(req, "account creation", err)) {
-        res.set_content(err, "text/plain");
-        return;
+    if (!check_client_version(ctx.req, "account creation", err)) {
+        return err;
     }
 
     if (!is_valid_online_id(online_id, "account creation", err)) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string base64_password = req.get_param_value("password");
-    if (base64_password.empty()) {
-        log("Missing password attempt for online ID " + online_id);
-        res.set_content("ERR:MissingPassword", "text/plain");
-        return;
+        return err;
     }
 
     std::lock_guard<std::mutex> lock_db(account_mutex);
@@ -260,8 +486,7 @@ void handle_create_account(const httplib::Request &req, httplib::Response &res)
     const auto existing_account = find_existing_online_id_case_insensitive(db["users"], online_id);
     if (existing_account) {
         log("Account creation attempt for existing online ID " + online_id);
-        res.set_content("ERR:UserExists", "text/plain");
-        return;
+        return "ERR:UserExists";
     }
 
     const std::string password = base64_decode(base64_password);
@@ -282,8 +507,9 @@ void handle_create_account(const httplib::Request &req, httplib::Response &res)
     user["salt"] = base64_encode(std::string(salt.begin(), salt.end()));
     user["token"] = token;
 
-    update_remote_addr(req, user);
+    update_remote_addr(ctx.req, user);
     save_users(db);
+    add_stat("users", 1);
 
     // Update the account_id -> online_id cache with the new account ID
     {
@@ -303,7 +529,7 @@ void handle_create_account(const httplib::Request &req, httplib::Response &res)
         token_cache[token] = account_id;
     }
 
-    const auto account_path = fs::path("v3kn") / "Users" / online_id;
+    const auto account_path = get_user_dir(online_id);
     fs::create_directories(account_path / "savedata");
     fs::create_directories(account_path / "trophy");
 
@@ -314,28 +540,12 @@ void handle_create_account(const httplib::Request &req, httplib::Response &res)
     const size_t user_count = db["users"].size();
 
     log("Created account for Account ID " + account_id + " with online ID " + online_id + ", user #" + std::to_string(user_count));
-    res.set_content("OK:" + token, "text/plain");
+    return "OK:" + token;
 }
 
-void handle_delete_account(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "account deletion", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
-
-    const std::string base64_password = req.get_param_value("password");
-    if (base64_password.empty()) {
-        log("Missing password on account deletion attempt for online ID " + online_id);
-        res.set_content("ERR:MissingPassword", "text/plain");
-        return;
-    }
+std::string handle_delete_account(const EndpointContext &ctx, const std::string &base64_password) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
     const std::string password = base64_decode(base64_password);
 
@@ -352,8 +562,7 @@ void handle_delete_account(const httplib::Request &req, httplib::Response &res)
 
     if (user["password"] != base64_server_hash) {
         log("Invalid password on account deletion attempt for online ID " + online_id);
-        res.set_content("ERR:InvalidPassword", "text/plain");
-        return;
+        return "ERR:InvalidPassword";
     }
 
     // Remove all online IDs of the user from the online ID cache
@@ -377,35 +586,29 @@ void handle_delete_account(const httplib::Request &req, httplib::Response &res)
         token_cache.erase(user["token"]);
     }
 
-    db["users"].erase(account_id);
+    // Tombstone the account, its files, friend links and conversations are reclaimed in the background
+    user["deleted_at"] = std::time(0);
+    user.erase("token");
     save_users(db);
+    add_stat("users", -1);
+    add_stat("storage_bytes", -user.value("quota_used", int64_t{ 0 }));
 
-    fs::remove_all("v3kn/Users/" + online_id);
+    end_account_presence(account_id, online_id);
+    queue_account_deletion(account_id, online_id);
     log("Deleting account for online ID " + online_id);
-    res.set_content("OK:UserDeleted", "text/plain");
+    return "OK:UserDeleted";
 }
 
-void handle_login(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    const std::string login_online_id = trim_online_id(req.get_param_value("online_id"));
+std::string handle_login(const EndpointContext &ctx, const std::string &base64_password) {
+    const std::string login_online_id = trim_online_id(std::string(get_param_view(ctx.req, "online_id")));
     if (login_online_id.empty()) {
         log("Missing online ID on login attempt");
-        res.set_content("ERR:MissingOnlineID", "text/plain");
-        return;
+        return "ERR:MissingOnlineID";
     }
 
     std::string err;
-    if (!check_client_version(req, "login", err)) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string base64_password = req.get_param_value("password");
-    if (base64_password.empty()) {
-        log("Missing password on login attempt for online ID " + login_online_id);
-        res.set_content("ERR:MissingPassword", "text/plain");
-        return;
+    if (!check_client_version(ctx.req, "login", err)) {
+        return err;
     }
 
     const std::string password = base64_decode(base64_password);
@@ -416,14 +619,18 @@ void handle_login(const httplib::Request &req, httplib::Response &res) {
     const auto account = find_existing_online_id_case_insensitive(db["users"], login_online_id);
     if (!account) {
         log("Login attempt for non-existing online ID " + login_online_id);
-        res.set_content("ERR:UserNotFound", "text/plain");
-        return;
+        return "ERR:UserNotFound";
     }
 
     const auto account_id = account->account_id;
     const auto online_id = account->online_id;
 
     auto &user = db["users"][account_id];
+    if (user.contains("deleted_at")) {
+        log("Login attempt for deleted online ID " + login_online_id);
+        return "ERR:UserNotFound";
+    }
+
     const std::string base64_salt = user["salt"];
     const std::string salt_str = base64_decode(base64_salt);
     const std::vector<unsigned char> salt(salt_str.begin(), salt_str.end());
@@ -433,8 +640,7 @@ void handle_login(const httplib::Request &req, httplib::Response &res) {
 
     if (user["password"] != base64_server_hash) {
         log("Invalid password on login attempt for online ID " + online_id);
-        res.set_content("ERR:InvalidPassword", "text/plain");
-        return;
+        return "ERR:InvalidPassword";
     }
 
     const std::string token = user["token"];
@@ -442,33 +648,24 @@ void handle_login(const httplib::Request &req, httplib::Response &res) {
 
     user["last_login"] = std::time(0);
     user["last_activity"] = std::time(0);
-    update_remote_addr(req, user);
+    update_remote_addr(ctx.req, user);
     save_users(db);
 
     json profile = load_profile(online_id);
     save_profile(online_id, profile);
 
     log("User " + online_id + " logged in.");
-    res.set_content("OK:" + online_id + ":" + token, "text/plain");
+    return "OK:" + online_id + ":" + token;
 }
 
-void handle_change_online_id(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
+std::string handle_change_online_id(const EndpointContext &ctx) {
     std::string err;
-    const auto account = get_valid_account(req, "online ID change", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    const std::string new_online_id = trim_online_id(req.get_param_value("new_online_id"));
+    const std::string new_online_id = trim_online_id(std::string(get_param_view(ctx.req, "new_online_id")));
     if (!is_valid_online_id(new_online_id, "online ID change", err)) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     std::lock_guard<std::mutex> lock_db(account_mutex);
@@ -476,15 +673,14 @@ void handle_change_online_id(const httplib::Request &req, httplib::Response &res
     const auto existing_online_id = find_existing_online_id_case_insensitive(db["users"], new_online_id);
     if (existing_online_id) {
         log("Online ID change attempt to existing online ID " + new_online_id + " by user " + online_id);
-        res.set_content("ERR:UserExists", "text/plain");
-        return;
+        return "ERR:UserExists";
     }
 
     auto &user = db["users"][account_id];
     user["online_ids"].push_back(new_online_id);
     user["online_id"] = new_online_id;
     user["last_activity"] = std::time(0);
-    update_remote_addr(req, user);
+    update_remote_addr(ctx.req, user);
     save_users(db);
 
     // Update the account_id -> online_id cache with the new online ID
@@ -499,7 +695,9 @@ void handle_change_online_id(const httplib::Request &req, httplib::Response &res
         online_id_cache[new_online_id] = account_id;
     }
 
-    fs::rename("v3kn/Users/" + online_id, "v3kn/Users/" + new_online_id);
+    rename_data_entry(DataTree::Users, online_id, new_online_id);
+    invalidate_profile_cache(online_id);
+    invalidate_profile_cache(new_online_id);
 
     // Update the profile with the new online ID
     json profile = load_profile(new_online_id);
@@ -507,40 +705,16 @@ void handle_change_online_id(const httplib::Request &req, httplib::Response &res
     save_profile(new_online_id, profile);
 
     log("User " + online_id + " changed online ID to " + new_online_id);
-    res.set_content("OK:OnlineIDChanged", "text/plain");
+    return "OK:OnlineIDChanged";
 }
 
-void handle_change_password(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "password change", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
-
-    const std::string base64_old_password = req.get_param_value("old_password");
-    if (base64_old_password.empty()) {
-        log("Missing old password on password change attempt for online ID " + online_id);
-        res.set_content("ERR:MissingOldPassword", "text/plain");
-        return;
-    }
-
-    const std::string base64_new_password = req.get_param_value("new_password");
-    if (base64_new_password.empty()) {
-        log("Missing new password on password change attempt for online ID " + online_id);
-        res.set_content("ERR:MissingNewPassword", "text/plain");
-        return;
-    }
+std::string handle_change_password(const EndpointContext &ctx, const std::string &base64_old_password, const std::string &base64_new_password) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
     if (base64_old_password == base64_new_password) {
         log("Same password provided on password change attempt for online ID " + online_id);
-        res.set_content("ERR:SamePassword", "text/plain");
-        return;
+        return "ERR:SamePassword";
     }
 
     const std::string new_password = base64_decode(base64_new_password);
@@ -559,8 +733,7 @@ void handle_change_password(const httplib::Request &req, httplib::Response &res)
 
     if (user["password"] != base64_old_server_hash) {
         log("Invalid old password on password change attempt for online ID " + online_id);
-        res.set_content("ERR:InvalidPassword", "text/plain");
-        return;
+        return "ERR:InvalidPassword";
     }
 
     const std::vector<unsigned char> new_salt = generate_salt();
@@ -577,7 +750,7 @@ void handle_change_password(const httplib::Request &req, httplib::Response &res)
     user["salt"] = base64_encode(std::string(new_salt.begin(), new_salt.end()));
     user["token"] = new_token;
     user["last_activity"] = std::time(0);
-    update_remote_addr(req, user);
+    update_remote_addr(ctx.req, user);
     save_users(db);
 
     {
@@ -585,76 +758,52 @@ void handle_change_password(const httplib::Request &req, httplib::Response &res)
         token_cache[new_token] = account_id;
     }
 
+    // The UDP presence key was handed out with the old token
+    drop_presence_session(account_id);
+
     log("User " + online_id + " changed their password (new token generated).");
-    res.set_content("OK:" + new_token, "text/plain");
+    return "OK:" + new_token;
 }
 
-void handle_change_about_me(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-    std::string err;
-    const auto account = get_valid_account(req, "about me change", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
-
-    const std::string about_me = req.get_param_value("about_me");
-    if (about_me.empty()) {
-        log("Missing About Me on about me change attempt for online ID " + online_id);
-        res.set_content("ERR:MissingAboutMe", "text/plain");
-        return;
-    }
+std::string handle_change_about_me(const EndpointContext &ctx, const std::string &about_me) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
     if (about_me.size() > 21) {
         log("About Me too long on about me change attempt for online ID " + online_id);
-        res.set_content("ERR:AboutMeTooLong", "text/plain");
-        return;
+        return "ERR:AboutMeTooLong";
     }
 
     json profile = load_profile(online_id);
     profile["about_me"] = about_me;
     save_profile(online_id, profile);
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
     log("User " + online_id + " changed their About Me.");
-    res.set_content("OK:AboutMeChanged", "text/plain");
+    return "OK:AboutMeChanged";
 }
 
-void handle_upload_avatar(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_upload_avatar(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    std::string err;
-    const auto account = get_valid_account(req, "avatar upload", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    if (!req.form.has_file("file")) {
+    if (!ctx.req.form.has_file("file")) {
         log("Missing file on avatar upload for online ID " + online_id);
-        res.set_content("ERR:MissingFile", "text/plain");
-        return;
+        return "ERR:MissingFile";
     }
 
-    const auto &file = req.form.get_file("file");
+    const auto &file = ctx.req.form.get_file("file");
+    meter_upload(file.content.size());
     if (file.content.empty()) {
         log("Empty file on avatar upload for online ID " + online_id);
-        res.set_content("ERR:EmptyFile", "text/plain");
-        return;
+        return "ERR:EmptyFile";
     }
 
     // Max 2MB
     if (file.content.size() > 2 * 1024 * 1024) {
         log("Avatar too large for online ID " + online_id + " (" + std::to_string(file.content.size()) + " bytes)");
-        res.set_content("ERR:FileTooLarge", "text/plain");
-        return;
+        return "ERR:FileTooLarge";
     }
 
     // Verify PNG signature and dimensions (max 128x128)
@@ -662,8 +811,7 @@ void handle_upload_avatar(const httplib::Request &req, httplib::Response &res) {
     const uint8_t png_sig[] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
     if (data.size() < 24 || std::memcmp(data.data(), png_sig, 8) != 0) {
         log("Invalid PNG file on avatar upload for online ID " + online_id);
-        res.set_content("ERR:InvalidPNG", "text/plain");
-        return;
+        return "ERR:InvalidPNG";
     }
 
     // Width at offset 16, height at offset 20 (big-endian uint32)
@@ -675,88 +823,60 @@ void handle_upload_avatar(const httplib::Request &req, httplib::Response &res) {
 
     if (width > 128 || height > 128) {
         log("Avatar dimensions too large for online ID " + online_id + " (" + std::to_string(width) + "x" + std::to_string(height) + ")");
-        res.set_content("ERR:DimensionsTooLarge", "text/plain");
-        return;
+        return "ERR:DimensionsTooLarge";
     }
 
-    const fs::path avatar_path = fs::path("v3kn") / "Users" / online_id / "Avatar.png";
+    const fs::path avatar_path = get_user_dir(online_id) / "Avatar.png";
     fs::create_directories(avatar_path.parent_path());
 
     std::ofstream out(avatar_path, std::ios::binary);
     out << file.content;
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
     log("Avatar uploaded for online ID " + online_id + " (" + std::to_string(file.content.size()) + " bytes)");
-    res.set_content("OK:AvatarUploaded", "text/plain");
+    return "OK:AvatarUploaded";
 }
 
-void handle_get_avatar(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_get_avatar(const EndpointContext &ctx, const std::string &target_online_id) {
+    const std::string &account_id = ctx.account.account_id;
 
-    std::string err;
-    const auto account = get_valid_account(req, "avatar download", err);
-    if (!account) {
-        log("Missing or invalid token on avatar download attempt");
-        res.set_content(err, "text/plain");
-        return;
-    }
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const std::string &target_online_id = req.get_param_value("target_online_id");
-    if (target_online_id.empty()) {
-        log("Missing target online ID on avatar download attempt by online ID " + online_id);
-        res.set_content("ERR:MissingTargetOnlineID", "text/plain");
-        return;
-    }
-
-    const fs::path avatar_path = fs::path("v3kn") / "Users" / target_online_id / "Avatar.png";
+    const fs::path avatar_path = get_user_dir(target_online_id) / "Avatar.png";
     if (!fs::exists(avatar_path)) {
-        res.set_content("ERR:NoAvatar", "text/plain");
-        return;
+        return "ERR:NoAvatar";
     }
 
     std::ifstream f(avatar_path, std::ios::binary);
     std::stringstream buffer;
     buffer << f.rdbuf();
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
-    res.set_content(buffer.str(), "image/png");
+    // Profile images are shown in the UI, they get a larger share than savedata transfers
+    set_scheduled_content(ctx.res, buffer.str(), "image/png", 4);
+    return {};
 }
 
-void handle_upload_panel(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_upload_panel(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    std::string err;
-    const auto account = get_valid_account(req, "panel upload", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    if (!req.form.has_file("file")) {
+    if (!ctx.req.form.has_file("file")) {
         log("Missing file on panel upload for online ID " + online_id);
-        res.set_content("ERR:MissingFile", "text/plain");
-        return;
+        return "ERR:MissingFile";
     }
 
-    const auto &file = req.form.get_file("file");
+    const auto &file = ctx.req.form.get_file("file");
+    meter_upload(file.content.size());
     if (file.content.empty()) {
         log("Empty file on panel upload for online ID " + online_id);
-        res.set_content("ERR:EmptyFile", "text/plain");
-        return;
+        return "ERR:EmptyFile";
     }
 
     // Max 2MB
     if (file.content.size() > 2 * 1024 * 1024) {
         log("Panel too large for online ID " + online_id + " (" + std::to_string(file.content.size()) + " bytes)");
-        res.set_content("ERR:FileTooLarge", "text/plain");
-        return;
+        return "ERR:FileTooLarge";
     }
 
     // Verify PNG signature
@@ -764,8 +884,7 @@ void handle_upload_panel(const httplib::Request &req, httplib::Response &res) {
     const uint8_t png_sig[] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
     if (data.size() < 24 || std::memcmp(data.data(), png_sig, 8) != 0) {
         log("Invalid PNG file on panel upload for online ID " + online_id);
-        res.set_content("ERR:InvalidPNG", "text/plain");
-        return;
+        return "ERR:InvalidPNG";
     }
 
     // Width at offset 16, height at offset 20 (big-endian uint32)
@@ -777,54 +896,36 @@ void handle_upload_panel(const httplib::Request &req, httplib::Response &res) {
 
     if (width != 400 || height != 80) {
         log("Panel dimensions invalid for online ID " + online_id + " (" + std::to_string(width) + "x" + std::to_string(height) + ")");
-        res.set_content("ERR:InvalidDimensions", "text/plain");
-        return;
+        return "ERR:InvalidDimensions";
     }
 
-    const fs::path panel_path = fs::path("v3kn") / "Users" / online_id / "Panel.png";
+    const fs::path panel_path = get_user_dir(online_id) / "Panel.png";
     fs::create_directories(panel_path.parent_path());
 
     std::ofstream out(panel_path, std::ios::binary);
     out << file.content;
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
     log("Panel uploaded for online ID " + online_id + " (" + std::to_string(file.content.size()) + " bytes)");
-    res.set_content("OK:PanelUploaded", "text/plain");
+    return "OK:PanelUploaded";
 }
 
-void handle_get_panel(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_get_panel(const EndpointContext &ctx, const std::string &target_online_id) {
+    const std::string &account_id = ctx.account.account_id;
 
-    std::string err;
-    const auto account = get_valid_account(req, "panel download", err);
-    if (!account) {
-        log("Missing or invalid token on panel download attempt");
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const std::string &target_online_id = req.get_param_value("target_online_id");
-    if (target_online_id.empty()) {
-        log("Missing target online ID on panel download attempt by online ID " + online_id);
-        res.set_content("ERR:MissingTargetOnlineID", "text/plain");
-        return;
-    }
-
-    const fs::path panel_path = fs::path("v3kn") / "Users" / target_online_id / "Panel.png";
+    const fs::path panel_path = get_user_dir(target_online_id) / "Panel.png";
     if (!fs::exists(panel_path)) {
-        res.set_content("ERR:NoPanel", "text/plain");
-        return;
+        return "ERR:NoPanel";
     }
 
     std::ifstream f(panel_path, std::ios::binary);
     std::stringstream buffer;
     buffer << f.rdbuf();
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
-    res.set_content(buffer.str(), "image/png");
+    // Profile images are shown in the UI, they get a larger share than savedata transfers
+    set_scheduled_content(ctx.res, buffer.str(), "image/png", 4);
+    return {};
 }
@@ -4,18 +4,23 @@
 #pragma once
 
 #include <httplib.h>
+#include <utils/endpoint.h>
 
+#include <optional>
 #include <string>
+#include <string_view>
 
 void create_friendship_established_activity(const std::string &account_id1, const std::string &account_id2);
 void migrate_activities_created_at_to_milliseconds();
 
 void register_activity_endpoints(httplib::Server &server);
 
-void handle_post_activity(const httplib::Request &req, httplib::Response &res);
-void handle_like_activity(const httplib::Request &req, httplib::Response &res);
-void handle_unlike_activity(const httplib::Request &req, httplib::Response &res);
-void handle_comment_activity(const httplib::Request &req, httplib::Response &res);
-void handle_uncomment_activity(const httplib::Request &req, httplib::Response &res);
-void handle_delete_activity(const httplib::Request &req, httplib::Response &res);
-void handle_get_activities(const httplib::Request &req, httplib::Response &res);
+std::string handle_post_activity(const EndpointContext &ctx);
+std::string handle_like_activity(const EndpointContext &ctx, int64_t created_at_time);
+std::string handle_unlike_activity(const EndpointContext &ctx, int64_t created_at_time);
+std::string handle_comment_activity(const EndpointContext &ctx);
+std::string handle_uncomment_activity(const EndpointContext &ctx, int64_t created_at_time, int64_t comment_created_at_time);
+std::string handle_delete_activity(const EndpointContext &ctx, int64_t created_at_time);
+std::string handle_get_activities(const EndpointContext &ctx, std::string target_online_id, const std::string &language);
+std::string handle_get_activity_likes(const EndpointContext &ctx, int64_t created_at_time, std::optional<size_t> limit_param, std::optional<std::string_view> cursor_param);
+std::string handle_get_activity_comments(const EndpointContext &ctx, int64_t created_at_time, std::optional<size_t> limit_param, std::optional<std::string_view> cursor_param);
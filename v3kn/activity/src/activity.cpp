@@ -4,6 +4,8 @@
 #include <account/account.h>
 #include <activity/activity.h>
 #include <friend/friend.h>
+#include <stats/stats.h>
+#include <utils/endpoint.h>
 #include <utils/utils.h>
 
 #include <ctime>
@@ -33,7 +35,7 @@ void migrate_activities_created_at_to_milliseconds() {
             continue;
 
         const std::string online_id = user["online_id"].get<std::string>();
-        const fs::path activities_path{ fs::path("v3kn") / "Users" / online_id / "activities.json" };
+        const fs::path activities_path{ get_user_dir(online_id) / "activities.json" };
         if (!fs::exists(activities_path))
             continue;
 
@@ -78,8 +80,7 @@ void migrate_activities_created_at_to_milliseconds() {
         if (!modified)
             continue;
 
-        std::ofstream out(activities_path);
-        out << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
         log("Migrated activity created_at timestamps to milliseconds for online ID " + online_id + " (account ID " + account_id + ")");
     }
 }
@@ -189,7 +190,7 @@ static void queue_friend_activity_comment_notifications(const std::string &activ
 }
 
 static void append_activity(const std::string &online_id, const json &activity) {
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(online_id) / "activities.json" };
     {
         json activities;
         std::lock_guard<std::mutex> activities_lock(activities_mutex);
@@ -215,8 +216,7 @@ static void append_activity(const std::string &online_id, const json &activity)
         }
 
         // Save file
-        std::ofstream f(activities_path);
-        f << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
     }
 
     // Update profile timestamp
@@ -260,38 +260,145 @@ void create_friendship_established_activity(const std::string &account_id1, cons
     }
 }
 
-void register_activity_endpoints(httplib::Server &server) {
-    server.Post("/v3kn/activity/post", handle_post_activity);
-    server.Post("/v3kn/activity/like", handle_like_activity);
-    server.Post("/v3kn/activity/unlike", handle_unlike_activity);
-    server.Post("/v3kn/activity/comment", handle_comment_activity);
-    server.Post("/v3kn/activity/uncomment", handle_uncomment_activity);
-    server.Post("/v3kn/activity/delete", handle_delete_activity);
-
-    server.Get("/v3kn/activity/get", handle_get_activities);
+// Number of likers resolved per activity in summary mode
+static constexpr size_t ACTIVITY_SUMMARY_LIKERS = 3;
+static constexpr size_t DEFAULT_ACTIVITY_DETAILS_PAGE = 20;
+static constexpr size_t MAX_ACTIVITY_DETAILS_PAGE = 100;
+
+// Helper: Resolve the like account IDs to online IDs, falls back to the account ID for unknown accounts
+static std::string resolve_like_online_id(const std::string &like_account_id) {
+    const std::string like_online_id = get_online_id_from_account_id(like_account_id);
+    return like_online_id.empty() ? like_account_id : like_online_id;
 }
 
-void handle_post_activity(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+// Helper: Copy of a comment with its account_id replaced by the online_id of the author
+static json resolve_comment_entry(const json &comment) {
+    json comment_entry = comment;
+    if (comment_entry.contains("account_id") && comment_entry["account_id"].is_string()) {
+        const std::string comment_online_id = get_online_id_from_account_id(comment_entry["account_id"].get<std::string>());
+        if (!comment_online_id.empty()) {
+            comment_entry.erase("account_id");
+            comment_entry["online_id"] = comment_online_id;
+        }
+    }
+    return comment_entry;
+}
 
-    std::string err;
-    const auto account = get_valid_account(req, "post activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
+// Helper: Replace the likes and comments of an activity entry by their counts, the caller like state and the first likers
+static void fill_activity_summary(json &entry, const json &activity, const std::string &account_id) {
+    size_t like_count = 0;
+    bool liked_by_me = false;
+    json first_likes = json::array();
+    if (activity.contains("likes") && activity["likes"].is_array()) {
+        for (const auto &like : activity["likes"]) {
+            if (!like.is_string())
+                continue;
+
+            const std::string &like_account_id = like.get_ref<const std::string &>();
+            if (like_account_id == account_id)
+                liked_by_me = true;
+            if (first_likes.size() < ACTIVITY_SUMMARY_LIKERS)
+                first_likes.push_back(resolve_like_online_id(like_account_id));
+            ++like_count;
+        }
+    }
+
+    size_t comment_count = 0;
+    if (activity.contains("comments") && activity["comments"].is_array()) {
+        comment_count = std::count_if(activity["comments"].begin(), activity["comments"].end(),
+            [](const json &comment) { return comment.is_object(); });
+    }
+
+    entry.erase("likes");
+    entry.erase("comments");
+    entry["like_count"] = like_count;
+    entry["liked_by_me"] = liked_by_me;
+    entry["first_likes"] = first_likes;
+    entry["comment_count"] = comment_count;
+}
+
+// Helper: Validate the target of the activity details endpoints and load the activity
+static std::optional<json> get_activity_details_request(const EndpointContext &ctx, const std::string &request, int64_t created_at_time, std::string &err) {
+    const std::string &online_id = ctx.account.online_id;
+    const auto target_account = get_valid_target_account(ctx.req, request + " target", err, online_id);
+    if (!target_account)
+        return std::nullopt;
+
+    const std::string &target_online_id = target_account->online_id;
+
+    const fs::path activities_path{ get_user_dir(target_online_id) / "activities.json" };
+    json activities;
+    {
+        std::lock_guard<std::mutex> activities_lock(activities_mutex);
+        if (!fs::exists(activities_path)) {
+            log("online ID " + online_id + " try to get " + request + " for online ID " + target_online_id + " but no activities found");
+            err = "ERR:NoActivities";
+            return std::nullopt;
+        }
+
+        std::ifstream f(activities_path);
+        f >> activities;
     }
 
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+    if (!activities.contains("activities") || !activities["activities"].is_array()) {
+        err = "ERR:NoActivities";
+        return std::nullopt;
+    }
+
+    for (auto &activity : activities["activities"]) {
+        if (activity.value("created_at", int64_t{ 0 }) == created_at_time)
+            return std::move(activity);
+    }
+
+    log("online ID " + online_id + " try to get " + request + " for online ID " + target_online_id + " but no matching activity found");
+    err = "ERR:ActivityNotFound";
+    return std::nullopt;
+}
+
+static constexpr bool is_activity_details_page(size_t limit) {
+    return limit > 0 && limit <= MAX_ACTIVITY_DETAILS_PAGE;
+}
+
+// Activity endpoints
+using CreatedAtParam = RequiredParam<"created_at", int64_t, "CreatedAt", is_positive>;
+using PostActivity = Endpoint<"/v3kn/activity/post", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using LikeActivity = Endpoint<"/v3kn/activity/like", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text, CreatedAtParam>;
+using UnlikeActivity = Endpoint<"/v3kn/activity/unlike", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text, CreatedAtParam>;
+using CommentActivity = Endpoint<"/v3kn/activity/comment", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using UncommentActivity = Endpoint<"/v3kn/activity/uncomment", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text,
+    CreatedAtParam, RequiredParam<"comment_created_at", int64_t, "CommentCreatedAt", is_positive>>;
+using DeleteActivity = Endpoint<"/v3kn/activity/delete", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text, CreatedAtParam>;
+using GetActivities = Endpoint<"/v3kn/activity/get", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json,
+    RequiredParam<"online_id", std::string, "TargetOnlineID">, RequiredParam<"sys_lang", std::string, "Language">>;
+using GetActivityLikes = Endpoint<"/v3kn/activity/likes", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json,
+    CreatedAtParam, OptionalParam<"limit", size_t, "Limit", is_activity_details_page>, OptionalParam<"cursor", std::string_view, "Cursor">>;
+using GetActivityComments = Endpoint<"/v3kn/activity/comments", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json,
+    CreatedAtParam, OptionalParam<"limit", size_t, "Limit", is_activity_details_page>, OptionalParam<"cursor", std::string_view, "Cursor">>;
+
+void register_activity_endpoints(httplib::Server &server) {
+    PostActivity::register_handler<handle_post_activity>(server);
+    LikeActivity::register_handler<handle_like_activity>(server);
+    UnlikeActivity::register_handler<handle_unlike_activity>(server);
+    CommentActivity::register_handler<handle_comment_activity>(server);
+    UncommentActivity::register_handler<handle_uncomment_activity>(server);
+    DeleteActivity::register_handler<handle_delete_activity>(server);
+
+    GetActivities::register_handler<handle_get_activities>(server);
+    GetActivityLikes::register_handler<handle_get_activity_likes>(server);
+    GetActivityComments::register_handler<handle_get_activity_comments>(server);
+}
+
+std::string handle_post_activity(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Parse JSON
     json payload;
     try {
-        payload = json::parse(req.body);
+        payload = json::parse(ctx.req.body);
     } catch (...) {
         log("online ID " + online_id + " try to post activity with invalid JSON");
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     payload.erase("online_id");
@@ -299,51 +406,33 @@ void handle_post_activity(const httplib::Request &req, httplib::Response &res) {
 
     // Post activity
     append_activity(online_id, payload);
+    add_daily_stat("activities_posted");
 
     // Respond
-    res.set_content("OK:ActivityPosted", "text/plain");
+    return "OK:ActivityPosted";
 }
 
-void handle_like_activity(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_like_activity(const EndpointContext &ctx, int64_t created_at_time) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "like activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "like activity target", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "like activity target", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_online_id = target_account->online_id;
     const std::string &target_account_id = target_account->account_id;
 
-    const auto created_at = req.get_param_value("created_at");
-    if (created_at.empty()) {
-        log("online_id " + online_id + " try to like activity with missing created_at");
-        res.set_content("ERR:MissingCreatedAt", "text/plain");
-        return;
-    }
-
-    const int64_t created_at_time = std::stoll(created_at);
-
     // Load activities.json
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / target_online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(target_online_id) / "activities.json" };
     json activities;
     {
         std::lock_guard<std::mutex> activities_lock(activities_mutex);
         if (!fs::exists(activities_path)) {
             log("online ID " + online_id + " try to like activity for online ID " + target_online_id + " but no activities found");
-            res.set_content("ERR:NoActivities", "text/plain");
-            return;
+            return "ERR:NoActivities";
         } else {
             std::ifstream f(activities_path);
             f >> activities;
@@ -356,8 +445,7 @@ void handle_like_activity(const httplib::Request &req, httplib::Response &res) {
             });
         if (it == activities["activities"].end()) {
             log("online ID " + online_id + " try to like activity for online ID " + target_online_id + " but no matching activity found");
-            res.set_content("ERR:ActivityNotFound", "text/plain");
-            return;
+            return "ERR:ActivityNotFound";
         }
 
         auto &likes = (*it)["likes"];
@@ -365,8 +453,7 @@ void handle_like_activity(const httplib::Request &req, httplib::Response &res) {
         // Check if already has 100 likes
         if (likes.size() >= 100) {
             log("online_id " + online_id + " try to like activity for online_id " + target_online_id + " but already has 100 likes");
-            res.set_content("ERR:MaxLikesReached", "text/plain");
-            return;
+            return "ERR:MaxLikesReached";
         }
 
         // Add like if not already liked
@@ -374,13 +461,11 @@ void handle_like_activity(const httplib::Request &req, httplib::Response &res) {
             likes.push_back(account_id);
         } else {
             log("online ID " + online_id + " try to like activity for online ID " + target_online_id + " but already liked");
-            res.set_content("ERR:AlreadyLiked", "text/plain");
-            return;
+            return "ERR:AlreadyLiked";
         }
 
         // Save updated activities.json
-        std::ofstream f(activities_path);
-        f << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
     }
 
     // Update profile timestamp
@@ -389,47 +474,28 @@ void handle_like_activity(const httplib::Request &req, httplib::Response &res) {
     queue_activity_owner_notification(target_account_id, account_id, created_at_time, false);
 
     log("online ID " + online_id + " liked activity for online ID " + target_online_id);
-    res.set_content("OK:Liked", "text/plain");
+    return "OK:Liked";
 }
 
-void handle_unlike_activity(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_unlike_activity(const EndpointContext &ctx, int64_t created_at_time) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "unlike activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "unlike activity target", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "unlike activity target", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
     const std::string &target_online_id = target_account->online_id;
 
-    const std::string created_at = req.get_param_value("created_at");
-    if (created_at.empty()) {
-        log("online ID " + online_id + " try to unlike activity with missing created_at");
-        res.set_content("ERR:MissingCreatedAt", "text/plain");
-        return;
-    }
-
-    const int64_t created_at_time = std::stoll(created_at);
-
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / target_online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(target_online_id) / "activities.json" };
     json activities;
 
     if (!fs::exists(activities_path)) {
         log("online ID " + online_id + " try to unlike activity for online ID " + target_online_id + " but no activities found");
-        res.set_content("ERR:NoActivities", "text/plain");
-        return;
+        return "ERR:NoActivities";
     }
 
     {
@@ -444,8 +510,7 @@ void handle_unlike_activity(const httplib::Request &req, httplib::Response &res)
 
         if (it == activities["activities"].end()) {
             log("online ID " + online_id + " try to unlike activity for online ID " + target_online_id + " but no matching activity found");
-            res.set_content("ERR:ActivityNotFound", "text/plain");
-            return;
+            return "ERR:ActivityNotFound";
         }
 
         auto &likes = (*it)["likes"];
@@ -453,104 +518,85 @@ void handle_unlike_activity(const httplib::Request &req, httplib::Response &res)
 
         if (like_it == likes.end()) {
             log("online ID " + online_id + " try to unlike activity for online ID " + target_online_id + " but activity not liked");
-            res.set_content("ERR:NotLiked", "text/plain");
-            return;
+            return "ERR:NotLiked";
         }
 
         likes.erase(like_it);
 
-        std::ofstream out(activities_path);
-        out << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
     }
 
     // Update profile timestamp
     update_profile_timestamp(target_online_id);
 
     log("online ID " + online_id + " unliked activity for online ID " + target_online_id);
-    res.set_content("OK:Unliked", "text/plain");
+    return "OK:Unliked";
 }
 
-void handle_comment_activity(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-    std::string err;
-    const auto account = get_valid_account(req, "comment activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_comment_activity(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     json payload;
     try {
-        payload = json::parse(req.body);
+        payload = json::parse(ctx.req.body);
     } catch (...) {
         log("online ID " + online_id + " try to comment activity with invalid JSON");
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     std::string target_online_id = payload.value("target_online_id", "");
     if (target_online_id.empty()) {
         log("online_id " + online_id + " try to comment activity with missing target online_id");
-        res.set_content("ERR:MissingTargetonline_id", "text/plain");
-        return;
+        return "ERR:MissingTargetonline_id";
     }
 
     const std::string target_account_id = get_account_id_from_online_id(target_online_id);
     if (target_account_id.empty()) {
         log("online ID " + online_id + " try to comment activity for non-existing online ID " + target_online_id);
-        res.set_content("ERR:TargetOnlineIDNotFound", "text/plain");
-        return;
+        return "ERR:TargetOnlineIDNotFound";
     }
 
     target_online_id = get_online_id_from_account_id(target_account_id);
     if (target_online_id.empty()) {
         log("online ID " + online_id + " try to comment activity for non-existing online ID " + target_online_id);
-        res.set_content("ERR:TargetOnlineIDNotFound", "text/plain");
-        return;
+        return "ERR:TargetOnlineIDNotFound";
     }
 
     const int64_t created_at = payload.value("created_at", int64_t{ 0 });
     if (created_at == 0) {
         log("online ID " + online_id + " try to comment activity with missing created_at");
-        res.set_content("ERR:MissingCreatedAt", "text/plain");
-        return;
+        return "ERR:MissingCreatedAt";
     }
 
     // Get comment from JSON and check if it's empty
     const auto comment = payload.value("comment", "");
     if (comment.empty()) {
         log("online ID " + online_id + " try to comment activity with missing comment");
-        res.set_content("ERR:MissingComment", "text/plain");
-        return;
+        return "ERR:MissingComment";
     }
 
     // Check comment length (max 140 characters)
     if (comment.size() > 140) {
         log("online ID " + online_id + " try to comment activity with comment exceeding 140 characters");
-        res.set_content("ERR:CommentTooLong", "text/plain");
-        return;
+        return "ERR:CommentTooLong";
     }
 
     // Check comment newlines (max 5 lines)
     const size_t newline_count = std::count(comment.begin(), comment.end(), '\n');
     if (newline_count > 4) {
         log("online ID " + online_id + " try to comment activity with comment exceeding 5 lines");
-        res.set_content("ERR:TooManyNewlines", "text/plain");
-        return;
+        return "ERR:TooManyNewlines";
     }
 
     // Load activities.json
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / target_online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(target_online_id) / "activities.json" };
     json activities;
     {
         std::lock_guard<std::mutex> activities_lock(activities_mutex);
         if (!fs::exists(activities_path)) {
             log("online ID " + online_id + " try to comment activity for online ID " + target_online_id + " but no activities found");
-            res.set_content("ERR:NoActivities", "text/plain");
-            return;
+            return "ERR:NoActivities";
         } else {
             std::ifstream f(activities_path);
             f >> activities;
@@ -563,8 +609,7 @@ void handle_comment_activity(const httplib::Request &req, httplib::Response &res
             });
         if (it == activities["activities"].end()) {
             log("online_id " + online_id + " try to comment activity for online_id " + target_online_id + " but no matching activity found");
-            res.set_content("ERR:ActivityNotFound", "text/plain");
-            return;
+            return "ERR:ActivityNotFound";
         }
 
         // Add comment to activity
@@ -573,8 +618,7 @@ void handle_comment_activity(const httplib::Request &req, httplib::Response &res
         // Limit to 20 comments per activity
         if (comments.size() >= 20) {
             log("online ID " + online_id + " try to comment activity for online ID " + target_online_id + " but already has 20 comments");
-            res.set_content("ERR:TooManyComments", "text/plain");
-            return;
+            return "ERR:TooManyComments";
         }
 
         // Add comment
@@ -586,8 +630,7 @@ void handle_comment_activity(const httplib::Request &req, httplib::Response &res
         comments.push_back(comment_entry);
 
         // Save updated activities.json
-        std::ofstream f(activities_path);
-        f << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
     }
 
     // Update profile timestamp
@@ -597,57 +640,28 @@ void handle_comment_activity(const httplib::Request &req, httplib::Response &res
     queue_friend_activity_comment_notifications(target_account_id, target_online_id, account_id, created_at);
 
     log("online ID " + online_id + " commented activity for online ID " + target_online_id);
-    res.set_content("OK:CommentAdded", "text/plain");
+    return "OK:CommentAdded";
 }
 
-void handle_uncomment_activity(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-    std::string err;
-    const auto account = get_valid_account(req, "uncomment activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_uncomment_activity(const EndpointContext &ctx, int64_t created_at_time, int64_t comment_created_at_time) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Get target online ID from parameters
-    const auto target_account = get_valid_target_account(req, "uncomment activity target", err, online_id);
+    std::string err;
+    const auto target_account = get_valid_target_account(ctx.req, "uncomment activity target", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
     const std::string &target_online_id = target_account->online_id;
 
-    // Get created_at from parameters
-    const std::string created_at = req.get_param_value("created_at");
-    if (created_at.empty()) {
-        log("online ID " + online_id + " try to uncomment activity with missing created_at");
-        res.set_content("ERR:MissingCreatedAt", "text/plain");
-        return;
-    }
-
-    const int64_t created_at_time = std::stoll(created_at);
-
-    // Get comment_created_at from parameters
-    const std::string comment_created_at = req.get_param_value("comment_created_at");
-    if (comment_created_at.empty()) {
-        log("online ID " + online_id + " try to uncomment activity with missing comment_created_at");
-        res.set_content("ERR:MissingCommentCreatedAt", "text/plain");
-        return;
-    }
-
-    const int64_t comment_created_at_time = std::stoll(comment_created_at);
-
     // Load activities.json
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / target_online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(target_online_id) / "activities.json" };
     if (!fs::exists(activities_path)) {
         log("online ID " + online_id + " try to uncomment activity for online ID " + target_online_id + " but no activities found");
-        res.set_content("ERR:NoActivities", "text/plain");
-        return;
+        return "ERR:NoActivities";
     }
 
     // Find activity and comment
@@ -665,8 +679,7 @@ void handle_uncomment_activity(const httplib::Request &req, httplib::Response &r
         // Check if activity exists
         if (it == activities["activities"].end()) {
             log("online ID " + online_id + " try to uncomment activity for online ID " + target_online_id + " but no matching activity found");
-            res.set_content("ERR:ActivityNotFound", "text/plain");
-            return;
+            return "ERR:ActivityNotFound";
         }
 
         // Find comment by comment_created_at timestamp
@@ -678,65 +691,42 @@ void handle_uncomment_activity(const httplib::Request &req, httplib::Response &r
 
         if (comment_it == comments.end()) {
             log("online ID " + online_id + " try to uncomment activity for online ID " + target_online_id + " but no matching comment found");
-            res.set_content("ERR:CommentNotFound", "text/plain");
-            return;
+            return "ERR:CommentNotFound";
         }
 
         // Check if the comment author is the same as the requester or if the requester is the owner of the activity
         if (!(*comment_it).contains("account_id")) {
             log("online ID " + online_id + " try to uncomment activity for online ID " + target_online_id + " but comment has no account ID");
-            res.set_content("ERR:CommentAuthorNotFound", "text/plain");
-            return;
+            return "ERR:CommentAuthorNotFound";
         }
 
         const std::string author = (*comment_it)["account_id"].get<std::string>();
         if ((author != account_id) && (account_id != target_account_id)) {
             log("online ID " + online_id + " try to delete comment for online ID " + target_online_id + " but not allowed to delete this comment");
-            res.set_content("ERR:NotAllowed", "text/plain");
-            return;
+            return "ERR:NotAllowed";
         }
 
         // Remove comment
         comments.erase(comment_it);
-        std::ofstream out(activities_path);
-        out << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
     }
 
     // Update profile timestamp
     update_profile_timestamp(target_online_id);
 
     log("online_id " + online_id + " uncommented activity for online_id " + target_online_id);
-    res.set_content("OK:Uncommented", "text/plain");
+    return "OK:Uncommented";
 }
 
-void handle_delete_activity(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-    std::string err;
-    const auto account = get_valid_account(req, "delete activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    // Get created_at from parameters
-    const std::string created_at = req.get_param_value("created_at");
-    if (created_at.empty()) {
-        log("online ID " + online_id + " try to delete activity with missing created_at");
-        res.set_content("ERR:MissingCreatedAt", "text/plain");
-        return;
-    }
-
-    const int64_t created_at_time = std::stoll(created_at);
+std::string handle_delete_activity(const EndpointContext &ctx, int64_t created_at_time) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Load activities.json
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(online_id) / "activities.json" };
     if (!fs::exists(activities_path)) {
         log("online_id " + online_id + " try to delete activity but no activities found");
-        res.set_content("ERR:NoActivities", "text/plain");
-        return;
+        return "ERR:NoActivities";
     }
 
     // Find activity by created_at timestamp and delete it
@@ -752,69 +742,39 @@ void handle_delete_activity(const httplib::Request &req, httplib::Response &res)
             });
         if (it == activities["activities"].end()) {
             log("online ID " + online_id + " try to delete activity but no matching activity found");
-            res.set_content("ERR:ActivityNotFound", "text/plain");
-            return;
+            return "ERR:ActivityNotFound";
         }
 
         // Remove activity
         activities["activities"].erase(it);
-        std::ofstream out(activities_path);
-        out << activities.dump(2);
+        write_file_atomic(activities_path, activities.dump(2));
     }
 
     log("online ID " + online_id + " deleted an activity");
-    res.set_content("OK:Deleted", "text/plain");
+    return "OK:Deleted";
 }
 
-void handle_get_activities(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "get activity", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    // Get target online_id from parameters
-    std::string target_online_id = req.get_param_value("online_id");
-    if (target_online_id.empty()) {
-        log("Online ID " + online_id + " try to get activities with missing target online ID");
-        res.set_content("ERR:MissingTargetOnlineID", "text/plain");
-        return;
-    }
+std::string handle_get_activities(const EndpointContext &ctx, std::string target_online_id, const std::string &language) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     const std::string target_account_id = get_account_id_from_online_id(target_online_id);
     if (target_account_id.empty()) {
         log("Online ID " + online_id + " try to get activities for non-existing online ID " + target_online_id);
-        res.set_content("ERR:TargetOnlineIDNotFound", "text/plain");
-        return;
+        return "ERR:TargetOnlineIDNotFound";
     }
 
     target_online_id = get_online_id_from_account_id(target_account_id);
     if (target_online_id.empty()) {
         log("Online ID " + online_id + " try to get activities for non-existing online ID " + target_online_id);
-        res.set_content("ERR:TargetOnlineIDNotFound", "text/plain");
-        return;
-    }
-
-    // Get language from parameters
-    const auto language = req.get_param_value("sys_lang");
-    if (language.empty()) {
-        log("Online ID " + online_id + " try to get activities with missing language");
-        res.set_content("ERR:MissingLanguage", "text/plain");
-        return;
+        return "ERR:TargetOnlineIDNotFound";
     }
 
     // Load activities.json
-    const fs::path activities_path{ fs::path("v3kn") / "Users" / target_online_id / "activities.json" };
+    const fs::path activities_path{ get_user_dir(target_online_id) / "activities.json" };
     if (!fs::exists(activities_path)) {
         log("Online ID " + online_id + " try to get activities for online ID " + target_online_id + " but no activities found");
-        res.set_content("ERR:NoActivities", "text/plain");
-        return;
+        return "ERR:NoActivities";
     }
 
     // Lock activities.json while reading
@@ -825,6 +785,8 @@ void handle_get_activities(const httplib::Request &req, httplib::Response &res)
         f >> activities;
     }
 
+    const bool summary = get_param_view(ctx.req, "summary") == "1";
+
     // Create a copy of activities and enrich game activities with information from server database (title name, etc..)
     json result_activities;
     result_activities["activities"] = json::array();
@@ -847,33 +809,24 @@ void handle_get_activities(const httplib::Request &req, httplib::Response &res)
             entry.erase("friend_account_id");
             entry["friend_online_id"] = friend_online_id;
         }
-        if (activity.contains("likes") && activity["likes"].is_array()) {
+        if (summary) {
+            // Summary mode: counts and the first likers only, full lists are served by /v3kn/activity/likes and /v3kn/activity/comments
+            fill_activity_summary(entry, activity, account_id);
+        } else if (activity.contains("likes") && activity["likes"].is_array()) {
             json likes = json::array();
             for (const auto &like : activity["likes"]) {
                 if (!like.is_string())
                     continue;
 
-                const std::string like_account_id = like.get<std::string>();
-                const std::string like_online_id = get_online_id_from_account_id(like_account_id);
-                likes.push_back(like_online_id.empty() ? like_account_id : like_online_id);
+                likes.push_back(resolve_like_online_id(like.get<std::string>()));
             }
             entry["likes"] = likes;
         }
-        if (activity.contains("comments") && activity["comments"].is_array()) {
+        if (!summary && activity.contains("comments") && activity["comments"].is_array()) {
             json comments = json::array();
             for (const auto &comment : activity["comments"]) {
-                if (!comment.is_object())
-                    continue;
-
-                json comment_entry = comment;
-                if (comment_entry.contains("account_id") && comment_entry["account_id"].is_string()) {
-                    const std::string comment_online_id = get_online_id_from_account_id(comment_entry["account_id"].get<std::string>());
-                    if (!comment_online_id.empty()) {
-                        comment_entry.erase("account_id");
-                        comment_entry["online_id"] = comment_online_id;
-                    }
-                }
-                comments.push_back(comment_entry);
+                if (comment.is_object())
+                    comments.push_back(resolve_comment_entry(comment));
             }
             entry["comments"] = comments;
         }
@@ -884,5 +837,101 @@ void handle_get_activities(const httplib::Request &req, httplib::Response &res)
     }
 
     log("Activities retrieved by online ID " + online_id + " for online ID " + target_online_id);
-    res.set_content(result_activities.dump(), "application/json");
+    return result_activities.dump();
+}
+
+std::string handle_get_activity_likes(const EndpointContext &ctx, int64_t created_at_time, std::optional<size_t> limit_param, std::optional<std::string_view> cursor_param) {
+    const std::string &online_id = ctx.account.online_id;
+
+    std::string err;
+    const auto activity = get_activity_details_request(ctx, "activity likes", created_at_time, err);
+    if (!activity) {
+        return err;
+    }
+
+    const size_t limit = limit_param.value_or(DEFAULT_ACTIVITY_DETAILS_PAGE);
+    const std::string_view cursor = cursor_param.value_or(std::string_view{});
+
+    // Likes are kept in like order, the cursor is the offset of the next page
+    std::vector<std::string> like_account_ids;
+    if (activity->contains("likes") && (*activity)["likes"].is_array()) {
+        for (const auto &like : (*activity)["likes"]) {
+            if (like.is_string())
+                like_account_ids.push_back(like.get<std::string>());
+        }
+    }
+
+    size_t begin = 0;
+    if (!cursor.empty()) {
+        const auto offset = parse_number<size_t>(cursor);
+        if (!offset) {
+            log("online ID " + online_id + " try to get activity likes with invalid cursor");
+            return "ERR:InvalidCursor";
+        }
+        begin = std::min(*offset, like_account_ids.size());
+    }
+    const size_t end = begin + std::min(limit, like_account_ids.size() - begin);
+
+    // Only the likes of the page are resolved
+    json response;
+    response["likes"] = json::array();
+    for (size_t i = begin; i < end; ++i)
+        response["likes"].push_back(resolve_like_online_id(like_account_ids[i]));
+    response["total"] = like_account_ids.size();
+    if (end < like_account_ids.size())
+        response["next_cursor"] = std::to_string(end);
+
+    return response.dump();
+}
+
+std::string handle_get_activity_comments(const EndpointContext &ctx, int64_t created_at_time, std::optional<size_t> limit_param, std::optional<std::string_view> cursor_param) {
+    const std::string &online_id = ctx.account.online_id;
+
+    std::string err;
+    const auto activity = get_activity_details_request(ctx, "activity comments", created_at_time, err);
+    if (!activity) {
+        return err;
+    }
+
+    const size_t limit = limit_param.value_or(DEFAULT_ACTIVITY_DETAILS_PAGE);
+    const std::string_view cursor = cursor_param.value_or(std::string_view{});
+
+    // Comments are kept in posting order, the cursor is the created_at of the last comment returned
+    // so that removed comments do not shift the following pages
+    const auto cursor_time = parse_number<int64_t>(cursor);
+    if (!cursor.empty() && !cursor_time) {
+        log("online ID " + online_id + " try to get activity comments with invalid cursor");
+        return "ERR:InvalidCursor";
+    }
+
+    json response;
+    response["comments"] = json::array();
+    size_t total = 0;
+    int64_t last_created_at = 0;
+    bool has_more = false;
+    if (activity->contains("comments") && (*activity)["comments"].is_array()) {
+        for (const auto &comment : (*activity)["comments"]) {
+            if (!comment.is_object())
+                continue;
+
+            ++total;
+            const int64_t comment_created_at = comment.value("created_at", int64_t{ 0 });
+            if (cursor_time && comment_created_at <= *cursor_time)
+                continue;
+
+            if (response["comments"].size() >= limit) {
+                has_more = true;
+                continue;
+            }
+
+            // Only the comments of the page are resolved
+            response["comments"].push_back(resolve_comment_entry(comment));
+            last_created_at = comment_created_at;
+        }
+    }
+    response["total"] = total;
+    if (has_more)
+        response["next_cursor"] = std::to_string(last_created_at);
+
+    return response.dump();
 }
@@ -0,0 +1,14 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <httplib.h>
+#include <utils/endpoint.h>
+
+#include <string>
+
+void register_admin_endpoints(httplib::Server &server);
+
+std::string handle_admin_memory(const EndpointContext &ctx);
+std::string handle_admin_metrics(const EndpointContext &ctx);
@@ -0,0 +1,86 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#include "admin/admin.h"
+#include "utils/endpoint.h"
+#include "utils/utils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#include <unistd.h>
+#endif
+
+using AdminMemory = Endpoint<"/v3kn/admin/memory", EndpointMethod::Get, EndpointAuth::Admin, EndpointLock::None, EndpointResponse::Json>;
+using AdminMetrics = Endpoint<"/v3kn/admin/metrics", EndpointMethod::Get, EndpointAuth::Admin, EndpointLock::None, EndpointResponse::Json>;
+
+void register_admin_endpoints(httplib::Server &server) {
+    AdminMemory::register_handler<handle_admin_memory>(server);
+    AdminMetrics::register_handler<handle_admin_metrics>(server);
+}
+
+// Helper: Allocator and process statistics, only available with glibc
+static json get_heap_stats() {
+    json heap = json::object();
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    const struct mallinfo2 info = mallinfo2();
+#else
+    const struct mallinfo info = mallinfo();
+#endif
+    heap["arena_bytes"] = static_cast<uint64_t>(info.arena);
+    heap["mmap_bytes"] = static_cast<uint64_t>(info.hblkhd);
+    heap["in_use_bytes"] = static_cast<uint64_t>(info.uordblks);
+    heap["free_bytes"] = static_cast<uint64_t>(info.fordblks);
+    heap["releasable_bytes"] = static_cast<uint64_t>(info.keepcost);
+
+    // Resident set size from /proc, in pages
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size_pages = 0, resident_pages = 0;
+    if (statm >> size_pages >> resident_pages)
+        heap["rss_bytes"] = resident_pages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+    // Full per-arena report from the allocator
+    char *buffer = nullptr;
+    size_t buffer_size = 0;
+    if (FILE *stream = open_memstream(&buffer, &buffer_size)) {
+        if (malloc_info(0, stream) == 0) {
+            fflush(stream);
+            heap["malloc_info"] = std::string(buffer, buffer_size);
+        }
+        fclose(stream);
+        free(buffer);
+    }
+#else
+    heap["unavailable"] = true;
+#endif
+    return heap;
+}
+
+std::string handle_admin_memory(const EndpointContext &ctx) {
+    // Optionally run the budget enforcement right away instead of waiting for the monitor
+    if (get_param_view(ctx.req, "enforce") == "1")
+        enforce_memory_budget();
+
+    json report = get_memory_usage_report();
+    report["heap"] = get_heap_stats();
+
+    // Optionally give the free heap memory back to the system
+    if (get_param_view(ctx.req, "trim") == "1") {
+#ifdef __GLIBC__
+        report["trimmed"] = malloc_trim(0) == 1;
+        report["heap_after_trim"] = get_heap_stats();
+#else
+        report["trimmed"] = false;
+#endif
+    }
+
+    return report.dump();
+}
+
+std::string handle_admin_metrics(const EndpointContext &ctx) {
+    return get_metrics_snapshot().dump();
+}
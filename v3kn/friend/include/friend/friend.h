@@ -5,23 +5,33 @@
 
 #include <httplib.h>
 #include <nlohmann/json.hpp>
+#include <utils/endpoint.h>
 
+#include <optional>
 #include <string>
 
 void register_friends_endpoints(httplib::Server &server);
 
 nlohmann::json load_friends(const std::string &online_id, const std::string &group);
 void notify_friend_poll_for_account(const std::string &account_id);
+void purge_account_friend_links(const std::string &account_id, const std::string &online_id);
+void warm_friend_caches(const std::string &account_id, const std::string &online_id);
+void drop_presence_session(const std::string &account_id);
+void end_account_presence(const std::string &account_id, const std::string &online_id);
 
-void handle_friend_add(const httplib::Request &req, httplib::Response &res);
-void handle_friend_accept(const httplib::Request &req, httplib::Response &res);
-void handle_friend_reject(const httplib::Request &req, httplib::Response &res);
-void handle_friend_remove(const httplib::Request &req, httplib::Response &res);
-void handle_friend_cancel(const httplib::Request &req, httplib::Response &res);
-void handle_friend_block(const httplib::Request &req, httplib::Response &res);
-void handle_friend_unblock(const httplib::Request &req, httplib::Response &res);
-void handle_friend_list(const httplib::Request &req, httplib::Response &res);
-void handle_friend_profile(const httplib::Request &req, httplib::Response &res);
-void handle_friend_poll(const httplib::Request &req, httplib::Response &res);
-void handle_friend_presence(const httplib::Request &req, httplib::Response &res);
-void handle_friend_search(const httplib::Request &req, httplib::Response &res);
+std::string handle_friend_add(const EndpointContext &ctx);
+std::string handle_friend_accept(const EndpointContext &ctx);
+std::string handle_friend_reject(const EndpointContext &ctx);
+std::string handle_friend_remove(const EndpointContext &ctx);
+std::string handle_friend_cancel(const EndpointContext &ctx);
+std::string handle_friend_block(const EndpointContext &ctx);
+std::string handle_friend_unblock(const EndpointContext &ctx);
+std::string handle_friend_list(const EndpointContext &ctx, const std::string &group, const std::string &language);
+std::string handle_friend_profile(const EndpointContext &ctx, const std::string &language);
+std::string handle_friend_poll(const EndpointContext &ctx, std::optional<int64_t> since);
+std::string handle_friend_presence(const EndpointContext &ctx, const std::string &status, const std::optional<std::string> &now_playing);
+std::string handle_friend_presence_key(const EndpointContext &ctx);
+std::string handle_friend_search(const EndpointContext &ctx);
+std::string handle_friend_suggestions(const EndpointContext &ctx, std::optional<size_t> limit_param);
+std::string handle_friend_top_titles(const EndpointContext &ctx, const std::string &language, std::optional<size_t> limit_param);
+std::string handle_top_titles(const EndpointContext &ctx, const std::string &language, std::optional<size_t> limit_param);
@@ -3,17 +3,31 @@
 
 #include <activity/activity.h>
 #include <friend/friend.h>
+#include <utils/params.h>
 #include <utils/utils.h>
 
 #include <algorithm>
 #include <array>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <memory>
+#include <optional>
+#include <set>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 #include "pugixml.hpp"
 
 // In-memory online status: account_id -> last presence timestamp (not persisted to disk)
@@ -23,12 +37,69 @@ static std::unordered_map<std::string, std::string> online_now_playing; // accou
 static std::unordered_map<std::string, std::string> presence_status; // account_id -> online/offline/not_available
 static std::unordered_set<std::string> pending_online_poll; // account_id -> waiting to poll on online
 static std::unordered_map<std::string, std::vector<json>> pending_friend_status_events; // account_id -> in-memory only status poll events
+constexpr size_t MAX_PENDING_FRIEND_STATUS_EVENTS = 100; // Per account, one event per friend at most
 static std::mutex online_users_mutex;
+
+// Now playing popularity: online players per title ID, kept in sync with online_now_playing so the top titles
+// never need a pass over online_users (online_users_mutex must be held)
+static std::unordered_map<std::string, size_t> now_playing_counts; // title ID -> online players
+static std::set<std::pair<size_t, std::string>, std::greater<>> now_playing_ranking; // (online players, title ID), most played first
+constexpr size_t MAX_TOP_TITLES = 50;
+
+// Presence ledger: last time each account was seen online, recorded on online -> offline transitions
+// and flushed in batches by the monitor thread to v3kn/presence.json
+static std::unordered_map<std::string, int64_t> last_seen; // account_id -> last online timestamp
+static bool last_seen_dirty = false;
+static std::mutex last_seen_mutex;
 static std::mutex pending_friend_status_events_mutex;
 static std::condition_variable online_monitor_cv;
 static std::atomic<bool> monitor_running{ true };
 json load_friends(const std::string &online_id, const std::string &group);
 static json load_friends_data(const std::string &online_id);
+static void register_friends_memory_consumers();
+static void start_udp_presence_listener();
+
+static void load_presence_ledger() {
+    std::ifstream f("v3kn/presence.json");
+    if (!f.is_open())
+        return;
+
+    try {
+        json data;
+        f >> data;
+        std::lock_guard<std::mutex> lock(last_seen_mutex);
+        for (const auto &[account_id, timestamp] : data.at("last_seen").items())
+            last_seen[account_id] = timestamp.get<int64_t>();
+        log("Loaded " + std::to_string(last_seen.size()) + " last seen times from the presence ledger");
+    } catch (...) {
+        log("Corrupted presence.json, last seen times will be rebuilt from new presence transitions");
+    }
+}
+
+static void record_last_seen(const std::string &account_id, int64_t timestamp) {
+    std::lock_guard<std::mutex> lock(last_seen_mutex);
+    last_seen[account_id] = timestamp;
+    last_seen_dirty = true;
+}
+
+static void flush_presence_ledger() {
+    json data;
+    {
+        std::lock_guard<std::mutex> lock(last_seen_mutex);
+        if (!last_seen_dirty)
+            return;
+
+        data["last_seen"] = last_seen;
+        last_seen_dirty = false;
+    }
+    write_file_atomic("v3kn/presence.json", data.dump());
+}
+
+static int64_t get_last_seen(const std::string &account_id) {
+    std::lock_guard<std::mutex> lock(last_seen_mutex);
+    const auto it = last_seen.find(account_id);
+    return it != last_seen.end() ? it->second : 0;
+}
 
 struct FriendPollSignal {
     std::condition_variable cv;
@@ -47,6 +118,7 @@ static std::shared_ptr<FriendPollSignal> get_friend_poll_signal(const std::strin
     return signal;
 }
 
+// Only the latest status per friend is kept, older ones carry no extra information for the client
 static void push_friend_status_event(const std::string &account_id, const std::string &target_account_id) {
     std::lock_guard<std::mutex> lock(pending_friend_status_events_mutex);
     json event;
@@ -54,7 +126,22 @@ static void push_friend_status_event(const std::string &account_id, const std::s
     event["group"] = "status_online";
     event["account_id"] = target_account_id;
     event["at"] = std::time(0);
-    pending_friend_status_events[account_id].push_back(event);
+
+    auto &events = pending_friend_status_events[account_id];
+    const auto existing = std::find_if(events.begin(), events.end(), [&target_account_id](const json &pending) {
+        return pending.value("account_id", "") == target_account_id;
+    });
+    if (existing != events.end()) {
+        events.erase(existing);
+        increment_metric("friend_status_events.coalesced");
+    }
+
+    if (events.size() >= MAX_PENDING_FRIEND_STATUS_EVENTS) {
+        events.erase(events.begin());
+        increment_metric("friend_status_events.dropped");
+    }
+
+    events.push_back(event);
 }
 
 static json pop_pending_friend_status_events(const std::string &account_id) {
@@ -126,11 +213,52 @@ struct FriendPollWaiter {
     }
 };
 
+// Helper: Move a title in the ranking after its player count changed (online_users_mutex must be held)
+static void adjust_now_playing_count(const std::string &titleid, int delta) {
+    if (titleid.empty())
+        return;
+
+    size_t &count = now_playing_counts[titleid];
+    if (count > 0)
+        now_playing_ranking.erase({ count, titleid });
+    count += delta;
+    if (count > 0)
+        now_playing_ranking.emplace(count, titleid);
+    else
+        now_playing_counts.erase(titleid);
+}
+
+// Helper: Update what an online account is playing (online_users_mutex must be held)
+static void set_now_playing(const std::string &account_id, const std::string &now_playing) {
+    auto [it, inserted] = online_now_playing.try_emplace(account_id);
+    if (!inserted) {
+        if (it->second == now_playing)
+            return;
+        adjust_now_playing_count(it->second, -1);
+    }
+
+    it->second = now_playing;
+    adjust_now_playing_count(now_playing, 1);
+}
+
+// Helper: Forget what an account was playing when it goes offline (online_users_mutex must be held)
+static void clear_now_playing(const std::string &account_id) {
+    auto it = online_now_playing.find(account_id);
+    if (it == online_now_playing.end())
+        return;
+
+    adjust_now_playing_count(it->second, -1);
+    online_now_playing.erase(it);
+}
+
 // Background thread that monitors online users and detects timeouts
 static void monitor_online_users() {
     const int64_t timeout_threshold = 30; // 30 seconds
 
     while (monitor_running) {
+        // Write the last seen times recorded since the previous pass in one batch
+        flush_presence_ledger();
+
         std::unique_lock<std::mutex> lock(online_users_mutex);
 
         // If no online users, wait indefinitely until someone comes online
@@ -154,7 +282,8 @@ static void monitor_online_users() {
             if ((now - last_presence) > timeout_threshold) {
                 const std::string account_id = it->first;
                 timed_out_users.push_back(account_id);
-                online_now_playing.erase(account_id);
+                record_last_seen(account_id, last_presence);
+                clear_now_playing(account_id);
                 presence_status.erase(account_id);
                 pending_online_poll.erase(account_id);
                 it = online_users.erase(it);
@@ -195,29 +324,63 @@ static void monitor_online_users() {
     }
 }
 
+// Targets are resolved by the handlers with get_valid_target_account. Presence, polls, search, suggestions and
+// top titles never took request_mutex, they use their own locks.
+using LanguageParam = RequiredParam<"sys_lang", std::string, "Language">;
+using LimitParam = OptionalParam<"limit", size_t, "Limit">;
+using FriendAdd = Endpoint<"/v3kn/friends/add", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendAccept = Endpoint<"/v3kn/friends/accept", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendReject = Endpoint<"/v3kn/friends/reject", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendRemove = Endpoint<"/v3kn/friends/remove", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendCancel = Endpoint<"/v3kn/friends/cancel", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendBlock = Endpoint<"/v3kn/friends/block", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendUnblock = Endpoint<"/v3kn/friends/unblock", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using FriendPresence = Endpoint<"/v3kn/friends/presence", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Text,
+    RequiredParam<"status", std::string, "Status">, OptionalParam<"now_playing", std::string, "NowPlaying">>;
+using FriendPresenceKey = Endpoint<"/v3kn/friends/presence_key", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Text>;
+using FriendList = Endpoint<"/v3kn/friends/list", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json,
+    RequiredParam<"group", std::string, "Group">, LanguageParam>;
+using FriendProfile = Endpoint<"/v3kn/friends/profile", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json, LanguageParam>;
+using FriendPoll = Endpoint<"/v3kn/friends/poll", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Json,
+    OptionalParam<"since", int64_t, "Timestamp">>;
+using FriendSearch = Endpoint<"/v3kn/friends/search", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Json>;
+using FriendSuggestions = Endpoint<"/v3kn/friends/suggestions", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Json, LimitParam>;
+using FriendTopTitles = Endpoint<"/v3kn/friends/top_titles", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Json, LanguageParam, LimitParam>;
+using TopTitles = Endpoint<"/v3kn/top_titles", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Json, LanguageParam, LimitParam>;
+
 void register_friends_endpoints(httplib::Server &server) {
     load_poll_events_from_disk();
-    server.Post("/v3kn/friends/add", handle_friend_add);
-    server.Post("/v3kn/friends/accept", handle_friend_accept);
-    server.Post("/v3kn/friends/reject", handle_friend_reject);
-    server.Post("/v3kn/friends/remove", handle_friend_remove);
-    server.Post("/v3kn/friends/cancel", handle_friend_cancel);
-    server.Post("/v3kn/friends/block", handle_friend_block);
-    server.Post("/v3kn/friends/unblock", handle_friend_unblock);
-    server.Post("/v3kn/friends/presence", handle_friend_presence);
-    server.Get("/v3kn/friends/list", handle_friend_list);
-    server.Get("/v3kn/friends/profile", handle_friend_profile);
-    server.Get("/v3kn/friends/poll", handle_friend_poll);
-    server.Get("/v3kn/friends/search", handle_friend_search);
+    load_presence_ledger();
+    FriendAdd::register_handler<handle_friend_add>(server);
+    FriendAccept::register_handler<handle_friend_accept>(server);
+    FriendReject::register_handler<handle_friend_reject>(server);
+    FriendRemove::register_handler<handle_friend_remove>(server);
+    FriendCancel::register_handler<handle_friend_cancel>(server);
+    FriendBlock::register_handler<handle_friend_block>(server);
+    FriendUnblock::register_handler<handle_friend_unblock>(server);
+    FriendPresence::register_handler<handle_friend_presence>(server);
+    FriendPresenceKey::register_handler<handle_friend_presence_key>(server);
+    FriendList::register_handler<handle_friend_list>(server);
+    FriendProfile::register_handler<handle_friend_profile>(server);
+    FriendPoll::register_handler<handle_friend_poll>(server);
+    FriendSearch::register_handler<handle_friend_search>(server);
+    FriendSuggestions::register_handler<handle_friend_suggestions>(server);
+    FriendTopTitles::register_handler<handle_friend_top_titles>(server);
+    TopTitles::register_handler<handle_top_titles>(server);
+
+    register_friends_memory_consumers();
 
     // Start the online users monitoring thread
     static std::thread monitor_thread(monitor_online_users);
     monitor_thread.detach();
+
+    // Optional UDP presence heartbeat channel
+    start_udp_presence_listener();
 }
 
 // Helper: Get friends file path
 static std::string get_friends_path(const std::string &online_id) {
-    fs::path friends_dir = fs::path("v3kn") / "Users" / online_id;
+    fs::path friends_dir = get_user_dir(online_id);
     fs::create_directories(friends_dir);
     return (friends_dir / "friends.json").string();
 }
@@ -307,11 +470,249 @@ static json load_friends_data(const std::string &online_id) {
     return friends_data;
 }
 
+// Friend graph cache: account IDs are interned to compact ids and each user's friends are kept as a sorted id list,
+// so mutual friends and suggestions are sorted-list intersections instead of friends.json scans (not persisted to disk)
+static std::unordered_map<std::string, uint32_t> interned_account_ids; // account_id -> compact id
+static std::vector<std::string> interned_account_id_names; // compact id -> account_id
+static std::unordered_map<uint32_t, std::vector<uint32_t>> friend_adjacency; // compact id -> sorted friend compact ids
+static std::unordered_map<uint32_t, std::pair<uint64_t, json>> friend_suggestions_cache; // compact id -> (user generation, suggestions)
+static std::unordered_map<uint32_t, uint64_t> friend_graph_generations; // compact id -> bumped when the user's or a friend's list changes
+static uint64_t friend_graph_epoch = 0; // Bumped when the interned ids are dropped
+static std::mutex friend_graph_mutex;
+
+constexpr size_t MAX_FRIEND_SUGGESTIONS = 50;
+
+// Helper: Intern an account ID (friend_graph_mutex must be held)
+static uint32_t intern_account_id(const std::string &account_id) {
+    auto it = interned_account_ids.find(account_id);
+    if (it != interned_account_ids.end())
+        return it->second;
+
+    const uint32_t id = static_cast<uint32_t>(interned_account_id_names.size());
+    interned_account_id_names.push_back(account_id);
+    interned_account_ids.emplace(account_id, id);
+    return id;
+}
+
+// Helper: Friend account IDs from a friends.json friends list
+static std::vector<std::string> get_friend_account_ids(const json &friends) {
+    std::vector<std::string> account_ids;
+    for (const auto &f : friends) {
+        if (f.is_object() && f.contains("account_id") && f["account_id"].is_string())
+            account_ids.push_back(f["account_id"].get<std::string>());
+    }
+    return account_ids;
+}
+
+// Helper: Intern and sort a friend list (friend_graph_mutex must be held)
+static std::vector<uint32_t> make_friend_adjacency(const std::vector<std::string> &friend_account_ids) {
+    std::vector<uint32_t> adjacency;
+    adjacency.reserve(friend_account_ids.size());
+    for (const auto &friend_account_id : friend_account_ids)
+        adjacency.push_back(intern_account_id(friend_account_id));
+
+    std::sort(adjacency.begin(), adjacency.end());
+    adjacency.erase(std::unique(adjacency.begin(), adjacency.end()), adjacency.end());
+    return adjacency;
+}
+
+// Helper: Get the sorted friend list of an interned account, loading it from friends.json on miss (friend_graph_mutex must be held)
+static const std::vector<uint32_t> &get_friend_adjacency(uint32_t id) {
+    auto it = friend_adjacency.find(id);
+    if (it != friend_adjacency.end())
+        return it->second;
+
+    std::vector<std::string> friend_account_ids;
+    const std::string online_id = get_online_id_from_account_id(interned_account_id_names[id]);
+    if (!online_id.empty())
+        friend_account_ids = get_friend_account_ids(load_friends(online_id, "friends"));
+    return friend_adjacency.emplace(id, make_friend_adjacency(friend_account_ids)).first->second;
+}
+
+// Helper: Load the friend lists missing from the graph without holding friend_graph_mutex, so reading friends.json
+// does not block the other users. A list invalidated while it was read is left to be loaded again on access
+static void preload_friend_adjacencies(const std::vector<std::string> &account_ids) {
+    std::vector<std::tuple<std::string, uint32_t, uint64_t>> missing; // account_id, id, generation
+    uint64_t epoch = 0;
+    {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        epoch = friend_graph_epoch;
+        for (const auto &account_id : account_ids) {
+            const uint32_t id = intern_account_id(account_id);
+            if (!friend_adjacency.contains(id))
+                missing.emplace_back(account_id, id, friend_graph_generations[id]);
+        }
+    }
+    if (missing.empty())
+        return;
+
+    std::vector<std::vector<std::string>> loaded;
+    loaded.reserve(missing.size());
+    for (const auto &[account_id, id, generation] : missing) {
+        const std::string online_id = get_online_id_from_account_id(account_id);
+        loaded.push_back(online_id.empty() ? std::vector<std::string>() : get_friend_account_ids(load_friends(online_id, "friends")));
+    }
+
+    std::lock_guard<std::mutex> lock(friend_graph_mutex);
+    if (epoch != friend_graph_epoch)
+        return;
+
+    for (size_t i = 0; i < missing.size(); ++i) {
+        const auto &[account_id, id, generation] = missing[i];
+        if (!friend_adjacency.contains(id) && friend_graph_generations[id] == generation)
+            friend_adjacency.emplace(id, make_friend_adjacency(loaded[i]));
+    }
+}
+
+// Helper: Drop the cached friend list of a user and the suggestions depending on it, the user's own and the ones of
+// its friends before and after the change (a friend of friend list), other users keep their cached suggestions
+static void invalidate_friend_graph(const std::string &online_id, const json &friends) {
+    const std::string account_id = get_account_id_from_online_id(online_id);
+    if (account_id.empty())
+        return;
+
+    const std::vector<std::string> friend_account_ids = get_friend_account_ids(friends);
+    std::lock_guard<std::mutex> lock(friend_graph_mutex);
+    const uint32_t id = intern_account_id(account_id);
+    std::vector<uint32_t> affected = make_friend_adjacency(friend_account_ids);
+    const auto it = friend_adjacency.find(id);
+    if (it != friend_adjacency.end()) {
+        // Only requests or blocks changed, the friends of the user are not affected
+        if (it->second == affected)
+            affected.clear();
+        else
+            affected.insert(affected.end(), it->second.begin(), it->second.end());
+        friend_adjacency.erase(it);
+    }
+    affected.push_back(id);
+
+    for (const uint32_t affected_id : affected) {
+        ++friend_graph_generations[affected_id];
+        friend_suggestions_cache.erase(affected_id);
+    }
+}
+
+static size_t count_mutual_friends(const std::string &account_id, const std::string &target_account_id) {
+    preload_friend_adjacencies({ account_id, target_account_id });
+
+    std::lock_guard<std::mutex> lock(friend_graph_mutex);
+    const uint32_t id = intern_account_id(account_id);
+    const uint32_t target_id = intern_account_id(target_account_id);
+    const auto &friends = get_friend_adjacency(id);
+    const auto &target_friends = get_friend_adjacency(target_id);
+
+    size_t count = 0;
+    auto a = friends.begin();
+    auto b = target_friends.begin();
+    while (a != friends.end() && b != target_friends.end()) {
+        if (*a < *b) {
+            ++a;
+        } else if (*b < *a) {
+            ++b;
+        } else {
+            ++count;
+            ++a;
+            ++b;
+        }
+    }
+    return count;
+}
+
+// Helper: Rank friends of friends by mutual friend count ("people you may know")
+static json get_friend_suggestions(const std::string &account_id, const std::string &online_id) {
+    // Friend lists are loaded before taking the graph lock, the user's own first, then the ones of its friends
+    preload_friend_adjacencies({ account_id });
+    std::vector<std::string> friend_account_ids;
+    {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        const uint32_t id = intern_account_id(account_id);
+        auto cached = friend_suggestions_cache.find(id);
+        if (cached != friend_suggestions_cache.end() && cached->second.first == friend_graph_generations[id])
+            return cached->second.second;
+
+        for (const uint32_t friend_id : get_friend_adjacency(id))
+            friend_account_ids.push_back(interned_account_id_names[friend_id]);
+    }
+    preload_friend_adjacencies(friend_account_ids);
+
+    // Requests and blocks are not part of the graph, but any change to them goes through save_friends and bumps the generation
+    const json requests = load_friends(online_id, "friend_requests");
+    const json blocked = load_friends(online_id, "players_blocked");
+
+    std::lock_guard<std::mutex> lock(friend_graph_mutex);
+    const uint32_t id = intern_account_id(account_id);
+    const uint64_t generation = friend_graph_generations[id];
+
+    std::vector<uint32_t> excluded = get_friend_adjacency(id);
+    excluded.push_back(id);
+    for (const auto *list : { &requests["sent"], &requests["received"], &blocked }) {
+        for (const auto &entry : *list) {
+            if (entry.is_object() && entry.contains("account_id") && entry["account_id"].is_string())
+                excluded.push_back(intern_account_id(entry["account_id"].get<std::string>()));
+        }
+    }
+    std::sort(excluded.begin(), excluded.end());
+
+    // Copy the list, loading friends of friends can insert into the adjacency map
+    const std::vector<uint32_t> friends = get_friend_adjacency(id);
+    std::unordered_map<uint32_t, uint32_t> mutual_counts;
+    for (const uint32_t friend_id : friends) {
+        for (const uint32_t candidate_id : get_friend_adjacency(friend_id)) {
+            if (!std::binary_search(excluded.begin(), excluded.end(), candidate_id))
+                ++mutual_counts[candidate_id];
+        }
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> ranked;
+    ranked.reserve(mutual_counts.size());
+    for (const auto &[candidate_id, count] : mutual_counts) {
+        const std::string candidate_online_id = get_online_id_from_account_id(interned_account_id_names[candidate_id]);
+        if (!candidate_online_id.empty())
+            ranked.emplace_back(candidate_online_id, count);
+    }
+
+    const size_t count = std::min(ranked.size(), MAX_FRIEND_SUGGESTIONS);
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), [](const auto &a, const auto &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    json suggestions = json::array();
+    for (size_t i = 0; i < count; ++i) {
+        json entry;
+        entry["online_id"] = ranked[i].first;
+        entry["mutual_friends"] = ranked[i].second;
+        suggestions.push_back(entry);
+    }
+
+    friend_suggestions_cache[id] = { generation, suggestions };
+    return suggestions;
+}
+
+// Paginated friend lists are read from an in-memory sorted view of each list, see handle_friend_list
+struct FriendListViewEntry {
+    std::string key; // "<0 online, 1 offline>:<lowercase online ID>"
+    json entry; // Entry of the friends.json list
+    std::string online_id;
+};
+
+struct FriendListView {
+    std::vector<FriendListViewEntry> entries;
+    std::chrono::steady_clock::time_point built_at;
+};
+
+static std::unordered_map<std::string, std::unordered_map<std::string, std::shared_ptr<const FriendListView>>> friend_list_views; // online_id -> list -> view
+static std::mutex friend_list_views_mutex;
+
 // Helper: Save friends data to file
 static void save_friends(const std::string &online_id, const json &friends_data) {
-    std::string path = get_friends_path(online_id);
-    std::ofstream f(path);
-    f << friends_data.dump(2);
+    {
+        std::string path = get_friends_path(online_id);
+        write_file_atomic(path, friends_data.dump(2));
+    }
+    invalidate_friend_graph(online_id, friends_data.contains("friends") ? friends_data["friends"] : json::array());
+
+    std::lock_guard<std::mutex> lock(friend_list_views_mutex);
+    friend_list_views.erase(online_id);
 }
 
 void migrate_friends_npid_to_account_id() {
@@ -471,7 +872,7 @@ static void calculate_trophy_level(int64_t points, int &level, int &progress) {
     progress = 100;
 }
 
-static json load_trophies_summary(const std::string &online_id) {
+static json compute_trophies_summary(const std::string &online_id) {
     json summary = json::object();
     summary["level"] = 1;
     summary["progress"] = 0;
@@ -481,7 +882,7 @@ static json load_trophies_summary(const std::string &online_id) {
     summary["gold"] = 0;
     summary["platinum"] = 0;
 
-    const fs::path trophies_path = fs::path("v3kn") / "Users" / online_id / "trophy" / "trophies.xml";
+    const fs::path trophies_path = get_user_dir(online_id) / "trophy" / "trophies.xml";
     pugi::xml_document doc;
     if (!doc.load_file(trophies_path.string().c_str()))
         return summary;
@@ -533,6 +934,33 @@ static json load_trophies_summary(const std::string &online_id) {
     return summary;
 }
 
+// Trophy summaries, revalidated against the modification time of trophies.xml (not persisted to disk)
+static std::unordered_map<std::string, std::pair<fs::file_time_type, json>> trophies_summary_cache; // online_id -> (trophies.xml mtime, summary)
+static std::mutex trophies_summary_cache_mutex;
+
+static json load_trophies_summary(const std::string &online_id) {
+    const fs::path trophies_path = get_user_dir(online_id) / "trophy" / "trophies.xml";
+    std::error_code ec;
+    const auto mtime = fs::last_write_time(trophies_path, ec);
+    if (ec) {
+        std::lock_guard<std::mutex> lock(trophies_summary_cache_mutex);
+        trophies_summary_cache.erase(online_id);
+        return compute_trophies_summary(online_id);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(trophies_summary_cache_mutex);
+        const auto it = trophies_summary_cache.find(online_id);
+        if (it != trophies_summary_cache.end() && it->second.first == mtime)
+            return it->second.second;
+    }
+
+    json summary = compute_trophies_summary(online_id);
+    std::lock_guard<std::mutex> lock(trophies_summary_cache_mutex);
+    trophies_summary_cache[online_id] = { mtime, summary };
+    return summary;
+}
+
 static void fill_presence_fields(json &status_obj, const std::string &account_id, bool include_last_activity, const std::string &language) {
     std::lock_guard<std::mutex> lock(online_users_mutex);
     const auto status_it = presence_status.find(account_id);
@@ -549,25 +977,23 @@ static void fill_presence_fields(json &status_obj, const std::string &account_id
     if (include_last_activity) {
         status_obj["last_activity"] = last_status_change.contains(account_id) ? last_status_change[account_id] : 0;
     }
-}
-
-void handle_friend_add(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
 
-    std::string err;
-    const auto account = get_valid_account(req, "friend add request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
+    // Last time an offline user was seen online, from the presence ledger
+    if (!is_online) {
+        const int64_t last_online = get_last_seen(account_id);
+        if (last_online != 0)
+            status_obj["last_online"] = last_online;
     }
+}
 
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_friend_add(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    const auto target_account = get_valid_target_account(req, "friend add request", err, online_id);
+    std::string err;
+    const auto target_account = get_valid_target_account(ctx.req, "friend add request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
@@ -575,14 +1001,12 @@ void handle_friend_add(const httplib::Request &req, httplib::Response &res) {
 
     if (online_id == target_online_id) {
         log("Cannot add yourself as friend: " + online_id);
-        res.set_content("ERR:CannotAddYourself", "text/plain");
-        return;
+        return "ERR:CannotAddYourself";
     }
 
     if (account_id == target_account_id) {
         log("Cannot add yourself as friend (account ID match): " + online_id);
-        res.set_content("ERR:CannotAddYourself", "text/plain");
-        return;
+        return "ERR:CannotAddYourself";
     }
 
     json user_friends = load_friends_data(online_id);
@@ -592,14 +1016,12 @@ void handle_friend_add(const httplib::Request &req, httplib::Response &res) {
 
     if (has_friend(user_friends["friends"], target_account_id)) {
         log("Already friends: " + online_id + " and " + target_online_id);
-        res.set_content("ERR:AlreadyFriends", "text/plain");
-        return;
+        return "ERR:AlreadyFriends";
     }
 
     if (has_friend(user_friends["friend_requests"]["sent"], target_account_id)) {
         log("Friend request already sent from " + online_id + " to " + target_online_id);
-        res.set_content("ERR:RequestAlreadySent", "text/plain");
-        return;
+        return "ERR:RequestAlreadySent";
     }
 
     const auto add_friend_request = [](const std::string &target_account_id, const std::string &target_online_id, json &target_friends, const std::string &type) {
@@ -616,8 +1038,7 @@ void handle_friend_add(const httplib::Request &req, httplib::Response &res) {
         add_friend_request(account_id, target_online_id, target_friends, "sent");
 
         log("Friend request silently stored from " + online_id + " to blocked target " + target_online_id);
-        res.set_content("OK:RequestSent", "text/plain");
-        return;
+        return "OK:RequestSent";
     }
 
     const bool has_received_request = has_friend(user_friends["friend_requests"]["received"], target_account_id);
@@ -648,8 +1069,7 @@ void handle_friend_add(const httplib::Request &req, httplib::Response &res) {
         create_friendship_established_activity(account_id, target_account_id);
 
         log("Auto-accepted friend request: " + online_id + " <-> " + target_online_id);
-        res.set_content("OK:FriendAdded", "text/plain");
-        return;
+        return "OK:FriendAdded";
     }
 
     // Send friend request
@@ -662,26 +1082,17 @@ void handle_friend_add(const httplib::Request &req, httplib::Response &res) {
     log("Friend request sent from " + online_id + " to " + target_online_id);
 
     notify_friend_poll(target_account_id);
-    res.set_content("OK:RequestSent", "text/plain");
+    return "OK:RequestSent";
 }
 
-void handle_friend_accept(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_accept(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friend accept request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend accept request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend accept request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
@@ -689,8 +1100,7 @@ void handle_friend_accept(const httplib::Request &req, httplib::Response &res) {
 
     if (account_id == target_account_id) {
         log("Cannot accept friend request from yourself (account ID match): " + online_id);
-        res.set_content("ERR:CannotAcceptYourself", "text/plain");
-        return;
+        return "ERR:CannotAcceptYourself";
     }
 
     std::lock_guard<std::mutex> lock_db(account_mutex);
@@ -698,8 +1108,7 @@ void handle_friend_accept(const httplib::Request &req, httplib::Response &res) {
 
     if (!db["users"].contains(target_account_id)) {
         log("Friend accept request to non-existing account ID " + target_account_id + " by " + online_id);
-        res.set_content("ERR:UserNotFound", "text/plain");
-        return;
+        return "ERR:UserNotFound";
     }
 
     json user_friends = load_friends_data(online_id);
@@ -707,8 +1116,7 @@ void handle_friend_accept(const httplib::Request &req, httplib::Response &res) {
 
     if (!has_friend(user_friends["friend_requests"]["received"], target_account_id)) {
         log("No friend request from " + target_account_id + " to accept by " + account_id);
-        res.set_content("ERR:NoRequestFound", "text/plain");
-        return;
+        return "ERR:NoRequestFound";
     }
 
     // Accept request
@@ -728,26 +1136,17 @@ void handle_friend_accept(const httplib::Request &req, httplib::Response &res) {
     create_friendship_established_activity(account_id, target_account_id);
 
     log("Friend request accepted: " + online_id + " <-> " + target_online_id);
-    res.set_content("OK:FriendAdded", "text/plain");
+    return "OK:FriendAdded";
 }
 
-void handle_friend_reject(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_reject(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friend reject request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend reject request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend reject request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
@@ -758,8 +1157,7 @@ void handle_friend_reject(const httplib::Request &req, httplib::Response &res) {
 
     if (!has_friend(user_friends["friend_requests"]["received"], target_account_id)) {
         log("No friend request from " + target_online_id + " to reject by " + online_id);
-        res.set_content("ERR:NoRequestFound", "text/plain");
-        return;
+        return "ERR:NoRequestFound";
     }
 
     // Reject request
@@ -771,26 +1169,17 @@ void handle_friend_reject(const httplib::Request &req, httplib::Response &res) {
 
     log("Friend request rejected: " + target_online_id + " -> " + online_id);
 
-    res.set_content("OK:RequestRejected", "text/plain");
+    return "OK:RequestRejected";
 }
 
-void handle_friend_remove(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_remove(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friend remove request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend remove request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend remove request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
@@ -798,14 +1187,12 @@ void handle_friend_remove(const httplib::Request &req, httplib::Response &res) {
 
     if (account_id == target_account_id) {
         log("Cannot remove yourself as friend (account ID match): " + online_id);
-        res.set_content("ERR:CannotRemoveYourself", "text/plain");
-        return;
+        return "ERR:CannotRemoveYourself";
     }
 
     if (target_online_id.empty()) {
         log("Friend remove request to non-existing online_id " + target_online_id + " by " + online_id);
-        res.set_content("ERR:UserNotFound", "text/plain");
-        return;
+        return "ERR:UserNotFound";
     }
 
     json user_friends = load_friends_data(online_id);
@@ -813,8 +1200,7 @@ void handle_friend_remove(const httplib::Request &req, httplib::Response &res) {
 
     if (!has_friend(user_friends["friends"], target_account_id)) {
         log("Not friends: " + online_id + " and " + target_online_id);
-        res.set_content("ERR:NotFriends", "text/plain");
-        return;
+        return "ERR:NotFriends";
     }
 
     // Remove friendship
@@ -826,34 +1212,24 @@ void handle_friend_remove(const httplib::Request &req, httplib::Response &res) {
 
     log("Friendship removed: " + online_id + " <-> " + target_online_id);
 
-    res.set_content("OK:FriendRemoved", "text/plain");
+    return "OK:FriendRemoved";
 }
 
-void handle_friend_cancel(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_cancel(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friend cancel request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend cancel request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend cancel request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
     const std::string &target_online_id = target_account->online_id;
     if (target_account_id.empty()) {
         log("Friend cancel request to user with no account ID " + target_online_id + " by " + online_id);
-        res.set_content("ERR:UserNotFound", "text/plain");
-        return;
+        return "ERR:UserNotFound";
     }
 
     json user_friends = load_friends_data(online_id);
@@ -861,8 +1237,7 @@ void handle_friend_cancel(const httplib::Request &req, httplib::Response &res) {
 
     if (!has_friend(user_friends["friend_requests"]["sent"], target_account_id)) {
         log("No friend request to cancel from " + online_id + " to " + target_online_id);
-        res.set_content("ERR:NoRequestFound", "text/plain");
-        return;
+        return "ERR:NoRequestFound";
     }
 
     // Cancel the friend request
@@ -876,26 +1251,17 @@ void handle_friend_cancel(const httplib::Request &req, httplib::Response &res) {
 
     log("Friend request cancelled: " + online_id + " -> " + target_online_id);
 
-    res.set_content("OK:RequestCancelled", "text/plain");
+    return "OK:RequestCancelled";
 }
 
-void handle_friend_block(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_block(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friend block request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend block request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend block request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
@@ -903,8 +1269,7 @@ void handle_friend_block(const httplib::Request &req, httplib::Response &res) {
 
     if (account_id == target_account_id) {
         log("Cannot block yourself: " + online_id);
-        res.set_content("ERR:CannotBlockYourself", "text/plain");
-        return;
+        return "ERR:CannotBlockYourself";
     }
 
     json user_friends = load_friends_data(online_id);
@@ -941,26 +1306,17 @@ void handle_friend_block(const httplib::Request &req, httplib::Response &res) {
     }
 
     log("Player blocked: " + online_id + " -> " + target_online_id);
-    res.set_content("OK:PlayerBlocked", "text/plain");
+    return "OK:PlayerBlocked";
 }
 
-void handle_friend_unblock(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_unblock(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friend unblock request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend unblock request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend unblock request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
@@ -983,106 +1339,182 @@ void handle_friend_unblock(const httplib::Request &req, httplib::Response &res)
     save_friends(online_id, user_friends);
 
     log("Player unblocked: " + online_id + " -> " + target_online_id);
-    res.set_content("OK:PlayerUnblocked", "text/plain");
+    return "OK:PlayerUnblocked";
 }
 
-void handle_friend_list(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+// Paginated friend lists: entries are sorted online first, then by case-insensitive online ID, and the cursor is the
+// sort key of the last entry returned. The view is built once with a snapshot of presence and kept in memory, so the
+// cursor stays stable while the following pages are read from it; a change to the list drops the view
+constexpr size_t MAX_FRIEND_LIST_PAGE = 100;
+constexpr auto FRIEND_LIST_VIEW_TTL = std::chrono::seconds(30); // Age after which a new listing takes a fresh presence snapshot
 
-    std::string err;
-    const auto account = get_valid_account(req, "friends list request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
+// Helper: Sorted view of a friends.json list, resolving online IDs and presence (for the friends list only)
+static std::shared_ptr<const FriendListView> build_friend_list_view(const json &entries, bool online_first) {
+    auto view = std::make_shared<FriendListView>();
+    view->built_at = std::chrono::steady_clock::now();
+    if (!entries.is_array())
+        return view;
+
+    std::vector<std::tuple<size_t, std::string, std::string>> resolved; // index, account_id, online_id
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const auto &entry = entries[i];
+        if (!entry.is_object() || !entry.contains("account_id") || !entry["account_id"].is_string())
+            continue;
+
+        const std::string entry_account_id = entry["account_id"].get<std::string>();
+        const std::string entry_online_id = get_online_id_from_account_id(entry_account_id);
+        if (!entry_online_id.empty())
+            resolved.emplace_back(i, entry_account_id, entry_online_id);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(online_users_mutex);
+        for (const auto &[index, entry_account_id, entry_online_id] : resolved) {
+            const auto status_it = presence_status.find(entry_account_id);
+            const bool online = online_first && status_it != presence_status.end() && status_it->second != "offline";
+            view->entries.push_back({ std::string(online ? "0:" : "1:") + lowercase_online_id(entry_online_id), entries[index], entry_online_id });
+        }
     }
 
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+    std::sort(view->entries.begin(), view->entries.end(), [](const FriendListViewEntry &a, const FriendListViewEntry &b) { return a.key < b.key; });
+    return view;
+}
 
-    const std::string group = req.get_param_value("group");
-    if (group.empty()) {
-        log("Missing group parameter on friends list request for online ID " + online_id);
-        res.set_content("ERR:MissingGroup", "text/plain");
-        return;
+// Helper: Cached view of a list (friends, sent, received, players_blocked), a new listing rebuilds it once it is old
+static std::shared_ptr<const FriendListView> get_friend_list_view(const std::string &online_id, const std::string &list, bool new_listing) {
+    {
+        std::lock_guard<std::mutex> lock(friend_list_views_mutex);
+        const auto user_it = friend_list_views.find(online_id);
+        if (user_it != friend_list_views.end()) {
+            const auto it = user_it->second.find(list);
+            if (it != user_it->second.end() && (!new_listing || std::chrono::steady_clock::now() - it->second->built_at < FRIEND_LIST_VIEW_TTL))
+                return it->second;
+        }
     }
 
-    const std::string language = req.get_param_value("sys_lang");
-    if (language.empty()) {
-        log("Missing sys_lang parameter on friends list request for online ID " + online_id);
-        res.set_content("ERR:MissingLanguage", "text/plain");
-        return;
+    const json entries = (list == "sent" || list == "received") ? load_friends(online_id, "friend_requests")[list] : load_friends(online_id, list);
+    auto view = build_friend_list_view(entries, list == "friends");
+
+    std::lock_guard<std::mutex> lock(friend_list_views_mutex);
+    friend_list_views[online_id][list] = view;
+    return view;
+}
+
+// Helper: Entries of the page following the cursor, sets next_cursor when more entries remain
+static std::vector<FriendListViewEntry> get_friend_list_page(const FriendListView &view, std::string_view cursor, size_t limit, json &response) {
+    auto begin = view.entries.begin();
+    if (!cursor.empty())
+        begin = std::upper_bound(view.entries.begin(), view.entries.end(), cursor, [](std::string_view key, const FriendListViewEntry &entry) { return key < entry.key; });
+
+    const auto end = begin + std::min<size_t>(limit, view.entries.end() - begin);
+    response["total"] = view.entries.size();
+    if (end != view.entries.end() && end != begin)
+        response["next_cursor"] = (end - 1)->key;
+
+    return { begin, end };
+}
+
+std::string handle_friend_list(const EndpointContext &ctx, const std::string &group, const std::string &language) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
+
+    // Pagination is opt-in, without a limit the whole list is returned
+    const bool paginated = ctx.req.has_param("limit");
+    size_t limit = 0;
+    const auto cursor = get_param_view(ctx.req, "cursor");
+    if (paginated) {
+        limit = get_number_param<size_t>(ctx.req, "limit").value_or(0);
+        if (limit == 0 || limit > MAX_FRIEND_LIST_PAGE) {
+            return "ERR:InvalidLimit";
+        }
     }
 
+    const auto enrich_friend = [&](const json &f, const std::string &friend_online_id) {
+        json entry = f;
+        const std::string friend_account_id = f["account_id"].get<std::string>();
+        fill_presence_fields(entry, friend_account_id, false, language);
+        entry.erase("account_id");
+        entry["online_id"] = friend_online_id;
+        entry["trophy_level"] = load_trophies_summary(friend_online_id)["level"];
+        return entry;
+    };
+
     json response = json::object();
     if (group == "friends") {
-        json friends = load_friends(online_id, "friends");
         json enriched_friends = json::array();
-        for (const auto &f : friends) {
-            if (!f.contains("account_id"))
-                continue;
-            json entry = f;
-            const std::string friend_account_id = f["account_id"].get<std::string>();
-            const std::string friend_online_id = get_online_id_from_account_id(friend_account_id);
-            if (friend_online_id.empty())
-                continue;
-            fill_presence_fields(entry, friend_account_id, false, language);
-            entry.erase("account_id");
-            entry["online_id"] = friend_online_id;
-            entry["trophy_level"] = load_trophies_summary(friend_online_id)["level"];
-            enriched_friends.push_back(entry);
+        if (paginated) {
+            // Only the requested page is enriched with presence and trophies
+            const auto view = get_friend_list_view(online_id, "friends", cursor.empty());
+            for (const auto &view_entry : get_friend_list_page(*view, cursor, limit, response))
+                enriched_friends.push_back(enrich_friend(view_entry.entry, view_entry.online_id));
+        } else {
+            for (const auto &f : load_friends(online_id, "friends")) {
+                if (!f.contains("account_id"))
+                    continue;
+                const std::string friend_online_id = get_online_id_from_account_id(f["account_id"].get<std::string>());
+                if (friend_online_id.empty())
+                    continue;
+                enriched_friends.push_back(enrich_friend(f, friend_online_id));
+            }
         }
         response["friends"] = enriched_friends;
-        json self_entry = json::object();
-        self_entry["online_id"] = online_id;
-        self_entry["since"] = 0;
-        fill_presence_fields(self_entry, account_id, false, language);
-        self_entry["trophy_level"] = load_trophies_summary(online_id)["level"];
-        response["self"] = self_entry;
+
+        // The first page carries the user's own entry
+        if (!paginated || cursor.empty()) {
+            json self_entry = json::object();
+            self_entry["online_id"] = online_id;
+            self_entry["since"] = 0;
+            fill_presence_fields(self_entry, account_id, false, language);
+            self_entry["trophy_level"] = load_trophies_summary(online_id)["level"];
+            response["self"] = self_entry;
+        }
     } else if (group == "friend_requests") {
-        json requests = load_friends(online_id, "friend_requests");
         response["friend_requests"] = json::object();
-        response["friend_requests"]["sent"] = convert_friend_entries_for_client(requests["sent"]);
-        response["friend_requests"]["received"] = convert_friend_entries_for_client(requests["received"]);
+        if (paginated) {
+            // Each direction is its own list when paginated
+            const std::string type(get_param_view(ctx.req, "type"));
+            if (type != "sent" && type != "received") {
+                return "ERR:InvalidType";
+            }
+
+            json page = json::array();
+            for (const auto &view_entry : get_friend_list_page(*get_friend_list_view(online_id, type, cursor.empty()), cursor, limit, response))
+                page.push_back(view_entry.entry);
+            response["friend_requests"][type] = convert_friend_entries_for_client(page);
+        } else {
+            const json requests = load_friends(online_id, "friend_requests");
+            response["friend_requests"]["sent"] = convert_friend_entries_for_client(requests["sent"]);
+            response["friend_requests"]["received"] = convert_friend_entries_for_client(requests["received"]);
+        }
     } else if (group == "players_blocked") {
-        response["players_blocked"] = convert_friend_entries_for_client(load_friends(online_id, "players_blocked"));
+        json blocked = json::array();
+        if (paginated) {
+            for (const auto &view_entry : get_friend_list_page(*get_friend_list_view(online_id, "players_blocked", cursor.empty()), cursor, limit, response))
+                blocked.push_back(view_entry.entry);
+        } else
+            blocked = load_friends(online_id, "players_blocked");
+        response["players_blocked"] = convert_friend_entries_for_client(blocked);
     } else {
-        res.set_content("ERR:InvalidGroup", "text/plain");
-        return;
+        return "ERR:InvalidGroup";
     }
 
     log("Friends list requested by " + online_id + " (" + group + ")");
-    res.set_content(response.dump(), "application/json");
+    return response.dump();
 }
 
-void handle_friend_profile(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_friend_profile(const EndpointContext &ctx, const std::string &language) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     std::string err;
-    const auto account = get_valid_account(req, "friends profile request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const auto target_account = get_valid_target_account(req, "friend profile request", err, online_id);
+    const auto target_account = get_valid_target_account(ctx.req, "friend profile request", err, online_id);
     if (!target_account) {
-        res.set_content(err, "text/plain");
-        return;
+        return err;
     }
 
     const std::string &target_account_id = target_account->account_id;
     const std::string &target_online_id = target_account->online_id;
 
-    const std::string language = req.get_param_value("sys_lang");
-    if (language.empty()) {
-        log("Missing sys_lang parameter on friend profile request for online ID " + online_id);
-        res.set_content("ERR:MissingLanguage", "text/plain");
-        return;
-    }
-
     json response = json::object();
     response["online_id"] = target_online_id;
     response["friends"] = json::array();
@@ -1110,6 +1542,9 @@ void handle_friend_profile(const httplib::Request &req, httplib::Response &res)
         response["relationship"] = "none";
     }
 
+    if (account_id != target_account_id)
+        response["mutual_friends"] = count_mutual_friends(account_id, target_account_id);
+
     // Include last_updated_activity and about_me from profile if available (for friends, this is used to trigger updates on the client when profile changes)
     json profile = load_profile(target_online_id);
     response["about_me"] = profile.value("about_me", "");
@@ -1122,31 +1557,14 @@ void handle_friend_profile(const httplib::Request &req, httplib::Response &res)
     }
 
     log("Friend profile requested by " + online_id + " for " + target_online_id + " -> " + response["relationship"].get<std::string>());
-    res.set_content(response.dump(), "application/json");
+    return response.dump();
 }
 
-void handle_friend_poll(const httplib::Request &req, httplib::Response &res) {
-    std::string err;
-    const auto account = get_valid_account(req, "friends poll request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_friend_poll(const EndpointContext &ctx, std::optional<int64_t> since) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    const std::string since_str = req.get_param_value("since");
-    int64_t since_timestamp = 0;
-    if (!since_str.empty()) {
-        try {
-            since_timestamp = std::stoll(since_str);
-        } catch (...) {
-            log("Invalid timestamp in poll request from " + online_id);
-            res.set_content("ERR:InvalidTimestamp", "text/plain");
-            return;
-        }
-    }
+    const int64_t since_timestamp = since.value_or(0);
 
     auto poll_signal = get_friend_poll_signal(account_id);
     FriendPollWaiter waiter_guard(account_id, poll_signal);
@@ -1248,8 +1666,7 @@ void handle_friend_poll(const httplib::Request &req, httplib::Response &res) {
             }
 
             log(details);
-            res.set_content(changes.dump(), "application/json");
-            return;
+            return changes.dump();
         }
 
         auto elapsed = std::chrono::steady_clock::now() - start;
@@ -1257,8 +1674,7 @@ void handle_friend_poll(const httplib::Request &req, httplib::Response &res) {
 
         if (remaining <= std::chrono::seconds(0)) {
             json empty = json::object();
-            res.set_content(empty.dump(), "application/json");
-            return;
+            return empty.dump();
         }
 
         std::unique_lock<std::mutex> lock(friends_cv_mutex);
@@ -1267,26 +1683,8 @@ void handle_friend_poll(const httplib::Request &req, httplib::Response &res) {
     }
 }
 
-void handle_friend_presence(const httplib::Request &req, httplib::Response &res) {
-    std::string err;
-    const auto account = get_valid_account(req, "friends presence", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const std::string status = req.get_param_value("status");
-    if (status.empty()) {
-        log("Missing status parameter on presence update for online ID " + online_id);
-        res.set_content("ERR:MissingStatus", "text/plain");
-        return;
-    }
-
-    const std::string now_playing = req.get_param_value("now_playing");
-
+// Helper: Apply a presence heartbeat or status change, shared by the HTTP and UDP channels
+static bool apply_presence_update(const std::string &account_id, const std::string &online_id, const std::string &status, const std::string &now_playing) {
     std::string old_status = "offline";
     bool old_online = false;
     bool status_changed = false;
@@ -1308,7 +1706,7 @@ void handle_friend_presence(const httplib::Request &req, httplib::Response &res)
         if (status == "online" || status == "not_available") {
             // Update timestamp in memory (heartbeat)
             online_users[account_id] = std::time(0);
-            online_now_playing[account_id] = now_playing;
+            set_now_playing(account_id, now_playing);
             presence_status[account_id] = status;
             status_changed = (old_status != status);
             now_playing_changed = old_online && (old_now_playing != now_playing);
@@ -1335,7 +1733,7 @@ void handle_friend_presence(const httplib::Request &req, httplib::Response &res)
         } else if (status == "offline") {
             // Remove from map = offline
             online_users.erase(account_id);
-            online_now_playing.erase(account_id);
+            clear_now_playing(account_id);
             presence_status.erase(account_id);
             pending_online_poll.erase(account_id);
             status_changed = (old_status != "offline");
@@ -1344,11 +1742,10 @@ void handle_friend_presence(const httplib::Request &req, httplib::Response &res)
             // Mark status change timestamp
             if (status_changed) {
                 last_status_change[account_id] = std::time(0);
+                record_last_seen(account_id, std::time(0));
             }
-        } else {
-            res.set_content("ERR:InvalidStatus", "text/plain");
-            return;
-        }
+        } else
+            return false;
     }
 
     // Notify polls if status changed
@@ -1361,25 +1758,260 @@ void handle_friend_presence(const httplib::Request &req, httplib::Response &res)
         log("Now playing updated for: " + online_id + " -> " + now_playing + " (" + now_playing_name + ")");
     }
 
-    res.set_content("OK", "text/plain");
+    return true;
 }
 
-void handle_friend_search(const httplib::Request &req, httplib::Response &res) {
-    std::string err;
-    const auto account = get_valid_account(req, "friends search", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
+std::string handle_friend_presence(const EndpointContext &ctx, const std::string &status, const std::optional<std::string> &now_playing) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
+
+    if (!apply_presence_update(account_id, online_id, status, now_playing.value_or(""))) {
+        return "ERR:InvalidStatus";
+    }
+
+    return "OK";
+}
+
+// UDP presence heartbeats: a client gets a session key over HTTP, then sends small HMAC'd datagrams
+// instead of HTTP heartbeats. The HTTP presence endpoint stays available as the fallback.
+//
+// Datagram layout (big-endian):
+//   0  magic "V3KP"        4  version (1)      5  status (0 offline, 1 online, 2 not_available)
+//   6  flags (bit 0: ack)  7  now playing length
+//   8  session id (u32)    12 counter (u64, strictly increasing per session)
+//   20 now playing         .. HMAC-SHA256 of all the preceding bytes with the session key
+constexpr size_t UDP_PRESENCE_HEADER_SIZE = 20;
+constexpr size_t UDP_PRESENCE_MAC_SIZE = 32;
+constexpr size_t UDP_PRESENCE_MAX_NOW_PLAYING = 64;
+constexpr uint8_t UDP_PRESENCE_VERSION = 1;
+constexpr uint8_t UDP_PRESENCE_FLAG_ACK = 0x01;
+// A session expires when idle or when it gets old, the client then asks for a new key (or falls back to HTTP)
+constexpr auto PRESENCE_SESSION_IDLE_TTL = std::chrono::minutes(10);
+constexpr auto PRESENCE_SESSION_MAX_AGE = std::chrono::hours(24);
+
+struct PresenceSession {
+    std::string account_id;
+    std::string online_id;
+    std::vector<unsigned char> key;
+    uint64_t last_counter = 0;
+    std::chrono::steady_clock::time_point created_at = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_used = created_at;
+};
+
+static std::unordered_map<uint32_t, PresenceSession> presence_sessions; // session id -> session (not persisted to disk)
+static std::unordered_map<std::string, uint32_t> presence_session_by_account; // account_id -> session id
+static std::mutex presence_sessions_mutex;
+static std::atomic<int> udp_presence_port{ 0 }; // 0 when the UDP channel is disabled
+
+static bool is_presence_session_expired(const PresenceSession &session, std::chrono::steady_clock::time_point now) {
+    return (now - session.last_used > PRESENCE_SESSION_IDLE_TTL) || (now - session.created_at > PRESENCE_SESSION_MAX_AGE);
+}
+
+// Helper: Drop the expired sessions (presence_sessions_mutex must be held)
+static void prune_presence_sessions() {
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = presence_sessions.begin(); it != presence_sessions.end();) {
+        if (is_presence_session_expired(it->second, now)) {
+            presence_session_by_account.erase(it->second.account_id);
+            it = presence_sessions.erase(it);
+        } else
+            ++it;
+    }
+}
+
+// Called when the credentials of the account change, the UDP key must not outlive them
+void drop_presence_session(const std::string &account_id) {
+    std::lock_guard<std::mutex> lock(presence_sessions_mutex);
+    auto it = presence_session_by_account.find(account_id);
+    if (it == presence_session_by_account.end())
+        return;
+
+    presence_sessions.erase(it->second);
+    presence_session_by_account.erase(it);
+}
+
+// Called when an account is tombstoned, it must not be reported online until the deletion worker purges it
+void end_account_presence(const std::string &account_id, const std::string &online_id) {
+    drop_presence_session(account_id);
+    apply_presence_update(account_id, online_id, "offline", "");
+}
+
+std::string handle_friend_presence_key(const EndpointContext &ctx) {
+    if (udp_presence_port == 0) {
+        return "ERR:UdpPresenceDisabled";
+    }
+
+    PresenceSession session;
+    session.account_id = ctx.account.account_id;
+    session.online_id = ctx.account.online_id;
+    session.key = generate_random_bytes(32);
+
+    uint32_t session_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(presence_sessions_mutex);
+        prune_presence_sessions();
+
+        // One session per account, a new key replaces the previous one
+        auto it = presence_session_by_account.find(session.account_id);
+        if (it != presence_session_by_account.end())
+            presence_sessions.erase(it->second);
+
+        do {
+            const auto random = generate_random_bytes(sizeof(session_id));
+            std::memcpy(&session_id, random.data(), sizeof(session_id));
+        } while (session_id == 0 || presence_sessions.contains(session_id));
+
+        presence_session_by_account[session.account_id] = session_id;
+        presence_sessions.emplace(session_id, session);
+    }
+
+    const std::string key(session.key.begin(), session.key.end());
+    return "OK:" + std::to_string(session_id) + ":" + base64_encode(key) + ":" + std::to_string(udp_presence_port);
+}
+
+static uint64_t read_big_endian(const unsigned char *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+// Helper: Authenticate and apply a heartbeat datagram, returns false if it was rejected
+static bool handle_udp_presence_datagram(const unsigned char *data, size_t size, bool &wants_ack) {
+    wants_ack = false;
+    if (size < UDP_PRESENCE_HEADER_SIZE + UDP_PRESENCE_MAC_SIZE || std::memcmp(data, "V3KP", 4) != 0 || data[4] != UDP_PRESENCE_VERSION)
+        return false;
+
+    const size_t now_playing_size = data[7];
+    if (now_playing_size > UDP_PRESENCE_MAX_NOW_PLAYING || size != UDP_PRESENCE_HEADER_SIZE + now_playing_size + UDP_PRESENCE_MAC_SIZE)
+        return false;
+
+    static const std::array<std::string, 3> statuses = { "offline", "online", "not_available" };
+    if (data[5] >= statuses.size())
+        return false;
+
+    const uint32_t session_id = static_cast<uint32_t>(read_big_endian(data + 8, 4));
+    const uint64_t counter = read_big_endian(data + 12, 8);
+    const size_t signed_size = UDP_PRESENCE_HEADER_SIZE + now_playing_size;
+
+    std::string account_id;
+    std::string online_id;
+    {
+        std::lock_guard<std::mutex> lock(presence_sessions_mutex);
+        auto it = presence_sessions.find(session_id);
+        if (it == presence_sessions.end())
+            return false;
+
+        auto &session = it->second;
+        const auto now = std::chrono::steady_clock::now();
+        if (is_presence_session_expired(session, now)) {
+            presence_session_by_account.erase(session.account_id);
+            presence_sessions.erase(it);
+            increment_metric("presence.udp.expired");
+            return false;
+        }
+
+        const auto mac = compute_hmac_sha256(session.key, data, signed_size);
+        if (!constant_time_equals(mac.data(), data + signed_size, UDP_PRESENCE_MAC_SIZE))
+            return false;
+
+        // Replay protection: a captured datagram can't be sent again
+        if (counter <= session.last_counter)
+            return false;
+
+        session.last_counter = counter;
+        session.last_used = now;
+        account_id = session.account_id;
+        online_id = session.online_id;
+    }
+
+    wants_ack = data[6] & UDP_PRESENCE_FLAG_ACK;
+    const std::string now_playing(reinterpret_cast<const char *>(data + UDP_PRESENCE_HEADER_SIZE), now_playing_size);
+    return apply_presence_update(account_id, online_id, statuses[data[5]], now_playing);
+}
+
+#ifndef _WIN32
+static void udp_presence_listener() {
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        log("UDP presence: failed to create socket, channel disabled");
+        udp_presence_port = 0;
+        return;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(static_cast<uint16_t>(udp_presence_port));
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        log("UDP presence: failed to bind port " + std::to_string(udp_presence_port) + ", channel disabled");
+        close(fd);
+        udp_presence_port = 0;
         return;
     }
 
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+    log("UDP presence: listening on port " + std::to_string(udp_presence_port));
+    unsigned char buffer[UDP_PRESENCE_HEADER_SIZE + UDP_PRESENCE_MAX_NOW_PLAYING + UDP_PRESENCE_MAC_SIZE];
+    while (true) {
+        sockaddr_in from{};
+        socklen_t from_size = sizeof(from);
+        const ssize_t size = recvfrom(fd, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr *>(&from), &from_size);
+        if (size < 0) {
+            const int error = errno;
+            if (error == EINTR || error == EAGAIN || error == EWOULDBLOCK)
+                continue;
 
-    std::string query = trim_online_id(req.get_param_value("query"));
-    if (query.size() < 3) {
-        res.set_content("ERR:QueryTooShort", "text/plain");
+            // Transient shortage of kernel memory, wait instead of spinning
+            if (error == ENOMEM || error == ENOBUFS) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+
+            log("UDP presence: receive failed (" + std::string(std::strerror(error)) + "), channel disabled");
+            close(fd);
+            udp_presence_port = 0;
+            return;
+        }
+
+        bool wants_ack = false;
+        const bool accepted = handle_udp_presence_datagram(buffer, static_cast<size_t>(size), wants_ack);
+        increment_metric(accepted ? "presence.udp.accepted" : "presence.udp.rejected");
+        if (wants_ack)
+            sendto(fd, "OK", 2, 0, reinterpret_cast<sockaddr *>(&from), from_size);
+    }
+}
+#endif
+
+// Enabled by setting V3KN_UDP_PRESENCE_PORT (not available on Windows)
+static void start_udp_presence_listener() {
+#ifndef _WIN32
+    const char *udp_port = std::getenv("V3KN_UDP_PRESENCE_PORT");
+    if (!udp_port || !*udp_port)
+        return;
+
+    const auto port = parse_number<int>(udp_port);
+    if (!port) {
+        log("Invalid V3KN_UDP_PRESENCE_PORT value, UDP presence disabled");
         return;
     }
+    udp_presence_port = *port;
+
+    if (udp_presence_port > 0 && udp_presence_port < 65536) {
+        static std::thread udp_presence_thread(udp_presence_listener);
+        udp_presence_thread.detach();
+    } else
+        udp_presence_port = 0;
+#endif
+}
+
+std::string handle_friend_search(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
+
+    std::string query = trim_online_id(std::string(get_param_view(ctx.req, "query")));
+    if (query.size() < 3) {
+        return "ERR:QueryTooShort";
+    }
 
     // Case-insensitive search
     query = lowercase_online_id(query);
@@ -1389,8 +2021,7 @@ void handle_friend_search(const httplib::Request &req, httplib::Response &res) {
 
     if (!db["users"].is_object()) {
         log("Invalid users database format");
-        res.set_content("ERR:InternalError", "text/plain");
-        return;
+        return "ERR:InternalError";
     }
 
     json results = json::array();
@@ -1398,6 +2029,10 @@ void handle_friend_search(const httplib::Request &req, httplib::Response &res) {
         if (user_account_id == account_id)
             continue;
 
+        // Accounts pending deletion are hidden
+        if (user.contains("deleted_at"))
+            continue;
+
         if (!user.contains("online_id") || !user["online_id"].is_string() || user["online_id"].empty())
             continue;
 
@@ -1412,5 +2047,349 @@ void handle_friend_search(const httplib::Request &req, httplib::Response &res) {
     }
 
     log("Friend search by " + online_id + " for '" + query + "' -> " + std::to_string(results.size()) + " result(s)");
-    res.set_content(results.dump(), "application/json");
+    return results.dump();
+}
+
+std::string handle_friend_suggestions(const EndpointContext &ctx, std::optional<size_t> limit_param) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
+
+    const size_t limit = limit_param ? std::clamp<size_t>(*limit_param, 1, MAX_FRIEND_SUGGESTIONS) : 10;
+
+    json suggestions = get_friend_suggestions(account_id, online_id);
+    if (suggestions.size() > limit)
+        suggestions.erase(suggestions.begin() + limit, suggestions.end());
+
+    log("Friend suggestions requested by " + online_id + " -> " + std::to_string(suggestions.size()) + " result(s)");
+    return suggestions.dump();
+}
+
+// Helper: Top titles entries from (online players, title ID) pairs, most played first
+static json build_top_titles(const std::vector<std::pair<size_t, std::string>> &ranking, const std::string &language) {
+    json titles = json::array();
+    for (const auto &[players, titleid] : ranking)
+        titles.push_back({ { "titleid", titleid }, { "name", get_stitle_name(titleid, language) }, { "players", players } });
+    return titles;
+}
+
+// Helper: Parse the optional limit of the top titles requests
+static size_t get_top_titles_limit(std::optional<size_t> limit) {
+    return limit ? std::clamp<size_t>(*limit, 1, MAX_TOP_TITLES) : 10;
+}
+
+std::string handle_top_titles(const EndpointContext &ctx, const std::string &language, std::optional<size_t> limit_param) {
+    const std::string &online_id = ctx.account.online_id;
+    const size_t limit = get_top_titles_limit(limit_param);
+
+    // The ranking is already ordered, only the first entries are copied
+    std::vector<std::pair<size_t, std::string>> ranking;
+    {
+        std::lock_guard<std::mutex> lock(online_users_mutex);
+        for (auto it = now_playing_ranking.begin(); (it != now_playing_ranking.end()) && (ranking.size() < limit); ++it)
+            ranking.push_back(*it);
+    }
+
+    return build_top_titles(ranking, language).dump();
+}
+
+std::string handle_friend_top_titles(const EndpointContext &ctx, const std::string &language, std::optional<size_t> limit_param) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
+    const size_t limit = get_top_titles_limit(limit_param);
+
+    std::vector<std::string> friend_account_ids;
+    {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        for (const uint32_t friend_id : get_friend_adjacency(intern_account_id(account_id)))
+            friend_account_ids.push_back(interned_account_id_names[friend_id]);
+    }
+
+    // Only the caller's friends are looked up
+    std::unordered_map<std::string, size_t> counts;
+    {
+        std::lock_guard<std::mutex> lock(online_users_mutex);
+        for (const auto &friend_account_id : friend_account_ids) {
+            const auto it = online_now_playing.find(friend_account_id);
+            if ((it != online_now_playing.end()) && !it->second.empty())
+                ++counts[it->second];
+        }
+    }
+
+    std::vector<std::pair<size_t, std::string>> ranking;
+    for (const auto &[titleid, players] : counts)
+        ranking.emplace_back(players, titleid);
+    std::sort(ranking.begin(), ranking.end(), std::greater<>());
+    if (ranking.size() > limit)
+        ranking.resize(limit);
+
+    return build_top_titles(ranking, language).dump();
+}
+
+// Remove every friend, request and block entry other users have for a deleted account, then its in-memory state
+void purge_account_friend_links(const std::string &account_id, const std::string &online_id) {
+    const json friends_data = load_friends_data(online_id);
+
+    std::unordered_set<std::string> linked_account_ids;
+    for (const auto *list : { &friends_data["friends"], &friends_data["friend_requests"]["sent"], &friends_data["friend_requests"]["received"], &friends_data["players_blocked"] }) {
+        for (const auto &entry : *list) {
+            if (entry.is_object() && entry.contains("account_id") && entry["account_id"].is_string())
+                linked_account_ids.insert(entry["account_id"].get<std::string>());
+        }
+    }
+
+    for (const auto &linked_account_id : linked_account_ids) {
+        const std::string linked_online_id = get_online_id_from_account_id(linked_account_id);
+        if (linked_online_id.empty())
+            continue;
+
+        json linked_friends = load_friends_data(linked_online_id);
+        for (auto *list : { &linked_friends["friends"], &linked_friends["friend_requests"]["sent"], &linked_friends["friend_requests"]["received"], &linked_friends["players_blocked"] }) {
+            while (has_friend(*list, account_id))
+                remove_friend(*list, account_id);
+        }
+        save_friends(linked_online_id, linked_friends);
+        remove_friend_event(linked_account_id, "request_received", account_id);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(online_users_mutex);
+        online_users.erase(account_id);
+        last_status_change.erase(account_id);
+        clear_now_playing(account_id);
+        presence_status.erase(account_id);
+        pending_online_poll.erase(account_id);
+    }
+    {
+        std::lock_guard<std::mutex> lock(pending_friend_status_events_mutex);
+        pending_friend_status_events.erase(account_id);
+    }
+    drop_presence_session(account_id);
+    {
+        std::lock_guard<std::mutex> lock(last_seen_mutex);
+        if (last_seen.erase(account_id))
+            last_seen_dirty = true;
+    }
+    pop_poll_events(account_id);
+
+    log("Purged friend links of deleted online ID " + online_id + " (" + std::to_string(linked_account_ids.size()) + " linked account(s))");
+}
+
+// Helpers: Estimate the memory used by the friend graph structures for the memory budget (friend_graph_mutex must be held)
+static size_t estimate_interned_account_ids_bytes() {
+    size_t bytes = interned_account_id_names.capacity() * sizeof(std::string);
+    for (const auto &[account_id, id] : interned_account_ids)
+        bytes += 2 * sizeof(void *) + sizeof(id) + 2 * estimate_string_bytes(account_id); // Key and name copies
+    bytes += friend_graph_generations.size() * (2 * sizeof(void *) + sizeof(uint32_t) + sizeof(uint64_t));
+    return bytes;
+}
+
+static size_t estimate_friend_adjacency_bytes(const std::vector<uint32_t> &friends) {
+    return 2 * sizeof(void *) + sizeof(uint32_t) + sizeof(friends) + friends.capacity() * sizeof(uint32_t);
+}
+
+static size_t estimate_friend_list_views_bytes(const std::string &online_id, const std::unordered_map<std::string, std::shared_ptr<const FriendListView>> &views) {
+    size_t bytes = 2 * sizeof(void *) + estimate_string_bytes(online_id);
+    for (const auto &[list, view] : views) {
+        bytes += 2 * sizeof(void *) + estimate_string_bytes(list) + sizeof(FriendListView);
+        for (const auto &entry : view->entries)
+            bytes += sizeof(FriendListViewEntry) + estimate_string_bytes(entry.key) + estimate_json_bytes(entry.entry) + estimate_string_bytes(entry.online_id);
+    }
+    return bytes;
+}
+
+static size_t estimate_friend_suggestions_bytes(const std::pair<uint64_t, json> &suggestions) {
+    return 2 * sizeof(void *) + sizeof(uint32_t) + sizeof(suggestions.first) + estimate_json_bytes(suggestions.second);
+}
+
+static size_t estimate_friend_graph_bytes() {
+    size_t bytes = 0;
+    for (const auto &[id, friends] : friend_adjacency)
+        bytes += estimate_friend_adjacency_bytes(friends);
+    for (const auto &[id, suggestions] : friend_suggestions_cache)
+        bytes += estimate_friend_suggestions_bytes(suggestions);
+    return bytes;
+}
+
+static void register_friends_memory_consumers() {
+    MemoryConsumer presence;
+    presence.name = "friends_presence";
+    presence.usage = [] {
+        std::lock_guard<std::mutex> lock(online_users_mutex);
+        MemoryUsage usage;
+        usage.entries = online_users.size();
+        for (const auto &[account_id, timestamp] : online_users)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id) + sizeof(timestamp);
+        for (const auto &[account_id, timestamp] : last_status_change)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id) + sizeof(timestamp);
+        for (const auto &account_id : pending_online_poll)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id);
+        usage.bytes += estimate_string_map_bytes(online_now_playing) + estimate_string_map_bytes(presence_status);
+        for (const auto &[titleid, players] : now_playing_counts)
+            usage.bytes += 2 * (2 * sizeof(void *) + estimate_string_bytes(titleid) + sizeof(players)); // Counter and ranking entry
+        return usage;
+    };
+    register_memory_consumer(std::move(presence));
+
+    MemoryConsumer signals;
+    signals.name = "friend_poll_signals";
+    signals.usage = [] {
+        std::lock_guard<std::mutex> lock(friend_poll_signals_mutex);
+        MemoryUsage usage;
+        usage.entries = friend_poll_signals.size();
+        for (const auto &[account_id, signal] : friend_poll_signals)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id) + sizeof(signal) + sizeof(FriendPollSignal);
+        return usage;
+    };
+    register_memory_consumer(std::move(signals));
+
+    MemoryConsumer summaries;
+    summaries.name = "trophies_summary_cache";
+    summaries.usage = [] {
+        std::lock_guard<std::mutex> lock(trophies_summary_cache_mutex);
+        MemoryUsage usage;
+        usage.entries = trophies_summary_cache.size();
+        for (const auto &[online_id, summary] : trophies_summary_cache)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(online_id) + sizeof(summary.first) + estimate_json_bytes(summary.second);
+        return usage;
+    };
+    summaries.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(trophies_summary_cache_mutex);
+        size_t freed = 0;
+        for (auto it = trophies_summary_cache.begin(); it != trophies_summary_cache.end() && freed < bytes_to_free;) {
+            freed += 2 * sizeof(void *) + estimate_string_bytes(it->first) + sizeof(it->second.first) + estimate_json_bytes(it->second.second);
+            it = trophies_summary_cache.erase(it);
+        }
+        return freed;
+    };
+    summaries.cost = 3;
+    register_memory_consumer(std::move(summaries));
+
+    MemoryConsumer ledger;
+    ledger.name = "presence_ledger";
+    ledger.usage = [] {
+        std::lock_guard<std::mutex> lock(last_seen_mutex);
+        MemoryUsage usage;
+        usage.entries = last_seen.size();
+        for (const auto &[account_id, timestamp] : last_seen)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id) + sizeof(timestamp);
+        return usage;
+    };
+    register_memory_consumer(std::move(ledger));
+
+    MemoryConsumer sessions;
+    sessions.name = "presence_sessions";
+    sessions.usage = [] {
+        std::lock_guard<std::mutex> lock(presence_sessions_mutex);
+        MemoryUsage usage;
+        usage.entries = presence_sessions.size();
+        for (const auto &[session_id, session] : presence_sessions)
+            usage.bytes += 4 * sizeof(void *) + sizeof(session_id) + sizeof(PresenceSession) + session.key.capacity() + estimate_string_bytes(session.account_id) * 2 + estimate_string_bytes(session.online_id);
+        return usage;
+    };
+    register_memory_consumer(std::move(sessions));
+
+    // Status events only hint clients to refresh the friend list, dropping them is the cheapest eviction
+    MemoryConsumer status_events;
+    status_events.name = "pending_friend_status_events";
+    status_events.usage = [] {
+        std::lock_guard<std::mutex> lock(pending_friend_status_events_mutex);
+        MemoryUsage usage;
+        for (const auto &[account_id, events] : pending_friend_status_events) {
+            usage.entries += events.size();
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id) + sizeof(events);
+            for (const auto &event : events)
+                usage.bytes += estimate_json_bytes(event);
+        }
+        return usage;
+    };
+    status_events.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(pending_friend_status_events_mutex);
+        size_t freed = 0;
+        for (auto it = pending_friend_status_events.begin(); it != pending_friend_status_events.end() && freed < bytes_to_free;) {
+            freed += 2 * sizeof(void *) + estimate_string_bytes(it->first) + sizeof(it->second);
+            for (const auto &event : it->second)
+                freed += estimate_json_bytes(event);
+            it = pending_friend_status_events.erase(it);
+        }
+        return freed;
+    };
+    register_memory_consumer(std::move(status_events));
+
+    // Friend list views are rebuilt from friends.json by the next listing
+    MemoryConsumer list_views;
+    list_views.name = "friend_list_views";
+    list_views.usage = [] {
+        std::lock_guard<std::mutex> lock(friend_list_views_mutex);
+        MemoryUsage usage;
+        for (const auto &[online_id, views] : friend_list_views)
+            usage.bytes += estimate_friend_list_views_bytes(online_id, views);
+        usage.entries = friend_list_views.size();
+        return usage;
+    };
+    list_views.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(friend_list_views_mutex);
+        size_t freed = 0;
+        for (auto it = friend_list_views.begin(); it != friend_list_views.end() && freed < bytes_to_free;) {
+            freed += estimate_friend_list_views_bytes(it->first, it->second);
+            it = friend_list_views.erase(it);
+        }
+        return freed;
+    };
+    register_memory_consumer(std::move(list_views));
+
+    // The friend graph is rebuilt from friends.json files on demand
+    MemoryConsumer graph;
+    graph.name = "friend_graph";
+    graph.usage = [] {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        return MemoryUsage{ friend_adjacency.size() + friend_suggestions_cache.size(), estimate_friend_graph_bytes() };
+    };
+    // Suggestions go first, then friend lists until enough is freed, both are reloaded on the next access
+    graph.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        size_t freed = 0;
+        for (auto it = friend_suggestions_cache.begin(); it != friend_suggestions_cache.end() && freed < bytes_to_free;) {
+            freed += estimate_friend_suggestions_bytes(it->second);
+            it = friend_suggestions_cache.erase(it);
+        }
+        for (auto it = friend_adjacency.begin(); it != friend_adjacency.end() && freed < bytes_to_free;) {
+            freed += estimate_friend_adjacency_bytes(it->second);
+            it = friend_adjacency.erase(it);
+        }
+        return freed;
+    };
+    graph.floor_bytes = 4 * 1024 * 1024;
+    graph.cost = 2;
+    register_memory_consumer(std::move(graph));
+
+    // Compact ids are referenced by every cached friend list, so the table is only dropped together with the graph
+    MemoryConsumer interned;
+    interned.name = "interned_account_ids";
+    interned.usage = [] {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        return MemoryUsage{ interned_account_ids.size(), estimate_interned_account_ids_bytes() };
+    };
+    interned.evict = [](size_t) {
+        std::lock_guard<std::mutex> lock(friend_graph_mutex);
+        const size_t freed = estimate_interned_account_ids_bytes() + estimate_friend_graph_bytes();
+        friend_adjacency.clear();
+        friend_suggestions_cache.clear();
+        interned_account_ids.clear();
+        interned_account_id_names.clear();
+        interned_account_id_names.shrink_to_fit();
+        friend_graph_generations.clear();
+        ++friend_graph_epoch;
+        return freed;
+    };
+    interned.floor_bytes = 2 * 1024 * 1024;
+    interned.cost = 3;
+    register_memory_consumer(std::move(interned));
+}
+
+// Preload the caches read by friend lists and profiles for a user, used by the startup warm-up
+void warm_friend_caches(const std::string &account_id, const std::string &online_id) {
+    load_trophies_summary(online_id);
+
+    std::lock_guard<std::mutex> lock(friend_graph_mutex);
+    get_friend_adjacency(intern_account_id(account_id));
 }
@@ -21,25 +21,117 @@
 #include <httplib.h>
 
 #include "account/account.h"
+#include "admin/admin.h"
 #include "activity/activity.h"
 #include "friend/friend.h"
 #include "messages/messages.h"
+#include "profiler/profiler.h"
+#include "stats/stats.h"
 #include "storage/storage.h"
+#include "tls/tls.h"
+#include "utils/params.h"
 #include "utils/utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <regex>
+#include <memory>
 #include <sstream>
 #include <thread>
+#include <tuple>
+#include <vector>
+
+// Thread pool that keeps track of queued and running requests for the memory report
+class CountingThreadPool : public httplib::ThreadPool {
+public:
+    explicit CountingThreadPool(size_t n)
+        : httplib::ThreadPool(n) {}
+
+    bool enqueue(std::function<void()> fn) override {
+        ++queued;
+        const bool accepted = httplib::ThreadPool::enqueue([fn = std::move(fn)] {
+            --queued;
+            ++running;
+            fn();
+            --running;
+        });
+        if (!accepted)
+            --queued;
+        return accepted;
+    }
+
+    static inline std::atomic<size_t> queued{ 0 };
+    static inline std::atomic<size_t> running{ 0 };
+};
+
+// Preload the per-user caches of the most recently active users, running alongside the server
+static void warm_up_caches() {
+    size_t max_users = 1000;
+    const char *warmup_users = std::getenv("V3KN_WARMUP_USERS");
+    if (warmup_users && *warmup_users) {
+        if (const auto value = parse_number<size_t>(warmup_users))
+            max_users = *value;
+        else
+            log("Invalid V3KN_WARMUP_USERS value, using default warm-up size");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    set_metric("warmup.ready", 0);
+
+    std::vector<std::tuple<int64_t, std::string, std::string>> users; // last_activity, account_id, online_id
+    {
+        std::lock_guard<std::mutex> lock(account_mutex);
+        const json db = load_users();
+        for (const auto &[account_id, user] : db["users"].items()) {
+            if (!user.is_object() || user.contains("deleted_at") || !user.contains("online_id"))
+                continue;
+            users.emplace_back(user.value("last_activity", int64_t{ 0 }), account_id, user["online_id"].get<std::string>());
+        }
+    }
+
+    const size_t count = std::min(max_users, users.size());
+    std::partial_sort(users.begin(), users.begin() + count, users.end(), std::greater<>());
+
+    std::atomic<size_t> next{ 0 };
+    std::vector<std::thread> workers;
+    const size_t worker_count = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 8);
+    for (size_t w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) {
+                const auto &[last_activity, account_id, online_id] = users[i];
+                load_profile(online_id);
+                warm_friend_caches(account_id, online_id);
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    set_metric("warmup.users", static_cast<int64_t>(count));
+    set_metric("warmup.duration_ms", static_cast<int64_t>(elapsed));
+    set_metric("warmup.ready", 1);
+    log("Warm-up complete: caches preloaded for " + std::to_string(count) + " recently active users in " + std::to_string(elapsed) + " ms");
+}
 
 //  SERVER
 int main() {
-    httplib::Server v3kn;
+    // Native TLS when a certificate is configured, plain HTTP behind an external terminator otherwise
+    // A configured certificate that fails to load must not silently downgrade clients to plain HTTP
+    const bool tls = is_tls_enabled();
+    std::unique_ptr<httplib::Server> server = tls ? create_tls_server() : std::make_unique<httplib::Server>();
+    if (!server) {
+        log("TLS is configured (V3KN_TLS_CERT/V3KN_TLS_KEY) but the TLS listener could not be created, exiting");
+        return 1;
+    }
+    httplib::Server &v3kn = *server;
 
     v3kn.new_task_queue = [] {
-        return new httplib::ThreadPool(32);
+        return new CountingThreadPool(32);
     };
 
     v3kn.set_read_timeout(120, 0);
@@ -109,6 +201,12 @@ int main() {
 
                 const auto &user_data = user.value();
 
+                // Accounts pending deletion are not resolvable anymore
+                if (user_data.contains("deleted_at")) {
+                    log("User " + account_id + " is pending deletion, skipping caches for this user");
+                    continue;
+                }
+
                 // Cache the account_id -> online_id mapping
                 if (user_data.contains("online_id") && !user_data["online_id"].empty()) {
                     const std::string online_id = user_data["online_id"].get<std::string>();
@@ -155,6 +253,24 @@ int main() {
     register_storage_endpoints(v3kn);
     register_friends_endpoints(v3kn);
     register_messages_endpoints(v3kn);
+    register_admin_endpoints(v3kn);
+    register_stats_endpoints(v3kn);
+    register_profiler_endpoints(v3kn);
+
+    MemoryConsumer thread_pool;
+    thread_pool.name = "thread_pool_queue";
+    thread_pool.usage = [] {
+        const size_t queued = CountingThreadPool::queued;
+        set_metric("thread_pool.running", static_cast<int64_t>(CountingThreadPool::running.load()));
+        return MemoryUsage{ queued, queued * (sizeof(std::function<void()>) + 2 * sizeof(void *)) };
+    };
+    register_memory_consumer(std::move(thread_pool));
+
+    // Keep the caches registered by the endpoints within the memory budget
+    start_memory_budget_monitor();
+
+    // Report the entries still in the flat Users/conversations/Trophies layout, they are migrated offline by v3kn-admin
+    check_data_layout();
 
 #ifndef _WIN32
     // AUTO-UPDATER THREAD
@@ -174,13 +290,21 @@ int main() {
                 }
 
                 std::string latest_hash;
-                if (release.contains("body")) {
-                    const auto &body = release["body"].get<std::string>();
-                    std::string pattern = "Corresponding commit:\\s*([a-f0-9]{" + std::to_string(server_hash.size()) + "})";
-                    std::regex re(pattern);
-                    std::smatch match;
-                    if (std::regex_search(body, match, re) && match.size() == 2) {
-                        latest_hash = match[1].str();
+                if (release.contains("body") && release["body"].is_string()) {
+                    // Look for "Corresponding commit: <sha>", the full SHA is compared by its prefix as long as our short hash
+                    const std::string_view body = release["body"].get_ref<const std::string &>();
+                    static constexpr std::string_view marker = "Corresponding commit:";
+                    static constexpr CharClass hash_chars = make_char_class("0123456789abcdef");
+                    for (size_t pos = body.find(marker); pos != std::string_view::npos; pos = body.find(marker, pos + 1)) {
+                        size_t begin = pos + marker.size();
+                        while (begin < body.size() && std::isspace(static_cast<unsigned char>(body[begin])))
+                            ++begin;
+
+                        const std::string_view candidate = body.substr(begin, server_hash.size());
+                        if (candidate.size() == server_hash.size() && matches_char_class(candidate, hash_chars)) {
+                            latest_hash = std::string(candidate);
+                            break;
+                        }
                     }
                 }
 
@@ -219,8 +343,15 @@ int main() {
     reload_stitles_cache();
     log("Loaded " + std::to_string(get_stitles_cache_size()) + " titles into cache");
 
-    log("Starting v3kn server version " + std::string(app_hash) + " on port 3000...");
-    v3kn.listen("0.0.0.0", 3000);
+    // Requests are served during the warm-up, they just miss the caches not loaded yet
+    std::thread(warm_up_caches).detach();
+
+    const int port = tls ? get_tls_port() : 3000;
+    if (tls)
+        start_tls_certificate_watcher();
+
+    log("Starting v3kn server version " + std::string(app_hash) + " on port " + std::to_string(port) + (tls ? " with TLS..." : "..."));
+    v3kn.listen("0.0.0.0", port);
 
     return 0;
 }
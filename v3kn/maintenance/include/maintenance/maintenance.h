@@ -0,0 +1,23 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <cstddef>
+
+// Offline consistency checks and rebuilds of the data directory, the server must not be running
+struct MaintenanceOptions {
+    bool fix = false; // Repair the inconsistencies found instead of only reporting them
+    bool rebuild_rarity = false; // Regenerate trophies_rarity.json from every trophies.xml
+    bool rebuild_indexes = false; // Regenerate conversation summaries and search indexes from messages.json
+    unsigned jobs = 0; // Worker threads, 0 for one per hardware thread
+};
+
+struct MaintenanceReport {
+    size_t users = 0;
+    size_t conversations = 0;
+    size_t issues = 0;
+    size_t fixed = 0;
+};
+
+MaintenanceReport run_maintenance(const MaintenanceOptions &options);
@@ -0,0 +1,501 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#include "maintenance/maintenance.h"
+#include "messages/messages.h"
+#include "storage/storage.h"
+#include "utils/utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+struct MaintenanceUser {
+    std::string account_id;
+    std::string online_id;
+    std::vector<std::string> online_ids;
+    uint64_t quota_used = 0;
+    uint64_t quota_on_disk = 0;
+    json friends = json::object(); // friends.json
+    bool friends_dirty = false;
+    json conversations = json::array(); // conversations.json
+    bool conversations_dirty = false;
+    json rarity = json::object(); // Rarity entries from this user's trophies.xml
+};
+
+struct MaintenanceConversation {
+    std::string conversation_id;
+    std::vector<std::string> participants; // Remaining participants after repair
+};
+
+static std::atomic<size_t> maintenance_issues{ 0 };
+static std::atomic<size_t> maintenance_fixed{ 0 };
+
+static void report_issue(const std::string &msg, bool fixed) {
+    ++maintenance_issues;
+    if (fixed)
+        ++maintenance_fixed;
+    log(std::string(fixed ? "maintenance: [fixed] " : "maintenance: [issue] ") + msg);
+}
+
+// Helper: Run fn(i) for every item on a pool of workers that pull the next item from a shared counter,
+// so a few large user directories don't leave the other workers idle
+template <typename F>
+static void parallel_for(size_t count, unsigned jobs, F fn) {
+    std::atomic<size_t> next{ 0 };
+    const size_t worker_count = std::clamp<size_t>(jobs, 1, std::max<size_t>(count, 1));
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++)
+                fn(i);
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+}
+
+static json load_json_file(const fs::path &path, const json &fallback) {
+    std::ifstream f(path);
+    if (!f.is_open())
+        return fallback;
+
+    try {
+        json data;
+        f >> data;
+        return data.type() == fallback.type() ? data : fallback;
+    } catch (...) {
+        report_issue("Corrupted JSON file " + path.string(), false);
+        return fallback;
+    }
+}
+
+// Helper: Sum of the files counted by the upload quota
+static uint64_t compute_quota_on_disk(const fs::path &user_dir) {
+    uint64_t total = 0;
+    for (const auto &[type, file_name] : { std::pair{ "savedata", "savedata.psvimg" }, std::pair{ "trophy", "TROPUSR.DAT" } }) {
+        std::error_code ec;
+        const fs::path type_dir = user_dir / type;
+        if (!fs::is_directory(type_dir, ec))
+            continue;
+
+        for (const auto &entry : fs::directory_iterator(type_dir, ec)) {
+            // Savedata versions sharing a content are charged once
+            if (std::string_view(type) == "savedata") {
+                total += get_savedata_unique_size(entry.path());
+                continue;
+            }
+
+            const fs::path file_path = entry.path() / file_name;
+            if (fs::is_regular_file(file_path, ec))
+                total += fs::file_size(file_path, ec);
+        }
+    }
+    return total;
+}
+
+static void scan_user(MaintenanceUser &user, const MaintenanceOptions &options) {
+    const fs::path user_dir = get_user_dir(user.online_id);
+    std::error_code ec;
+    if (!fs::is_directory(user_dir, ec)) {
+        // An online ID change interrupted between users.json and the directory rename leaves the data under an old ID
+        const auto old_id = std::find_if(user.online_ids.begin(), user.online_ids.end(), [&](const std::string &id) {
+            return id != user.online_id && fs::is_directory(get_user_dir(id), ec);
+        });
+        if (old_id != user.online_ids.end()) {
+            if (options.fix && !rename_data_entry(DataTree::Users, *old_id, user.online_id))
+                ec = std::make_error_code(std::errc::io_error);
+            report_issue("User directory of " + user.online_id + " still under old online ID " + *old_id, options.fix && !ec);
+        } else {
+            if (options.fix) {
+                fs::create_directories(user_dir / "savedata", ec);
+                fs::create_directories(user_dir / "trophy", ec);
+            }
+            report_issue("Missing user directory for " + user.online_id + " (account ID " + user.account_id + ")", options.fix && !ec);
+        }
+    }
+
+    user.quota_on_disk = compute_quota_on_disk(user_dir);
+    if (user.quota_on_disk != user.quota_used)
+        report_issue("Quota drift for " + user.online_id + ": recorded " + std::to_string(user.quota_used) + ", on disk " + std::to_string(user.quota_on_disk), options.fix);
+
+    user.friends = load_json_file(user_dir / "friends.json", json::object());
+    user.conversations = load_json_file(user_dir / "conversations.json", json::array());
+
+    if (options.rebuild_rarity && fs::exists(user_dir / "trophy" / "trophies.xml", ec))
+        collect_trophies_rarity(user.online_id, user.rarity);
+}
+
+static bool has_account(const json &list, const std::string &account_id) {
+    return list.is_array() && std::any_of(list.begin(), list.end(), [&](const json &entry) {
+        return entry.is_object() && entry.value("account_id", "") == account_id;
+    });
+}
+
+// Helper: Get a friend list of friends.json (friends, players_blocked, friend_requests/sent, friend_requests/received)
+static json &get_friend_list(json &friends, const std::string &group, const std::string &type = "") {
+    json &node = type.empty() ? friends[group] : friends[group][type];
+    if (!node.is_array())
+        node = json::array();
+    return node;
+}
+
+static void check_friend_links(std::vector<MaintenanceUser> &users, const std::unordered_map<std::string, size_t> &user_by_account_id, const MaintenanceOptions &options) {
+    const auto find_user = [&](const std::string &account_id) -> MaintenanceUser * {
+        const auto it = user_by_account_id.find(account_id);
+        return it != user_by_account_id.end() ? &users[it->second] : nullptr;
+    };
+
+    for (auto &user : users) {
+        if (!user.friends.is_object())
+            continue;
+
+        // Links to accounts that no longer exist
+        for (const auto &[group, type] : { std::pair{ "friends", "" }, std::pair{ "players_blocked", "" }, std::pair{ "friend_requests", "sent" }, std::pair{ "friend_requests", "received" } }) {
+            if (!user.friends.contains(group))
+                continue;
+
+            json &list = get_friend_list(user.friends, group, type);
+            for (auto it = list.begin(); it != list.end();) {
+                const std::string target = it->is_object() ? it->value("account_id", "") : "";
+                if (find_user(target)) {
+                    ++it;
+                    continue;
+                }
+
+                report_issue("Dangling " + std::string(group) + (*type ? std::string("/") + type : "") + " entry " + target + " for " + user.online_id, options.fix);
+                if (options.fix) {
+                    it = list.erase(it);
+                    user.friends_dirty = true;
+                } else
+                    ++it;
+            }
+        }
+    }
+
+    for (auto &user : users) {
+        if (!user.friends.is_object())
+            continue;
+
+        // Friendships must be mutual, a one-sided friend is removed (the users can add each other again)
+        if (user.friends.contains("friends")) {
+            json &friends = get_friend_list(user.friends, "friends");
+            for (auto it = friends.begin(); it != friends.end();) {
+                MaintenanceUser *target = find_user(it->value("account_id", ""));
+                if (!target || !target->friends.contains("friends") || has_account(target->friends["friends"], user.account_id)) {
+                    ++it;
+                    continue;
+                }
+
+                report_issue("One-sided friendship from " + user.online_id + " to " + target->online_id, options.fix);
+                if (options.fix) {
+                    it = friends.erase(it);
+                    user.friends_dirty = true;
+                } else
+                    ++it;
+            }
+        }
+
+        // A request must be both sent and received, except requests silently stored for a target blocking the sender
+        if (user.friends.contains("friend_requests")) {
+            const json sent = get_friend_list(user.friends, "friend_requests", "sent");
+            for (const auto &request : sent) {
+                MaintenanceUser *target = find_user(request.value("account_id", ""));
+                if (!target || !target->friends.is_object())
+                    continue;
+
+                const bool blocked = target->friends.contains("players_blocked") && has_account(target->friends["players_blocked"], user.account_id);
+                if (blocked || (target->friends.contains("friend_requests") && has_account(target->friends["friend_requests"]["received"], user.account_id)))
+                    continue;
+
+                report_issue("Friend request from " + user.online_id + " to " + target->online_id + " missing on the receiving side", options.fix);
+                if (options.fix) {
+                    json received;
+                    received["account_id"] = user.account_id;
+                    received["sent_at"] = request.value("sent_at", int64_t{ 0 });
+                    get_friend_list(target->friends, "friend_requests", "received").push_back(received);
+                    target->friends_dirty = true;
+                }
+            }
+        }
+    }
+}
+
+// Helper: Move a per participant key (unread, read_seq) to the current online ID, the value already there wins
+static void rename_participant_key(json &metadata, const std::string &field, const std::string &old_id, const std::string &new_id) {
+    if (!metadata.contains(field) || !metadata[field].is_object() || !metadata[field].contains(old_id))
+        return;
+
+    auto &values = metadata[field];
+    if (!values.contains(new_id))
+        values[new_id] = values[old_id];
+    values.erase(old_id);
+}
+
+// Participants are stored by online ID and are not rewritten by an online ID change, so every ID of an account
+// history maps to its current one. IDs of accounts pending deletion are left to the deletion worker.
+static void scan_conversation(MaintenanceConversation &conversation, const std::unordered_map<std::string, std::string> &current_online_ids, const std::unordered_set<std::string> &pending_online_ids, const MaintenanceOptions &options) {
+    const fs::path conv_dir = get_data_entry_path(DataTree::Conversations, conversation.conversation_id);
+    json metadata = load_json_file(conv_dir / "metadata.json", json::object());
+    if (!metadata.contains("participants") || !metadata["participants"].is_array()) {
+        report_issue("Conversation " + conversation.conversation_id + " has no participants list", false);
+        return;
+    }
+
+    bool dirty = false;
+    auto &participants = metadata["participants"];
+    for (auto it = participants.begin(); it != participants.end();) {
+        const std::string participant = it->is_string() ? it->get<std::string>() : "";
+        if (pending_online_ids.contains(participant)) {
+            ++it;
+            continue;
+        }
+
+        if (const auto current = current_online_ids.find(participant); current != current_online_ids.end()) {
+            const std::string &online_id = current->second;
+            const bool listed = std::find(conversation.participants.begin(), conversation.participants.end(), online_id) != conversation.participants.end();
+            if (participant == online_id && !listed) {
+                conversation.participants.push_back(online_id);
+                ++it;
+                continue;
+            }
+
+            report_issue("Conversation " + conversation.conversation_id + " references " + online_id + " by " + (listed ? "a duplicate entry " : "old online ID ") + participant, options.fix);
+            if (!options.fix) {
+                if (!listed)
+                    conversation.participants.push_back(online_id);
+                ++it;
+                continue;
+            }
+
+            if (participant != online_id) {
+                rename_participant_key(metadata, "unread", participant, online_id);
+                rename_participant_key(metadata, "read_seq", participant, online_id);
+            }
+            dirty = true;
+            if (listed) {
+                it = participants.erase(it);
+                continue;
+            }
+            *it = online_id;
+            conversation.participants.push_back(online_id);
+            ++it;
+            continue;
+        }
+
+        report_issue("Conversation " + conversation.conversation_id + " references missing user " + participant, options.fix);
+        if (options.fix) {
+            if (metadata.contains("unread") && metadata["unread"].is_object())
+                metadata["unread"].erase(participant);
+            if (metadata.contains("read_seq") && metadata["read_seq"].is_object())
+                metadata["read_seq"].erase(participant);
+            it = participants.erase(it);
+            dirty = true;
+        } else
+            ++it;
+    }
+
+    std::error_code ec;
+    if (options.fix && participants.empty()) {
+        fs::remove_all(conv_dir, ec);
+        report_issue("Conversation " + conversation.conversation_id + " has no participant left, removed", !ec);
+        conversation.participants.clear();
+        return;
+    }
+
+    if (dirty)
+        write_file_atomic(conv_dir / "metadata.json", metadata.dump(2));
+
+    if (options.rebuild_indexes)
+        rebuild_conversation_caches(conversation.conversation_id);
+}
+
+static void check_user_conversations(std::vector<MaintenanceUser> &users, const std::unordered_map<std::string, size_t> &user_by_online_id, const std::vector<MaintenanceConversation> &conversations, const MaintenanceOptions &options) {
+    std::unordered_set<std::string> existing;
+    for (const auto &conversation : conversations) {
+        if (!conversation.participants.empty())
+            existing.insert(conversation.conversation_id);
+    }
+
+    // Listed conversations that no longer exist
+    for (auto &user : users) {
+        for (auto it = user.conversations.begin(); it != user.conversations.end();) {
+            if (it->is_string() && existing.contains(it->get<std::string>())) {
+                ++it;
+                continue;
+            }
+
+            report_issue("User " + user.online_id + " lists missing conversation " + it->dump(), options.fix);
+            if (options.fix) {
+                it = user.conversations.erase(it);
+                user.conversations_dirty = true;
+            } else
+                ++it;
+        }
+    }
+
+    // Conversations missing from a participant's list
+    for (const auto &conversation : conversations) {
+        for (const auto &participant : conversation.participants) {
+            const auto it = user_by_online_id.find(participant);
+            if (it == user_by_online_id.end())
+                continue;
+
+            auto &user = users[it->second];
+            if (std::find(user.conversations.begin(), user.conversations.end(), conversation.conversation_id) != user.conversations.end())
+                continue;
+
+            report_issue("Conversation " + conversation.conversation_id + " missing from the list of " + participant, options.fix);
+            if (options.fix) {
+                user.conversations.push_back(conversation.conversation_id);
+                user.conversations_dirty = true;
+            }
+        }
+    }
+}
+
+// Directories under Users that belong to no account are moved aside rather than deleted
+static void check_orphaned_user_dirs(const std::unordered_set<std::string> &known_online_ids, const MaintenanceOptions &options) {
+    for (const auto &name : list_data_entries(DataTree::Users)) {
+        if (known_online_ids.contains(name))
+            continue;
+
+        const fs::path entry_path = get_user_dir(name);
+        std::error_code move_ec;
+        if (options.fix) {
+            const fs::path orphaned_dir = fs::path("v3kn") / "orphaned";
+            fs::create_directories(orphaned_dir, move_ec);
+            fs::path target = orphaned_dir / name;
+            if (fs::exists(target, move_ec))
+                target += "-" + std::to_string(std::time(0));
+            fs::rename(entry_path, target, move_ec);
+        }
+        report_issue("Orphaned user directory " + entry_path.string() + (options.fix ? " moved to v3kn/orphaned" : ""), options.fix && !move_ec);
+    }
+}
+
+static void merge_trophies_rarity(json &rarity_json, const json &partial) {
+    // Every user contributes each online ID once per list, so merging is a plain append
+    for (const auto &root : { "players", "trophies" }) {
+        if (!partial.contains(root))
+            continue;
+
+        for (const auto &[npcomm_id, value] : partial[root].items()) {
+            if (value.is_array()) {
+                auto &players = rarity_json[root][npcomm_id];
+                for (const auto &online_id : value)
+                    players.push_back(online_id);
+            } else if (value.is_object()) {
+                for (const auto &[trophy_id, earned] : value.items()) {
+                    auto &merged = rarity_json[root][npcomm_id][trophy_id];
+                    for (const auto &online_id : earned)
+                        merged.push_back(online_id);
+                }
+            }
+        }
+    }
+}
+
+MaintenanceReport run_maintenance(const MaintenanceOptions &options) {
+    const auto start = std::chrono::steady_clock::now();
+    const unsigned jobs = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+    maintenance_issues = 0;
+    maintenance_fixed = 0;
+
+    json db = load_users();
+    std::vector<MaintenanceUser> users;
+    std::unordered_map<std::string, size_t> user_by_account_id;
+    std::unordered_map<std::string, size_t> user_by_online_id;
+    std::unordered_set<std::string> known_online_ids; // Includes accounts pending deletion, their directory is not orphaned
+    std::unordered_set<std::string> pending_online_ids; // Every ID of the accounts pending deletion
+    for (const auto &[account_id, user_data] : db["users"].items()) {
+        if (!user_data.is_object() || !user_data.contains("online_id"))
+            continue;
+
+        const std::string online_id = user_data["online_id"].get<std::string>();
+        known_online_ids.insert(online_id);
+        if (user_data.contains("deleted_at")) {
+            pending_online_ids.insert(online_id);
+            if (user_data.contains("online_ids") && user_data["online_ids"].is_array()) {
+                for (const auto &id : user_data["online_ids"])
+                    pending_online_ids.insert(id.get<std::string>());
+            }
+            continue;
+        }
+
+        MaintenanceUser user;
+        user.account_id = account_id;
+        user.online_id = online_id;
+        if (user_data.contains("online_ids") && user_data["online_ids"].is_array())
+            user.online_ids = user_data["online_ids"].get<std::vector<std::string>>();
+        user.quota_used = user_data.value("quota_used", uint64_t{ 0 });
+
+        user_by_account_id[account_id] = users.size();
+        user_by_online_id[online_id] = users.size();
+        users.push_back(std::move(user));
+    }
+    log("maintenance: scanning " + std::to_string(users.size()) + " users with " + std::to_string(jobs) + " jobs" + (options.fix ? " (fix mode)" : ""));
+
+    parallel_for(users.size(), jobs, [&](size_t i) { scan_user(users[i], options); });
+
+    check_friend_links(users, user_by_account_id, options);
+    check_orphaned_user_dirs(known_online_ids, options);
+
+    std::vector<MaintenanceConversation> conversations;
+    for (const auto &conversation_id : list_data_entries(DataTree::Conversations))
+        conversations.push_back({ conversation_id, {} });
+
+    std::unordered_map<std::string, std::string> current_online_ids;
+    for (const auto &user : users) {
+        for (const auto &id : user.online_ids)
+            current_online_ids[id] = user.online_id;
+        current_online_ids[user.online_id] = user.online_id;
+    }
+
+    parallel_for(conversations.size(), jobs, [&](size_t i) { scan_conversation(conversations[i], current_online_ids, pending_online_ids, options); });
+    check_user_conversations(users, user_by_online_id, conversations, options);
+
+    if (options.fix) {
+        bool users_dirty = false;
+        for (const auto &user : users) {
+            if (user.quota_on_disk != user.quota_used) {
+                db["users"][user.account_id]["quota_used"] = user.quota_on_disk;
+                users_dirty = true;
+            }
+        }
+        if (users_dirty)
+            save_users(db);
+
+        parallel_for(users.size(), jobs, [&](size_t i) {
+            const auto &user = users[i];
+            const fs::path user_dir = get_user_dir(user.online_id);
+            if (user.friends_dirty)
+                write_file_atomic(user_dir / "friends.json", user.friends.dump(2));
+            if (user.conversations_dirty)
+                write_file_atomic(user_dir / "conversations.json", user.conversations.dump(2));
+        });
+    }
+
+    if (options.rebuild_rarity) {
+        json rarity_json = json{ { "players", json::object() }, { "trophies", json::object() } };
+        for (const auto &user : users)
+            merge_trophies_rarity(rarity_json, user.rarity);
+        save_trophies_rarity(rarity_json);
+        log("maintenance: rebuilt trophies_rarity.json with " + std::to_string(rarity_json["players"].size()) + " trophy sets");
+    }
+
+    MaintenanceReport report;
+    report.users = users.size();
+    report.conversations = conversations.size();
+    report.issues = maintenance_issues;
+    report.fixed = maintenance_fixed;
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    log("maintenance: " + std::to_string(report.users) + " users, " + std::to_string(report.conversations) + " conversations, " + std::to_string(report.issues) + " issue(s), " + std::to_string(report.fixed) + " fixed in " + std::to_string(elapsed) + " ms");
+    return report;
+}
@@ -4,15 +4,24 @@
 #pragma once
 
 #include <httplib.h>
+#include <utils/endpoint.h>
+
+#include <optional>
+#include <string>
 
 void register_messages_endpoints(httplib::Server &server);
 
-void handle_messages_create(const httplib::Request &req, httplib::Response &res);
-void handle_messages_send(const httplib::Request &req, httplib::Response &res);
-void handle_messages_delete(const httplib::Request &req, httplib::Response &res);
-void handle_messages_add_participant(const httplib::Request &req, httplib::Response &res);
-void handle_messages_leave(const httplib::Request &req, httplib::Response &res);
-void handle_messages_delete_conversation(const httplib::Request &req, httplib::Response &res);
-void handle_messages_conversations(const httplib::Request &req, httplib::Response &res);
-void handle_messages_read(const httplib::Request &req, httplib::Response &res);
-void handle_messages_poll(const httplib::Request &req, httplib::Response &res);
+void purge_account_conversations(const std::string &online_id);
+void rebuild_conversation_caches(const std::string &conversation_id);
+
+std::string handle_messages_create(const EndpointContext &ctx);
+std::string handle_messages_send(const EndpointContext &ctx, const std::string &message);
+std::string handle_messages_delete(const EndpointContext &ctx);
+std::string handle_messages_add_participant(const EndpointContext &ctx);
+std::string handle_messages_leave(const EndpointContext &ctx);
+std::string handle_messages_delete_conversation(const EndpointContext &ctx);
+std::string handle_messages_conversations(const EndpointContext &ctx);
+std::string handle_messages_read(const EndpointContext &ctx);
+std::string handle_messages_poll(const EndpointContext &ctx, std::optional<int64_t> since);
+std::string handle_messages_mark_read(const EndpointContext &ctx);
+std::string handle_messages_search(const EndpointContext &ctx);
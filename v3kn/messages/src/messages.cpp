@@ -2,24 +2,51 @@
 // Copyright (C) 2026 Vita3K team
 
 #include "messages/messages.h"
+#include "stats/stats.h"
+#include "utils/params.h"
 #include "utils/utils.h"
 
 #include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <ctime>
 #include <fstream>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+static void register_messages_memory_consumers();
+
+// Conversation IDs are trimmed and checked by the handlers, the poll waits without the request lock
+using CreateConversation = Endpoint<"/v3kn/messages/create", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using SendMessage = Endpoint<"/v3kn/messages/send", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text,
+    RequiredParam<"message", std::string, "Message">>;
+using DeleteMessage = Endpoint<"/v3kn/messages/delete", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using AddParticipant = Endpoint<"/v3kn/messages/add_participant", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using LeaveConversation = Endpoint<"/v3kn/messages/leave", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using DeleteConversation = Endpoint<"/v3kn/messages/delete_conversation", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using ListConversations = Endpoint<"/v3kn/messages/conversations", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json>;
+using ReadMessages = Endpoint<"/v3kn/messages/read", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json>;
+using PollMessages = Endpoint<"/v3kn/messages/poll", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Json,
+    OptionalParam<"since", int64_t, "Timestamp">>;
+using MarkRead = Endpoint<"/v3kn/messages/mark_read", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using SearchMessages = Endpoint<"/v3kn/messages/search", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json>;
 
 void register_messages_endpoints(httplib::Server &server) {
-    server.Post("/v3kn/messages/create", handle_messages_create);
-    server.Post("/v3kn/messages/send", handle_messages_send);
-    server.Post("/v3kn/messages/delete", handle_messages_delete);
-    server.Post("/v3kn/messages/add_participant", handle_messages_add_participant);
-    server.Post("/v3kn/messages/leave", handle_messages_leave);
-    server.Post("/v3kn/messages/delete_conversation", handle_messages_delete_conversation);
-    server.Get("/v3kn/messages/conversations", handle_messages_conversations);
-    server.Get("/v3kn/messages/read", handle_messages_read);
-    server.Get("/v3kn/messages/poll", handle_messages_poll);
+    CreateConversation::register_handler<handle_messages_create>(server);
+    SendMessage::register_handler<handle_messages_send>(server);
+    DeleteMessage::register_handler<handle_messages_delete>(server);
+    AddParticipant::register_handler<handle_messages_add_participant>(server);
+    LeaveConversation::register_handler<handle_messages_leave>(server);
+    DeleteConversation::register_handler<handle_messages_delete_conversation>(server);
+    ListConversations::register_handler<handle_messages_conversations>(server);
+    ReadMessages::register_handler<handle_messages_read>(server);
+    PollMessages::register_handler<handle_messages_poll>(server);
+    MarkRead::register_handler<handle_messages_mark_read>(server);
+    SearchMessages::register_handler<handle_messages_search>(server);
+
+    register_messages_memory_consumers();
 }
 
 static void init_messages_fields(json &user) {
@@ -27,11 +54,16 @@ static void init_messages_fields(json &user) {
         user["messages"] = json::object();
 }
 
-// Helper: Get conversation directory path
+// Helper: Get conversation directory path, created by the save helpers only
 static std::string get_conversation_dir(const std::string &conversation_id) {
-    fs::path conv_dir = fs::path("v3kn") / "conversations" / conversation_id;
-    fs::create_directories(conv_dir);
-    return conv_dir.string();
+    return get_data_entry_path(DataTree::Conversations, conversation_id).string();
+}
+
+// Helper: Write a conversation or user file, creating its directory on first write
+static void write_data_file(const std::string &path, const std::string &content) {
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    write_file_atomic(path, content);
 }
 
 // Helper: Get conversation metadata file path
@@ -58,9 +90,7 @@ static json load_conversation_metadata(const std::string &conversation_id) {
 
 // Helper: Save conversation metadata
 static void save_conversation_metadata(const std::string &conversation_id, const json &metadata) {
-    std::string path = get_conversation_metadata_path(conversation_id);
-    std::ofstream f(path);
-    f << metadata.dump(2);
+    write_data_file(get_conversation_metadata_path(conversation_id), metadata.dump(2));
 }
 
 // Helper: Load conversation messages
@@ -77,16 +107,22 @@ static json load_conversation_messages(const std::string &conversation_id) {
 
 // Helper: Save conversation messages
 static void save_conversation_messages(const std::string &conversation_id, const json &messages) {
-    std::string path = get_conversation_messages_path(conversation_id);
-    std::ofstream f(path);
-    f << messages.dump(2);
+    write_data_file(get_conversation_messages_path(conversation_id), messages.dump(2));
+}
+
+// Helper: Get conversation search index file path
+static std::string get_conversation_index_path(const std::string &conversation_id) {
+    return (fs::path(get_conversation_dir(conversation_id)) / "index.json").string();
+}
+
+// Helper: Get conversation search index log path, the postings changed since index.json was written
+static std::string get_conversation_index_log_path(const std::string &conversation_id) {
+    return (fs::path(get_conversation_dir(conversation_id)) / "index.log").string();
 }
 
 // Helper: Get user's conversations file path
 static std::string get_user_conversations_path(const std::string &online_id) {
-    fs::path dir = fs::path("v3kn") / "Users" / online_id;
-    fs::create_directories(dir);
-    return (dir / "conversations.json").string();
+    return (get_user_dir(online_id) / "conversations.json").string();
 }
 
 // Helper: Load user's conversations
@@ -103,9 +139,7 @@ static json load_user_conversations(const std::string &online_id) {
 
 // Helper: Save user's conversations
 static void save_user_conversations(const std::string &online_id, const json &conversations) {
-    std::string path = get_user_conversations_path(online_id);
-    std::ofstream f(path);
-    f << conversations.dump(2);
+    write_data_file(get_user_conversations_path(online_id), conversations.dump(2));
 }
 
 // Helper: Generate conversation ID from participants
@@ -130,6 +164,281 @@ static std::string generate_conversation_id(const std::vector<std::string> &part
     }
 }
 
+// Helper: Give a sequence id to every message missing one (conversations created before sequence ids existed)
+static void ensure_message_seqs(json &metadata, json &messages) {
+    int64_t next_seq = metadata.value("next_seq", int64_t{ 1 });
+    for (auto &msg : messages) {
+        if (!msg.contains("seq"))
+            msg["seq"] = next_seq++;
+        else
+            next_seq = std::max(next_seq, msg["seq"].get<int64_t>() + 1);
+    }
+    metadata["next_seq"] = next_seq;
+}
+
+// Helper: Keep the summary fields read by the conversations list in sync with the messages file
+static void update_conversation_summary(json &metadata, const json &messages) {
+    metadata["count"] = messages.size();
+    if (messages.empty())
+        metadata.erase("last_message");
+    else
+        metadata["last_message"] = messages.back();
+}
+
+// Helper: Count a new message as unread for every participant but its sender
+static void increment_unread_counters(json &metadata, const std::string &sender) {
+    if (!metadata.contains("unread") || !metadata["unread"].is_object())
+        metadata["unread"] = json::object();
+
+    for (const auto &p : metadata.value("participants", json::array())) {
+        if (!p.is_string() || p.get<std::string>() == sender)
+            continue;
+        auto &unread = metadata["unread"][p.get<std::string>()];
+        unread = unread.is_number_integer() ? unread.get<int64_t>() + 1 : 1;
+    }
+}
+
+// Helper: Uncount a deleted message for every participant that had not read it yet
+static void decrement_unread_counters(json &metadata, const std::string &sender, int64_t seq) {
+    if (!metadata.contains("unread") || !metadata["unread"].is_object())
+        return;
+
+    const json read_seqs = metadata.value("read_seq", json::object());
+    for (auto &[participant, unread] : metadata["unread"].items()) {
+        if (participant == sender || !unread.is_number_integer() || unread.get<int64_t>() <= 0)
+            continue;
+        if (read_seqs.value(participant, int64_t{ 0 }) < seq)
+            unread = unread.get<int64_t>() - 1;
+    }
+}
+
+// Helper: Move a participant read cursor to the latest message
+static void mark_conversation_read(json &metadata, const std::string &online_id) {
+    metadata["read_seq"][online_id] = metadata.value("next_seq", int64_t{ 1 }) - 1;
+    metadata["unread"][online_id] = 0;
+}
+
+// Inverted index of a conversation: case-folded token -> sorted message sequence ids
+struct ConversationIndex {
+    std::unordered_map<std::string, std::vector<int64_t>> postings;
+    size_t log_entries = 0; // Lines in index.log not yet folded into index.json
+};
+
+// index.log is folded into index.json once it holds this many messages
+constexpr size_t CONVERSATION_INDEX_LOG_MAX_ENTRIES = 256;
+
+// Search index cache, persisted in each conversation directory as index.json
+static std::unordered_map<std::string, ConversationIndex> conversation_index_cache; // conversation_id -> index
+static std::mutex conversation_index_mutex;
+
+// Helper: Split a message into unique lowercase tokens (ASCII letters and digits, UTF-8 sequences are kept as is)
+static std::vector<std::string> tokenize_message(const std::string &text) {
+    std::vector<std::string> tokens;
+    std::string token;
+    const auto flush = [&] {
+        if (token.size() >= 2 && std::find(tokens.begin(), tokens.end(), token) == tokens.end())
+            tokens.push_back(token);
+        token.clear();
+    };
+
+    for (const unsigned char c : text) {
+        if (c >= 0x80 || std::isalnum(c))
+            token.push_back(static_cast<char>(std::tolower(c)));
+        else
+            flush();
+    }
+    flush();
+
+    return tokens;
+}
+
+static void add_to_conversation_index(ConversationIndex &index, int64_t seq, const std::string &text) {
+    for (const auto &token : tokenize_message(text)) {
+        auto &posting = index.postings[token];
+        if (posting.empty() || posting.back() < seq)
+            posting.push_back(seq);
+        else if (!std::binary_search(posting.begin(), posting.end(), seq))
+            posting.insert(std::lower_bound(posting.begin(), posting.end(), seq), seq);
+    }
+}
+
+static void remove_from_conversation_index(ConversationIndex &index, int64_t seq, const std::vector<std::string> &tokens) {
+    for (const auto &token : tokens) {
+        auto posting_it = index.postings.find(token);
+        if (posting_it == index.postings.end())
+            continue;
+
+        auto &posting = posting_it->second;
+        auto seq_it = std::lower_bound(posting.begin(), posting.end(), seq);
+        if (seq_it != posting.end() && *seq_it == seq)
+            posting.erase(seq_it);
+        if (posting.empty())
+            index.postings.erase(posting_it);
+    }
+}
+
+// Helper: Write the whole index to index.json and empty the log
+static void save_conversation_index(const std::string &conversation_id, ConversationIndex &index) {
+    json tokens = json::object();
+    for (const auto &[token, posting] : index.postings)
+        tokens[token] = posting;
+
+    write_data_file(get_conversation_index_path(conversation_id), json{ { "tokens", tokens } }.dump());
+    std::error_code ec;
+    fs::remove(get_conversation_index_log_path(conversation_id), ec);
+    index.log_entries = 0;
+}
+
+// Helper: Append the postings of one message to index.log ('+' added, '-' removed), folding the log into index.json when it is full.
+// Replaying a line is idempotent, so a crash between the snapshot and the log removal only replays lines already applied.
+static void log_conversation_index_change(const std::string &conversation_id, ConversationIndex &index, char op, int64_t seq, const std::vector<std::string> &tokens) {
+    if (++index.log_entries > CONVERSATION_INDEX_LOG_MAX_ENTRIES) {
+        save_conversation_index(conversation_id, index);
+        return;
+    }
+
+    std::string line = op + std::to_string(seq);
+    for (const auto &token : tokens)
+        line += " " + token;
+    line += "\n";
+
+    std::ofstream log_file(get_conversation_index_log_path(conversation_id), std::ios::binary | std::ios::app);
+    log_file << line;
+    if (!log_file)
+        save_conversation_index(conversation_id, index);
+}
+
+// Helper: Apply index.log on top of the postings loaded from index.json
+static void replay_conversation_index_log(const std::string &conversation_id, ConversationIndex &index) {
+    std::ifstream log_file(get_conversation_index_log_path(conversation_id), std::ios::binary);
+    std::string line;
+    while (std::getline(log_file, line)) {
+        if (line.size() < 2 || (line[0] != '+' && line[0] != '-'))
+            continue;
+
+        std::vector<std::string> tokens;
+        size_t pos = 1;
+        const size_t seq_end = std::min(line.find(' ', pos), line.size());
+        const auto seq = parse_number<int64_t>(std::string_view(line).substr(pos, seq_end - pos));
+        if (!seq)
+            continue;
+
+        for (pos = seq_end + 1; pos < line.size();) {
+            const size_t end = std::min(line.find(' ', pos), line.size());
+            if (end > pos)
+                tokens.push_back(line.substr(pos, end - pos));
+            pos = end + 1;
+        }
+
+        if (line[0] == '+') {
+            for (const auto &token : tokens) {
+                auto &posting = index.postings[token];
+                if (!std::binary_search(posting.begin(), posting.end(), *seq))
+                    posting.insert(std::lower_bound(posting.begin(), posting.end(), *seq), *seq);
+            }
+        } else
+            remove_from_conversation_index(index, *seq, tokens);
+        ++index.log_entries;
+    }
+}
+
+// Helper: Get the search index of a conversation, loading or rebuilding it on miss (conversation_index_mutex must be held)
+static ConversationIndex &get_conversation_index(const std::string &conversation_id) {
+    auto it = conversation_index_cache.find(conversation_id);
+    if (it != conversation_index_cache.end())
+        return it->second;
+
+    ConversationIndex index;
+    bool loaded = false;
+    {
+        std::ifstream f(get_conversation_index_path(conversation_id));
+        if (f.is_open()) {
+            try {
+                json data;
+                f >> data;
+                for (const auto &[token, posting] : data.at("tokens").items())
+                    index.postings[token] = posting.get<std::vector<int64_t>>();
+                loaded = true;
+                replay_conversation_index_log(conversation_id, index);
+            } catch (...) {
+                log("Corrupted search index for conversation " + conversation_id + " - rebuilding");
+                index.postings.clear();
+            }
+        }
+    }
+
+    if (!loaded) {
+        json metadata = load_conversation_metadata(conversation_id);
+        json messages = load_conversation_messages(conversation_id);
+        if (!metadata.contains("next_seq")) {
+            ensure_message_seqs(metadata, messages);
+            save_conversation_metadata(conversation_id, metadata);
+            save_conversation_messages(conversation_id, messages);
+        }
+
+        for (const auto &msg : messages) {
+            if (msg.contains("seq") && msg.contains("msg") && msg["msg"].is_string())
+                add_to_conversation_index(index, msg["seq"].get<int64_t>(), msg["msg"].get<std::string>());
+        }
+        save_conversation_index(conversation_id, index);
+    }
+
+    return conversation_index_cache.emplace(conversation_id, std::move(index)).first->second;
+}
+
+static void index_conversation_message(const std::string &conversation_id, const json &msg) {
+    std::lock_guard<std::mutex> lock(conversation_index_mutex);
+    auto &index = get_conversation_index(conversation_id);
+    const int64_t seq = msg["seq"].get<int64_t>();
+    const std::string &text = msg["msg"].get_ref<const std::string &>();
+    add_to_conversation_index(index, seq, text);
+    log_conversation_index_change(conversation_id, index, '+', seq, tokenize_message(text));
+}
+
+static void unindex_conversation_messages(const std::string &conversation_id, const json &deleted_messages) {
+    std::lock_guard<std::mutex> lock(conversation_index_mutex);
+    auto &index = get_conversation_index(conversation_id);
+    for (const auto &msg : deleted_messages) {
+        if (!msg.contains("seq") || !msg.contains("msg") || !msg["msg"].is_string())
+            continue;
+
+        const int64_t seq = msg["seq"].get<int64_t>();
+        const auto tokens = tokenize_message(msg["msg"].get<std::string>());
+        remove_from_conversation_index(index, seq, tokens);
+        log_conversation_index_change(conversation_id, index, '-', seq, tokens);
+    }
+}
+
+static void drop_conversation_index(const std::string &conversation_id) {
+    std::lock_guard<std::mutex> lock(conversation_index_mutex);
+    conversation_index_cache.erase(conversation_id);
+}
+
+// Helper: Get the sequence ids of the messages matching every query token
+static std::vector<int64_t> search_conversation_index(const std::string &conversation_id, const std::vector<std::string> &tokens) {
+    std::lock_guard<std::mutex> lock(conversation_index_mutex);
+    const auto &index = get_conversation_index(conversation_id);
+
+    std::vector<int64_t> result;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        auto posting_it = index.postings.find(tokens[i]);
+        if (posting_it == index.postings.end())
+            return {};
+
+        if (i == 0) {
+            result = posting_it->second;
+        } else {
+            std::vector<int64_t> intersection;
+            std::set_intersection(result.begin(), result.end(), posting_it->second.begin(), posting_it->second.end(), std::back_inserter(intersection));
+            result = std::move(intersection);
+        }
+
+        if (result.empty())
+            break;
+    }
+    return result;
+}
+
 // Helper: Check if user is in conversation
 static bool is_user_in_conversation(const std::string &conversation_id, const std::string &online_id) {
     json metadata = load_conversation_metadata(conversation_id);
@@ -143,46 +452,33 @@ static bool is_user_in_conversation(const std::string &conversation_id, const st
     return false;
 }
 
-void handle_messages_create(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "create conversation request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_create(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Parse JSON body
     json request_data;
     try {
-        request_data = json::parse(req.body);
+        request_data = json::parse(ctx.req.body);
     } catch (...) {
         log("Invalid JSON in create conversation request from " + online_id);
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     if (!request_data.contains("participants") || !request_data["participants"].is_array()) {
         log("Missing or invalid participants in create conversation request from " + online_id);
-        res.set_content("ERR:MissingParticipants", "text/plain");
-        return;
+        return "ERR:MissingParticipants";
     }
 
     if (!request_data.contains("message") || !request_data["message"].is_string()) {
         log("Missing message in create conversation request from " + online_id);
-        res.set_content("ERR:MissingMessage", "text/plain");
-        return;
+        return "ERR:MissingMessage";
     }
 
     const std::string first_message = request_data["message"].get<std::string>();
     if (first_message.empty() || first_message.size() > 2000) {
         log("Invalid message in create conversation request from " + online_id);
-        res.set_content("ERR:InvalidMessage", "text/plain");
-        return;
+        return "ERR:InvalidMessage";
     }
 
     // Extract participants (include creator)
@@ -192,8 +488,7 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
     for (const auto &p : request_data["participants"]) {
         if (!p.is_string()) {
             log("Invalid participant in create conversation request from " + online_id);
-            res.set_content("ERR:InvalidParticipant", "text/plain");
-            return;
+            return "ERR:InvalidParticipant";
         }
         std::string participant = trim_online_id(p.get<std::string>());
         if (!participant.empty() && participant != online_id) {
@@ -203,8 +498,7 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
 
     if (participants.size() < 2) {
         log("Conversation must have at least 2 participants (from " + online_id + ")");
-        res.set_content("ERR:NotEnoughParticipants", "text/plain");
-        return;
+        return "ERR:NotEnoughParticipants";
     }
 
     std::lock_guard<std::mutex> lock_db(account_mutex);
@@ -214,8 +508,7 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
     for (const auto &p : participants) {
         if (!db["users"].contains(p)) {
             log("Create conversation request with non-existing participant " + p + " by " + online_id);
-            res.set_content("ERR:ParticipantNotFound:" + p, "text/plain");
-            return;
+            return "ERR:ParticipantNotFound:" + p;
         }
     }
 
@@ -226,8 +519,7 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
     json metadata = load_conversation_metadata(conversation_id);
     if (!metadata.empty()) {
         log("Conversation " + conversation_id + " already exists");
-        res.set_content("ERR:ConversationAlreadyExists", "text/plain");
-        return;
+        return "ERR:ConversationAlreadyExists";
     }
 
     // Create conversation metadata
@@ -236,8 +528,6 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
     metadata["creator"] = online_id;
     metadata["created_at"] = std::time(0);
 
-    save_conversation_metadata(conversation_id, metadata);
-
     // Create first message
     json messages = json::array();
     json msg;
@@ -245,8 +535,17 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
     msg["msg"] = first_message;
     msg["timestamp"] = std::time(0);
     messages.push_back(msg);
+    ensure_message_seqs(metadata, messages);
+
+    update_conversation_summary(metadata, messages);
+    increment_unread_counters(metadata, online_id);
+    mark_conversation_read(metadata, online_id);
 
+    save_conversation_metadata(conversation_id, metadata);
     save_conversation_messages(conversation_id, messages);
+    index_conversation_message(conversation_id, messages.back());
+    add_stat("conversations", 1);
+    add_daily_stat("messages_sent");
 
     // Add conversation to each participant's list
     for (const auto &p : participants) {
@@ -261,119 +560,97 @@ void handle_messages_create(const httplib::Request &req, httplib::Response &res)
     messages_cv.notify_all();
 
     log("Conversation created: " + conversation_id + " by " + online_id + " with " + std::to_string(participants.size()) + " participants");
-    res.set_content("OK:" + conversation_id, "text/plain");
+    return "OK:" + conversation_id;
 }
 
-void handle_messages_send(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "message send request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
+std::string handle_messages_send(const EndpointContext &ctx, const std::string &message) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const std::string conversation_id = trim_online_id(req.get_param_value("conversation_id"));
+    const std::string conversation_id = trim_online_id(std::string(get_param_view(ctx.req, "conversation_id")));
     if (conversation_id.empty()) {
         log("Missing conversation_id on message send request for online_id " + online_id);
-        res.set_content("ERR:MissingConversationID", "text/plain");
-        return;
-    }
-
-    const std::string message = req.get_param_value("message");
-    if (message.empty()) {
-        log("Missing message on message send request for online_id " + online_id);
-        res.set_content("ERR:MissingMessage", "text/plain");
-        return;
+        return "ERR:MissingConversationID";
     }
 
     if (message.size() > 2000) {
         log("Message too long from " + online_id + " in conversation " + conversation_id);
-        res.set_content("ERR:MessageTooLong", "text/plain");
-        return;
+        return "ERR:MessageTooLong";
     }
 
     // Load conversation metadata
     json metadata = load_conversation_metadata(conversation_id);
     if (metadata.empty()) {
         log("Message send to non-existing conversation " + conversation_id + " by " + online_id);
-        res.set_content("ERR:ConversationNotFound", "text/plain");
-        return;
+        return "ERR:ConversationNotFound";
     }
 
     // Verify sender is in the conversation
     if (!is_user_in_conversation(conversation_id, online_id)) {
         log("Message send to conversation " + conversation_id + " by non-member " + online_id);
-        res.set_content("ERR:NotInConversation", "text/plain");
-        return;
+        return "ERR:NotInConversation";
     }
 
     // Load conversation messages
     json messages = load_conversation_messages(conversation_id);
+    ensure_message_seqs(metadata, messages);
 
     // Create message object
     json msg;
     msg["from"] = online_id;
     msg["msg"] = message;
     msg["timestamp"] = std::time(0);
+    msg["seq"] = metadata["next_seq"];
+    metadata["next_seq"] = msg["seq"].get<int64_t>() + 1;
 
     // Append to conversation messages
     messages.push_back(msg);
 
+    // Update unread counters, the sender has read everything up to its own message
+    update_conversation_summary(metadata, messages);
+    increment_unread_counters(metadata, online_id);
+    mark_conversation_read(metadata, online_id);
+
     // Save conversation messages
+    save_conversation_metadata(conversation_id, metadata);
     save_conversation_messages(conversation_id, messages);
+    index_conversation_message(conversation_id, msg);
+    add_daily_stat("messages_sent");
 
     // Notify all waiting polls
     messages_cv.notify_all();
 
     log("Message sent from " + online_id + " to conversation " + conversation_id);
-    res.set_content("OK:MessageSent", "text/plain");
+    return "OK:MessageSent";
 }
 
-void handle_messages_delete(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "message delete request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_delete(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Parse JSON body
     json request_data;
     try {
-        request_data = json::parse(req.body);
+        request_data = json::parse(ctx.req.body);
     } catch (...) {
         log("Invalid JSON in message delete request from " + online_id);
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     if (!request_data.contains("conversation_id") || !request_data["conversation_id"].is_string()) {
         log("Missing conversation_id in message delete request from " + online_id);
-        res.set_content("ERR:MissingConversationID", "text/plain");
-        return;
+        return "ERR:MissingConversationID";
     }
 
     if (!request_data.contains("timestamps") || !request_data["timestamps"].is_array()) {
         log("Missing or invalid timestamps in message delete request from " + online_id);
-        res.set_content("ERR:MissingTimestamps", "text/plain");
-        return;
+        return "ERR:MissingTimestamps";
     }
 
     const std::string conversation_id = request_data["conversation_id"].get<std::string>();
     if (conversation_id.empty()) {
         log("Empty conversation_id in message delete request from " + online_id);
-        res.set_content("ERR:EmptyConversationID", "text/plain");
-        return;
+        return "ERR:EmptyConversationID";
     }
 
     // Extract timestamps array
@@ -381,35 +658,32 @@ void handle_messages_delete(const httplib::Request &req, httplib::Response &res)
     for (const auto &ts : request_data["timestamps"]) {
         if (!ts.is_number_integer()) {
             log("Invalid timestamp in delete request from " + online_id);
-            res.set_content("ERR:InvalidTimestamp", "text/plain");
-            return;
+            return "ERR:InvalidTimestamp";
         }
         timestamps.push_back(ts.get<int64_t>());
     }
 
     if (timestamps.empty()) {
         log("No timestamps provided in delete request from " + online_id);
-        res.set_content("ERR:NoTimestamps", "text/plain");
-        return;
+        return "ERR:NoTimestamps";
     }
 
     // Load conversation metadata
     json metadata = load_conversation_metadata(conversation_id);
     if (metadata.empty()) {
         log("Message delete request to non-existing conversation " + conversation_id + " by " + online_id);
-        res.set_content("ERR:ConversationNotFound", "text/plain");
-        return;
+        return "ERR:ConversationNotFound";
     }
 
     // Verify requester is in the conversation
     if (!is_user_in_conversation(conversation_id, online_id)) {
         log("Message delete request to conversation " + conversation_id + " by non-member " + online_id);
-        res.set_content("ERR:NotInConversation", "text/plain");
-        return;
+        return "ERR:NotInConversation";
     }
 
     // Load conversation messages
     json messages = load_conversation_messages(conversation_id);
+    json deleted_messages = json::array();
     int deleted_count = 0;
 
     // Delete messages by timestamp (only if sent by this user)
@@ -422,6 +696,10 @@ void handle_messages_delete(const httplib::Request &req, httplib::Response &res)
                     break;
                 }
 
+                if (it->contains("seq"))
+                    decrement_unread_counters(metadata, online_id, (*it)["seq"].get<int64_t>());
+
+                deleted_messages.push_back(*it);
                 messages.erase(it);
                 deleted_count++;
                 break;
@@ -431,53 +709,43 @@ void handle_messages_delete(const httplib::Request &req, httplib::Response &res)
 
     if (deleted_count == 0) {
         log("No messages deleted for " + online_id + " in conversation " + conversation_id);
-        res.set_content("ERR:NoMessagesDeleted", "text/plain");
-        return;
+        return "ERR:NoMessagesDeleted";
     }
 
     // Save conversation messages
+    update_conversation_summary(metadata, messages);
+    save_conversation_metadata(conversation_id, metadata);
     save_conversation_messages(conversation_id, messages);
+    unindex_conversation_messages(conversation_id, deleted_messages);
 
     // Notify all waiting polls
     messages_cv.notify_all();
 
     log("Messages deleted by " + online_id + " in conversation " + conversation_id + " (count: " + std::to_string(deleted_count) + ")");
-    res.set_content("OK:MessagesDeleted:" + std::to_string(deleted_count), "text/plain");
+    return "OK:MessagesDeleted:" + std::to_string(deleted_count);
 }
 
-void handle_messages_add_participant(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "add participant request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_add_participant(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Parse JSON body
     json request_data;
     try {
-        request_data = json::parse(req.body);
+        request_data = json::parse(ctx.req.body);
     } catch (...) {
         log("Invalid JSON in add participant request from " + online_id);
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     if (!request_data.contains("conversation_id") || !request_data["conversation_id"].is_string()) {
         log("Missing conversation_id in add participant request from " + online_id);
-        res.set_content("ERR:MissingConversationID", "text/plain");
-        return;
+        return "ERR:MissingConversationID";
     }
 
     if (!request_data.contains("participant") || !request_data["participant"].is_string()) {
         log("Missing participant in add participant request from " + online_id);
-        res.set_content("ERR:MissingParticipant", "text/plain");
-        return;
+        return "ERR:MissingParticipant";
     }
 
     const std::string conversation_id = request_data["conversation_id"].get<std::string>();
@@ -485,8 +753,7 @@ void handle_messages_add_participant(const httplib::Request &req, httplib::Respo
 
     if (new_participant.empty()) {
         log("Empty participant in add participant request from " + online_id);
-        res.set_content("ERR:EmptyParticipant", "text/plain");
-        return;
+        return "ERR:EmptyParticipant";
     }
 
     std::lock_guard<std::mutex> lock_db(account_mutex);
@@ -495,34 +762,31 @@ void handle_messages_add_participant(const httplib::Request &req, httplib::Respo
     // Verify new participant exists
     if (!db["users"].contains(new_participant)) {
         log("Add participant request with non-existing user " + new_participant + " by " + online_id);
-        res.set_content("ERR:ParticipantNotFound", "text/plain");
-        return;
+        return "ERR:ParticipantNotFound";
     }
 
     // Load conversation metadata
     json metadata = load_conversation_metadata(conversation_id);
     if (metadata.empty() || !metadata.contains("participants")) {
         log("Add participant request to non-existing conversation " + conversation_id + " by " + online_id);
-        res.set_content("ERR:ConversationNotFound", "text/plain");
-        return;
+        return "ERR:ConversationNotFound";
     }
 
     // Verify requester is in the conversation
     if (!is_user_in_conversation(conversation_id, online_id)) {
         log("Add participant request to conversation " + conversation_id + " by non-member " + online_id);
-        res.set_content("ERR:NotInConversation", "text/plain");
-        return;
+        return "ERR:NotInConversation";
     }
 
     // Check if participant is already in conversation
     if (is_user_in_conversation(conversation_id, new_participant)) {
         log("Participant " + new_participant + " already in conversation " + conversation_id);
-        res.set_content("ERR:AlreadyInConversation", "text/plain");
-        return;
+        return "ERR:AlreadyInConversation";
     }
 
-    // Add participant to conversation
+    // Add participant to conversation, history from before joining is not counted as unread
     metadata["participants"].push_back(new_participant);
+    mark_conversation_read(metadata, new_participant);
     save_conversation_metadata(conversation_id, metadata);
 
     // Add conversation to new participant's list
@@ -536,36 +800,25 @@ void handle_messages_add_participant(const httplib::Request &req, httplib::Respo
     messages_cv.notify_all();
 
     log("Participant " + new_participant + " added to conversation " + conversation_id + " by " + online_id);
-    res.set_content("OK:ParticipantAdded", "text/plain");
+    return "OK:ParticipantAdded";
 }
 
-void handle_messages_leave(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "leave conversation request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_leave(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Parse JSON body
     json request_data;
     try {
-        request_data = json::parse(req.body);
+        request_data = json::parse(ctx.req.body);
     } catch (...) {
         log("Invalid JSON in leave conversation request from " + online_id);
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     if (!request_data.contains("conversation_id") || !request_data["conversation_id"].is_string()) {
         log("Missing conversation_id in leave conversation request from " + online_id);
-        res.set_content("ERR:MissingConversationID", "text/plain");
-        return;
+        return "ERR:MissingConversationID";
     }
 
     const std::string conversation_id = request_data["conversation_id"].get<std::string>();
@@ -574,15 +827,13 @@ void handle_messages_leave(const httplib::Request &req, httplib::Response &res)
     json metadata = load_conversation_metadata(conversation_id);
     if (metadata.empty() || !metadata.contains("participants")) {
         log("Leave conversation request to non-existing conversation " + conversation_id + " by " + online_id);
-        res.set_content("ERR:ConversationNotFound", "text/plain");
-        return;
+        return "ERR:ConversationNotFound";
     }
 
     // Verify requester is in the conversation
     if (!is_user_in_conversation(conversation_id, online_id)) {
         log("Leave conversation request to conversation " + conversation_id + " by non-member " + online_id);
-        res.set_content("ERR:NotInConversation", "text/plain");
-        return;
+        return "ERR:NotInConversation";
     }
 
     // Remove participant from conversation
@@ -594,6 +845,11 @@ void handle_messages_leave(const httplib::Request &req, httplib::Response &res)
             }),
         participants.end());
 
+    if (metadata.contains("unread") && metadata["unread"].is_object())
+        metadata["unread"].erase(online_id);
+    if (metadata.contains("read_seq") && metadata["read_seq"].is_object())
+        metadata["read_seq"].erase(online_id);
+
     save_conversation_metadata(conversation_id, metadata);
 
     // Remove conversation from user's list
@@ -607,36 +863,25 @@ void handle_messages_leave(const httplib::Request &req, httplib::Response &res)
     messages_cv.notify_all();
 
     log("User " + online_id + " left conversation " + conversation_id);
-    res.set_content("OK:LeftConversation", "text/plain");
+    return "OK:LeftConversation";
 }
 
-void handle_messages_delete_conversation(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "delete conversation request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_delete_conversation(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Parse JSON body
     json request_data;
     try {
-        request_data = json::parse(req.body);
+        request_data = json::parse(ctx.req.body);
     } catch (...) {
         log("Invalid JSON in delete conversation request from " + online_id);
-        res.set_content("ERR:InvalidJSON", "text/plain");
-        return;
+        return "ERR:InvalidJSON";
     }
 
     if (!request_data.contains("conversation_id") || !request_data["conversation_id"].is_string()) {
         log("Missing conversation_id in delete conversation request from " + online_id);
-        res.set_content("ERR:MissingConversationID", "text/plain");
-        return;
+        return "ERR:MissingConversationID";
     }
 
     const std::string conversation_id = request_data["conversation_id"].get<std::string>();
@@ -645,15 +890,13 @@ void handle_messages_delete_conversation(const httplib::Request &req, httplib::R
     json metadata = load_conversation_metadata(conversation_id);
     if (metadata.empty()) {
         log("Delete conversation request to non-existing conversation " + conversation_id + " by " + online_id);
-        res.set_content("ERR:ConversationNotFound", "text/plain");
-        return;
+        return "ERR:ConversationNotFound";
     }
 
     // Verify requester is the creator
     if (!metadata.contains("creator") || metadata["creator"].get<std::string>() != online_id) {
         log("Delete conversation request to conversation " + conversation_id + " by non-creator " + online_id);
-        res.set_content("ERR:NotCreator", "text/plain");
-        return;
+        return "ERR:NotCreator";
     }
 
     // Remove conversation from all participants' lists
@@ -672,27 +915,20 @@ void handle_messages_delete_conversation(const httplib::Request &req, httplib::R
     }
 
     // Delete conversation files
+    drop_conversation_index(conversation_id);
     fs::remove_all(get_conversation_dir(conversation_id));
+    add_stat("conversations", -1);
 
     // Notify all waiting polls
     messages_cv.notify_all();
 
     log("Conversation " + conversation_id + " deleted by creator " + online_id);
-    res.set_content("OK:ConversationDeleted", "text/plain");
+    return "OK:ConversationDeleted";
 }
 
-void handle_messages_conversations(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "conversations list request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_conversations(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
     // Build JSON array of conversations
     json response = json::array();
@@ -710,89 +946,63 @@ void handle_messages_conversations(const httplib::Request &req, httplib::Respons
         if (metadata.empty())
             continue;
 
-        json messages = load_conversation_messages(conversation_id);
+        // Conversations without summary fields predate unread counters, fall back to reading the messages file
+        if (!metadata.contains("count"))
+            update_conversation_summary(metadata, load_conversation_messages(conversation_id));
 
         json conv;
         conv["online_id"] = conversation_id; // Use conversation_id as identifier
-        conv["count"] = messages.size();
+        conv["count"] = metadata["count"];
         conv["creator"] = metadata.value("creator", "");
         conv["participants"] = metadata.value("participants", json::array());
+        conv["unread"] = metadata.contains("unread") && metadata["unread"].is_object() ? metadata["unread"].value(online_id, int64_t{ 0 }) : 0;
 
-        if (!messages.empty()) {
-            conv["last_message"] = messages.back();
+        if (metadata.contains("last_message")) {
+            conv["last_message"] = metadata["last_message"];
         }
 
         response.push_back(conv);
     }
 
     log("Conversations list requested by " + online_id + " (" + std::to_string(response.size()) + " conversations)");
-    res.set_content(response.dump(), "application/json");
+    return response.dump();
 }
 
-void handle_messages_read(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_messages_read(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    std::string err;
-    const auto account = get_valid_account(req, "messages read request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
-
-    const std::string conversation_id = trim_online_id(req.get_param_value("conversation_id"));
+    const std::string conversation_id = trim_online_id(std::string(get_param_view(ctx.req, "conversation_id")));
     if (conversation_id.empty()) {
         log("Missing conversation_id on messages read request for online_id " + online_id);
-        res.set_content("ERR:MissingConversationID", "text/plain");
-        return;
+        return "ERR:MissingConversationID";
     }
 
     // Load conversation metadata
     json metadata = load_conversation_metadata(conversation_id);
     if (metadata.empty()) {
         log("Messages read request to non-existing conversation " + conversation_id + " by " + online_id);
-        res.set_content("ERR:ConversationNotFound", "text/plain");
-        return;
+        return "ERR:ConversationNotFound";
     }
 
     // Verify requester is in the conversation
     if (!is_user_in_conversation(conversation_id, online_id)) {
         log("Messages read request to conversation " + conversation_id + " by non-member " + online_id);
-        res.set_content("ERR:NotInConversation", "text/plain");
-        return;
+        return "ERR:NotInConversation";
     }
 
     // Load conversation messages
     json messages = load_conversation_messages(conversation_id);
 
     log("Messages read: " + online_id + " <-> conversation " + conversation_id + " (" + std::to_string(messages.size()) + " messages)");
-    res.set_content(messages.dump(), "application/json");
+    return messages.dump();
 }
 
-void handle_messages_poll(const httplib::Request &req, httplib::Response &res) {
-    std::string err;
-    const auto account = get_valid_account(req, "messages poll request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_messages_poll(const EndpointContext &ctx, std::optional<int64_t> since) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    const std::string since_str = req.get_param_value("since");
-    int64_t since_timestamp = 0;
-    if (!since_str.empty()) {
-        try {
-            since_timestamp = std::stoll(since_str);
-        } catch (...) {
-            log("Invalid timestamp in poll request from " + online_id);
-            res.set_content("ERR:InvalidTimestamp", "text/plain");
-            return;
-        }
-    }
+    const int64_t since_timestamp = since.value_or(0);
 
     const auto start = std::chrono::steady_clock::now();
     const auto timeout = std::chrono::seconds(30);
@@ -830,8 +1040,7 @@ void handle_messages_poll(const httplib::Request &req, httplib::Response &res) {
 
         if (!new_messages.empty()) {
             log("Poll: " + online_id + " - " + std::to_string(new_messages.size()) + " new messages");
-            res.set_content(new_messages.dump(), "application/json");
-            return;
+            return new_messages.dump();
         }
 
         // Calculate remaining time
@@ -840,8 +1049,7 @@ void handle_messages_poll(const httplib::Request &req, httplib::Response &res) {
 
         if (remaining <= std::chrono::seconds(0)) {
             json empty = json::array();
-            res.set_content(empty.dump(), "application/json");
-            return;
+            return empty.dump();
         }
 
         // Wait for notification or timeout
@@ -850,5 +1058,177 @@ void handle_messages_poll(const httplib::Request &req, httplib::Response &res) {
     }
 
     json empty = json::array();
-    res.set_content(empty.dump(), "application/json");
+    return empty.dump();
+}
+
+std::string handle_messages_mark_read(const EndpointContext &ctx) {
+    const std::string &online_id = ctx.account.online_id;
+
+    const std::string conversation_id = trim_online_id(std::string(get_param_view(ctx.req, "conversation_id")));
+    if (conversation_id.empty()) {
+        log("Missing conversation_id on mark read request for online_id " + online_id);
+        return "ERR:MissingConversationID";
+    }
+
+    // Load conversation metadata
+    json metadata = load_conversation_metadata(conversation_id);
+    if (metadata.empty()) {
+        log("Mark read request to non-existing conversation " + conversation_id + " by " + online_id);
+        return "ERR:ConversationNotFound";
+    }
+
+    // Verify requester is in the conversation
+    if (!is_user_in_conversation(conversation_id, online_id)) {
+        log("Mark read request to conversation " + conversation_id + " by non-member " + online_id);
+        return "ERR:NotInConversation";
+    }
+
+    // Conversations created before sequence ids existed get them on first use
+    if (!metadata.contains("next_seq")) {
+        json messages = load_conversation_messages(conversation_id);
+        ensure_message_seqs(metadata, messages);
+        update_conversation_summary(metadata, messages);
+        save_conversation_messages(conversation_id, messages);
+    }
+
+    mark_conversation_read(metadata, online_id);
+    save_conversation_metadata(conversation_id, metadata);
+
+    log("Conversation " + conversation_id + " marked as read by " + online_id);
+    return "OK:MarkedRead";
+}
+
+std::string handle_messages_search(const EndpointContext &ctx) {
+    const std::string &online_id = ctx.account.online_id;
+
+    const std::string query(get_param_view(ctx.req, "query"));
+    const std::vector<std::string> tokens = tokenize_message(query);
+    if (tokens.empty()) {
+        log("Messages search request with too short query from " + online_id);
+        return "ERR:QueryTooShort";
+    }
+
+    constexpr size_t max_results = 50;
+
+    json results = json::array();
+    for (const auto &conv_id_json : load_user_conversations(online_id)) {
+        if (!conv_id_json.is_string())
+            continue;
+
+        const std::string conversation_id = conv_id_json.get<std::string>();
+        const std::vector<int64_t> seqs = search_conversation_index(conversation_id, tokens);
+        if (seqs.empty())
+            continue;
+
+        // Messages are stored in sequence order, only the matching ones are picked
+        for (const auto &msg : load_conversation_messages(conversation_id)) {
+            if (!msg.contains("seq") || !std::binary_search(seqs.begin(), seqs.end(), msg["seq"].get<int64_t>()))
+                continue;
+
+            json entry;
+            entry["conversation_id"] = conversation_id;
+            entry["message"] = msg;
+            results.push_back(entry);
+        }
+    }
+
+    // Most recent matches first
+    std::stable_sort(results.begin(), results.end(), [](const json &a, const json &b) {
+        return a["message"].value("timestamp", int64_t{ 0 }) > b["message"].value("timestamp", int64_t{ 0 });
+    });
+    if (results.size() > max_results)
+        results.erase(results.begin() + max_results, results.end());
+
+    log("Messages search by " + online_id + " -> " + std::to_string(results.size()) + " result(s)");
+    return results.dump();
+}
+
+// Remove a deleted account from all its conversations, conversations left without participants are deleted
+void purge_account_conversations(const std::string &online_id) {
+    const json user_conversations = load_user_conversations(online_id);
+    for (const auto &conv_id_json : user_conversations) {
+        if (!conv_id_json.is_string())
+            continue;
+
+        const std::string conversation_id = conv_id_json.get<std::string>();
+        json metadata = load_conversation_metadata(conversation_id);
+        if (metadata.empty())
+            continue;
+
+        auto &participants = metadata["participants"];
+        participants.erase(
+            std::remove_if(participants.begin(), participants.end(),
+                [&online_id](const json &p) {
+                    return p.is_string() && p.get<std::string>() == online_id;
+                }),
+            participants.end());
+
+        if (participants.empty()) {
+            drop_conversation_index(conversation_id);
+            fs::remove_all(get_conversation_dir(conversation_id));
+            add_stat("conversations", -1);
+            continue;
+        }
+
+        if (metadata.contains("unread") && metadata["unread"].is_object())
+            metadata["unread"].erase(online_id);
+        if (metadata.contains("read_seq") && metadata["read_seq"].is_object())
+            metadata["read_seq"].erase(online_id);
+
+        save_conversation_metadata(conversation_id, metadata);
+    }
+
+    messages_cv.notify_all();
+    log("Purged conversations of deleted online ID " + online_id + " (" + std::to_string(user_conversations.size()) + " conversation(s))");
+}
+
+// Rebuild the derived data of a conversation (sequence ids, summary fields, search index) from its messages file
+void rebuild_conversation_caches(const std::string &conversation_id) {
+    json metadata = load_conversation_metadata(conversation_id);
+    json messages = load_conversation_messages(conversation_id);
+    ensure_message_seqs(metadata, messages);
+    update_conversation_summary(metadata, messages);
+    save_conversation_metadata(conversation_id, metadata);
+    save_conversation_messages(conversation_id, messages);
+
+    ConversationIndex index;
+    for (const auto &msg : messages) {
+        if (msg.contains("seq") && msg.contains("msg") && msg["msg"].is_string())
+            add_to_conversation_index(index, msg["seq"].get<int64_t>(), msg["msg"].get<std::string>());
+    }
+    save_conversation_index(conversation_id, index);
+    drop_conversation_index(conversation_id);
+}
+
+// Helper: Estimate the memory used by a cached search index
+static size_t estimate_conversation_index_bytes(const std::string &conversation_id, const ConversationIndex &index) {
+    size_t bytes = 2 * sizeof(void *) + estimate_string_bytes(conversation_id) + sizeof(ConversationIndex) + index.postings.bucket_count() * sizeof(void *);
+    for (const auto &[token, seqs] : index.postings)
+        bytes += 2 * sizeof(void *) + estimate_string_bytes(token) + sizeof(seqs) + seqs.capacity() * sizeof(int64_t);
+    return bytes;
+}
+
+// Search indexes are persisted in each conversation directory, evicted ones are reloaded on the next search
+static void register_messages_memory_consumers() {
+    MemoryConsumer indexes;
+    indexes.name = "conversation_index_cache";
+    indexes.usage = [] {
+        std::lock_guard<std::mutex> lock(conversation_index_mutex);
+        MemoryUsage usage;
+        usage.entries = conversation_index_cache.size();
+        for (const auto &[conversation_id, index] : conversation_index_cache)
+            usage.bytes += estimate_conversation_index_bytes(conversation_id, index);
+        return usage;
+    };
+    indexes.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(conversation_index_mutex);
+        size_t freed = 0;
+        for (auto it = conversation_index_cache.begin(); it != conversation_index_cache.end() && freed < bytes_to_free;) {
+            freed += estimate_conversation_index_bytes(it->first, it->second);
+            it = conversation_index_cache.erase(it);
+        }
+        return freed;
+    };
+    indexes.cost = 2;
+    register_memory_consumer(std::move(indexes));
 }
@@ -0,0 +1,14 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <httplib.h>
+#include <utils/endpoint.h>
+
+#include <optional>
+#include <string>
+
+void register_profiler_endpoints(httplib::Server &server);
+
+std::string handle_admin_profile(const EndpointContext &ctx, std::optional<int> seconds_param, std::optional<int> frequency_param);
@@ -0,0 +1,178 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#include "profiler/profiler.h"
+#include "utils/endpoint.h"
+#include "utils/utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+constexpr int MAX_PROFILE_SECONDS = 60;
+constexpr int MAX_PROFILE_FREQUENCY = 1000; // Hz
+constexpr size_t MAX_PROFILE_SAMPLES = 20000;
+constexpr int MAX_PROFILE_DEPTH = 48;
+
+// Runs for the whole profile duration, without request_mutex
+using AdminProfile = Endpoint<"/v3kn/admin/profile", EndpointMethod::Get, EndpointAuth::Admin, EndpointLock::None, EndpointResponse::Text,
+    OptionalParam<"seconds", int, "Parameters">, OptionalParam<"hz", int, "Parameters">>;
+
+void register_profiler_endpoints(httplib::Server &server) {
+    AdminProfile::register_handler<handle_admin_profile>(server);
+}
+
+#ifndef _WIN32
+// Sample buffer written from the signal handler, allocated for the duration of a profile
+struct ProfileSample {
+    int depth;
+    void *frames[MAX_PROFILE_DEPTH];
+};
+
+static std::atomic<bool> profiler_busy{ false };
+static std::atomic<ProfileSample *> profile_samples{ nullptr };
+static std::atomic<size_t> profile_sample_count{ 0 };
+
+static void profile_signal_handler(int) {
+    ProfileSample *samples = profile_samples.load(std::memory_order_acquire);
+    if (!samples)
+        return;
+
+    const size_t index = profile_sample_count.fetch_add(1, std::memory_order_relaxed);
+    if (index >= MAX_PROFILE_SAMPLES)
+        return;
+
+    const int saved_errno = errno;
+    samples[index].depth = backtrace(samples[index].frames, MAX_PROFILE_DEPTH);
+    errno = saved_errno;
+}
+
+// Helper: Resolve a frame address with the binary's own symbols (the executable is linked with exported symbols)
+static std::string symbolize_frame(void *address, std::unordered_map<void *, std::string> &symbols) {
+    auto it = symbols.find(address);
+    if (it != symbols.end())
+        return it->second;
+
+    std::string name;
+    Dl_info info;
+    if (dladdr(address, &info) && info.dli_sname) {
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        name = status == 0 && demangled ? demangled : info.dli_sname;
+        free(demangled);
+    } else if (dladdr(address, &info) && info.dli_fname) {
+        const std::string module = info.dli_fname;
+        name = module.substr(module.find_last_of('/') + 1) + "+" + std::to_string(reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+    } else {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%p", address);
+        name = buffer;
+    }
+
+    // ';' separates frames in the collapsed format
+    std::replace(name.begin(), name.end(), ';', ':');
+    return symbols.emplace(address, name).first->second;
+}
+
+// Helper: Fold samples into collapsed stacks ("root;...;leaf count" per line)
+static std::string collapse_samples(const std::vector<ProfileSample> &samples, size_t count) {
+    std::unordered_map<void *, std::string> symbols;
+    std::map<std::string, size_t> stacks;
+    for (size_t i = 0; i < count; ++i) {
+        const auto &sample = samples[i];
+
+        // Skip the signal handler and the kernel trampoline frames
+        std::string stack;
+        for (int frame = sample.depth - 1; frame >= 2; --frame) {
+            if (!stack.empty())
+                stack += ';';
+            stack += symbolize_frame(sample.frames[frame], symbols);
+        }
+        if (!stack.empty())
+            ++stacks[stack];
+    }
+
+    std::string collapsed;
+    for (const auto &[stack, samples_count] : stacks)
+        collapsed += stack + " " + std::to_string(samples_count) + "\n";
+    return collapsed;
+}
+#endif
+
+std::string handle_admin_profile(const EndpointContext &ctx, std::optional<int> seconds_param, std::optional<int> frequency_param) {
+#ifdef _WIN32
+    return "ERR:NotSupported";
+#else
+    const int seconds = std::clamp(seconds_param.value_or(10), 1, MAX_PROFILE_SECONDS);
+    const int frequency = std::clamp(frequency_param.value_or(100), 1, MAX_PROFILE_FREQUENCY);
+
+    bool expected = false;
+    if (!profiler_busy.compare_exchange_strong(expected, true)) {
+        return "ERR:ProfilerBusy";
+    }
+
+    // backtrace lazily loads the unwinder, do it once outside of the signal handler
+    void *warmup[1];
+    backtrace(warmup, 1);
+
+    std::vector<ProfileSample> samples(MAX_PROFILE_SAMPLES);
+    profile_sample_count = 0;
+    profile_samples.store(samples.data(), std::memory_order_release);
+
+    struct sigaction action = {};
+    struct sigaction previous_action = {};
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous_action);
+
+    // ITIMER_PROF counts CPU time of the whole process, the signal lands on the thread that is running
+    // tv_usec must stay below one second, 1 Hz is a whole second interval
+    const int interval_us = 1000000 / frequency;
+    struct itimerval timer = {};
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        log(std::string("Profiler failed to start the timer: ") + std::strerror(errno));
+        profile_samples.store(nullptr, std::memory_order_release);
+        sigaction(SIGPROF, &previous_action, nullptr);
+        profiler_busy = false;
+        return "ERR:ProfilerTimerFailed";
+    }
+
+    log("Profiler started for " + std::to_string(seconds) + " seconds at " + std::to_string(frequency) + " Hz");
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    const struct itimerval stop_timer = {};
+    setitimer(ITIMER_PROF, &stop_timer, nullptr);
+    profile_samples.store(nullptr, std::memory_order_release);
+
+    // Let any handler still running on another thread finish with the buffer
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    sigaction(SIGPROF, &previous_action, nullptr);
+
+    const size_t total = profile_sample_count;
+    const size_t count = std::min(total, MAX_PROFILE_SAMPLES);
+    log("Profiler stopped, " + std::to_string(total) + " samples (" + std::to_string(total - count) + " dropped)");
+
+    std::string collapsed = collapse_samples(samples, count);
+    profiler_busy = false;
+    return collapsed;
+#endif
+}
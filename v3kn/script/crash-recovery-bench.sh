@@ -0,0 +1,161 @@
+#!/bin/bash
+
+# Crash-recovery benchmark: runs the server on a synthetic data directory, kills it with SIGKILL
+# at random points under write load, restarts it and checks that no acknowledged write was lost.
+#
+# Usage: crash-recovery-bench.sh <path to v3kn.bin> [iterations] [accounts per iteration]
+# Requires curl and python3. The server listens on port 3000, nothing else may use it.
+
+BIN="$1"
+ITERATIONS="${2:-10}"
+ACCOUNTS="${3:-40}"
+URL="http://127.0.0.1:3000"
+VERSION="1"
+PASSWORD=$(printf 'bench-password' | base64)
+
+if [ -z "$BIN" ] || [ ! -x "$BIN" ]; then
+    echo "Usage: $0 <path to v3kn.bin> [iterations] [accounts per iteration]"
+    exit 1
+fi
+
+WORKDIR=$(mktemp -d)
+cp "$BIN" "$WORKDIR/v3kn.bin"
+mkdir -p "$WORKDIR/v3kn"
+cd "$WORKDIR" || exit 1
+echo "=== v3kn crash-recovery benchmark in $WORKDIR ==="
+
+SERVER_PID=""
+start_server() {
+    ./v3kn.bin >>server.out 2>&1 &
+    SERVER_PID=$!
+
+    # Recovery time: from process start until the server answers
+    local start
+    start=$(date +%s%N)
+    until curl -s -o /dev/null "$URL/"; do
+        if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+            echo "Server failed to start, see $WORKDIR/server.out"
+            exit 1
+        fi
+        sleep 0.01
+    done
+    RECOVERY_MS=$((($(date +%s%N) - start) / 1000000))
+}
+
+# Write load: create accounts, then friend requests between them, every acknowledged write is recorded
+write_load() {
+    local iteration=$1
+    local previous_id=""
+    local previous_token=""
+    for i in $(seq 1 "$ACCOUNTS"); do
+        local online_id="b${iteration}x${i}"
+        local reply
+        reply=$(curl -s -X POST "$URL/v3kn/create?online_id=$online_id&password=$PASSWORD&version=$VERSION")
+        case "$reply" in
+        OK:*) echo "$online_id" >>acked_accounts.txt ;;
+        *) continue ;;
+        esac
+        local token="${reply#OK:}"
+
+        if [ -n "$previous_token" ]; then
+            reply=$(curl -s -X POST -H "Authorization: Bearer $previous_token" "$URL/v3kn/friends/add?target_online_id=$online_id")
+            [ "$reply" = "OK:RequestSent" ] && echo "$previous_id $online_id" >>acked_requests.txt
+        fi
+        previous_id="$online_id"
+        previous_token="$token"
+    done
+}
+
+# Integrity check: every JSON file must parse, acknowledged writes must be present
+verify() {
+    python3 - <<'EOF'
+import glob, json, os
+
+corrupted = []
+def load(path):
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except FileNotFoundError:
+        return None
+    except ValueError:
+        corrupted.append(path)
+        return None
+
+users = load("v3kn/users.json") or {"users": {}}
+load("v3kn/events.json")
+# Both the flat layout and the hashed buckets (root/hh/hh/entry) are checked
+for root in ("v3kn/Users", "v3kn/conversations"):
+    for path in glob.glob(root + "/*/*.json") + glob.glob(root + "/*/*/*/*.json"):
+        load(path)
+
+online_ids = {}
+for account_id, user in users.get("users", {}).items():
+    if isinstance(user, dict) and "online_id" in user:
+        online_ids[user["online_id"]] = account_id
+
+def read_lines(path):
+    if not os.path.exists(path):
+        return []
+    with open(path) as f:
+        return [line.split() for line in f if line.strip()]
+
+acked_accounts = read_lines("acked_accounts.txt")
+lost_accounts = [a[0] for a in acked_accounts if a[0] not in online_ids]
+
+def has_request(online_id, kind, target_online_id):
+    paths = glob.glob("v3kn/Users/*/*/%s/friends.json" % online_id) + ["v3kn/Users/%s/friends.json" % online_id]
+    friends = load(paths[0]) or {}
+    target = online_ids.get(target_online_id)
+    return any(e.get("account_id") == target for e in friends.get("friend_requests", {}).get(kind, []))
+
+acked_requests = read_lines("acked_requests.txt")
+lost_requests = 0
+half_requests = 0
+for sender, target in acked_requests:
+    sent = has_request(sender, "sent", target)
+    received = has_request(target, "received", sender)
+    if not sent and not received:
+        lost_requests += 1
+    elif sent != received:
+        half_requests += 1
+
+print("RESULT %d %d %d %d %d %d" % (len(corrupted), len(acked_accounts), len(lost_accounts), len(acked_requests), lost_requests, half_requests))
+for path in corrupted:
+    print("  corrupted: " + path)
+EOF
+}
+
+TOTAL_RECOVERY_MS=0
+MAX_RECOVERY_MS=0
+TOTAL_CORRUPTED=0
+for iteration in $(seq 1 "$ITERATIONS"); do
+    start_server
+    TOTAL_RECOVERY_MS=$((TOTAL_RECOVERY_MS + RECOVERY_MS))
+    [ "$RECOVERY_MS" -gt "$MAX_RECOVERY_MS" ] && MAX_RECOVERY_MS=$RECOVERY_MS
+
+    write_load "$iteration" &
+    LOAD_PID=$!
+
+    # Kill at a random point between 100 ms and 2 s into the load
+    sleep "$(awk -v r=$RANDOM 'BEGIN { printf "%.3f", 0.1 + (r % 1900) / 1000 }')"
+    kill -9 "$SERVER_PID"
+    wait "$SERVER_PID" 2>/dev/null
+    wait "$LOAD_PID" 2>/dev/null
+
+    read -r _ corrupted acked lost acked_requests lost_requests half_requests < <(verify | head -n 1)
+    TOTAL_CORRUPTED=$((TOTAL_CORRUPTED + corrupted))
+    echo "[$iteration] recovery ${RECOVERY_MS} ms, corrupted files $corrupted, accounts lost $lost/$acked, friend requests lost $lost_requests/$acked_requests, half-applied $half_requests (cumulative)"
+done
+
+# Final restart to measure recovery from the last crash
+start_server
+kill -9 "$SERVER_PID"
+wait "$SERVER_PID" 2>/dev/null
+echo "=== Summary ==="
+echo "Recovery time: average $((TOTAL_RECOVERY_MS / ITERATIONS)) ms, max $MAX_RECOVERY_MS ms, after last crash $RECOVERY_MS ms"
+verify | sed -n '2,$p'
+echo "Corrupted file observations: $TOTAL_CORRUPTED"
+echo "Data directory kept in $WORKDIR"
+
+[ "$TOTAL_CORRUPTED" -eq 0 ]
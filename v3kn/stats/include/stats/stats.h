@@ -0,0 +1,22 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <httplib.h>
+#include <nlohmann/json.hpp>
+#include <utils/endpoint.h>
+
+#include <cstdint>
+#include <string>
+
+// Server statistics, maintained by the handlers as they change the data and checkpointed to v3kn/stats.json
+void register_stats_endpoints(httplib::Server &server);
+
+// Running total, e.g. users or storage_bytes
+void add_stat(const std::string &name, int64_t delta);
+// Running total also counted in the bucket of the current UTC day, e.g. messages_sent
+void add_daily_stat(const std::string &name, int64_t delta = 1);
+nlohmann::json get_stats_snapshot();
+
+std::string handle_admin_stats(const EndpointContext &ctx);
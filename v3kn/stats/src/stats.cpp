@@ -0,0 +1,144 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#include "stats/stats.h"
+#include "utils/utils.h"
+
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+// Totals and per-day buckets, read by the admin endpoint as they are (no walk of users.json or the data tree)
+static json stats = json::object();
+static bool stats_dirty = false;
+static std::mutex stats_mutex;
+
+constexpr size_t MAX_STATS_DAYS = 90;
+constexpr auto STATS_CHECKPOINT_INTERVAL = std::chrono::seconds(60);
+
+// Helper: Current UTC day, the key of the daily buckets
+static std::string get_stats_day() {
+    const std::time_t now = std::time(0);
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+
+    char daybuf[16];
+    std::strftime(daybuf, sizeof(daybuf), "%Y-%m-%d", &tm);
+    return daybuf;
+}
+
+// Helper: Totals that can be derived from the data, computed once when there is no checkpoint yet
+static json bootstrap_stats() {
+    int64_t users = 0;
+    int64_t storage_bytes = 0;
+    const json db = load_users();
+    if (db.contains("users") && db["users"].is_object()) {
+        for (const auto &[account_id, user] : db["users"].items()) {
+            if (!user.is_object() || user.contains("deleted_at"))
+                continue;
+
+            ++users;
+            storage_bytes += user.value("quota_used", int64_t{ 0 });
+        }
+    }
+
+    json totals = json::object();
+    totals["users"] = users;
+    totals["storage_bytes"] = storage_bytes;
+    totals["conversations"] = static_cast<int64_t>(list_data_entries(DataTree::Conversations).size());
+    return json{ { "tracked_since", std::time(0) }, { "totals", totals }, { "daily", json::object() } };
+}
+
+static void load_stats() {
+    std::ifstream file("v3kn/stats.json");
+    if (file) {
+        json loaded = json::parse(file, nullptr, false);
+        if (loaded.is_object() && loaded.contains("totals") && loaded["totals"].is_object()) {
+            if (!loaded.contains("daily") || !loaded["daily"].is_object())
+                loaded["daily"] = json::object();
+            stats = std::move(loaded);
+            return;
+        }
+        log("Corrupted stats.json, rebuilding the totals from the data");
+    }
+
+    stats = bootstrap_stats();
+    stats_dirty = true;
+    log("Stats bootstrapped: " + stats["totals"].dump());
+}
+
+// Helper: Write the stats when they changed since the last checkpoint
+static void checkpoint_stats() {
+    json snapshot;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        if (!stats_dirty)
+            return;
+
+        stats["checkpointed_at"] = std::time(0);
+        snapshot = stats;
+        stats_dirty = false;
+    }
+
+    write_file_atomic("v3kn/stats.json", snapshot.dump(2));
+}
+
+static void checkpoint_stats_periodically() {
+    while (true) {
+        std::this_thread::sleep_for(STATS_CHECKPOINT_INTERVAL);
+        checkpoint_stats();
+    }
+}
+
+using AdminStats = Endpoint<"/v3kn/admin/stats", EndpointMethod::Get, EndpointAuth::Admin, EndpointLock::None, EndpointResponse::Json>;
+
+void register_stats_endpoints(httplib::Server &server) {
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        load_stats();
+    }
+    checkpoint_stats();
+
+    AdminStats::register_handler<handle_admin_stats>(server);
+
+    static std::thread checkpoint_thread(checkpoint_stats_periodically);
+    checkpoint_thread.detach();
+}
+
+void add_stat(const std::string &name, int64_t delta) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto &total = stats["totals"][name];
+    total = total.is_number_integer() ? total.get<int64_t>() + delta : delta;
+    stats_dirty = true;
+}
+
+void add_daily_stat(const std::string &name, int64_t delta) {
+    const std::string day = get_stats_day();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto &total = stats["totals"][name];
+    total = total.is_number_integer() ? total.get<int64_t>() + delta : delta;
+
+    auto &daily = stats["daily"];
+    auto &bucket = daily[day][name];
+    bucket = bucket.is_number_integer() ? bucket.get<int64_t>() + delta : delta;
+
+    // Day keys sort chronologically, the oldest buckets are dropped
+    while (daily.size() > MAX_STATS_DAYS)
+        daily.erase(daily.begin());
+    stats_dirty = true;
+}
+
+json get_stats_snapshot() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return stats;
+}
+
+std::string handle_admin_stats(const EndpointContext &ctx) {
+    return get_stats_snapshot().dump();
+}
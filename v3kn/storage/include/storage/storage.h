@@ -4,14 +4,28 @@
 #pragma once
 
 #include <httplib.h>
+#include <nlohmann/json.hpp>
+#include <utils/endpoint.h>
+
+#include <filesystem>
+#include <string>
 
 void register_storage_endpoints(httplib::Server &server);
 
-void handle_get_save_info(const httplib::Request &req, httplib::Response &res);
-void handle_get_trophies_info(const httplib::Request &req, httplib::Response &res);
-void handle_download_file(const httplib::Request &req, httplib::Response &res);
-void handle_upload_file(const httplib::Request &req, httplib::Response &res);
-void handle_check_trophy_conf_data(const httplib::Request &req, httplib::Response &res);
-void handle_upload_trophy_conf_data(const httplib::Request &req, httplib::Response &res);
-void handle_check_stitle_info(const httplib::Request &req, httplib::Response &res);
-void handle_upload_stitle_info(const httplib::Request &req, httplib::Response &res);
+void purge_account_trophies_rarity(const std::string &online_id);
+void collect_trophies_rarity(const std::string &online_id, nlohmann::json &rarity_json);
+void save_trophies_rarity(const nlohmann::json &rarity_json);
+
+// Bytes of a savedata directory charged to the quota: the distinct contents of its retained versions
+uint64_t get_savedata_unique_size(const std::filesystem::path &savedata_dir);
+
+std::string handle_get_save_info(const EndpointContext &ctx, const std::string &titleid);
+std::string handle_get_trophies_info(const EndpointContext &ctx);
+std::string handle_download_file(const EndpointContext &ctx);
+std::string handle_upload_file(const EndpointContext &ctx);
+std::string handle_check_trophy_conf_data(const EndpointContext &ctx);
+std::string handle_upload_trophy_conf_data(const EndpointContext &ctx);
+std::string handle_check_stitle_info(const EndpointContext &ctx, const std::string &titleid);
+std::string handle_upload_stitle_info(const EndpointContext &ctx);
+std::string handle_get_save_versions(const EndpointContext &ctx, const std::string &titleid);
+std::string handle_restore_save_version(const EndpointContext &ctx, const std::string &titleid, int64_t version);
@@ -1,198 +1,169 @@
 // v3knr project
 // Copyright (C) 2026 Vita3K team
 
+#include "stats/stats.h"
 #include "storage/storage.h"
+#include "utils/params.h"
 #include "utils/utils.h"
 
 #include <pugixml.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
 #include <sstream>
 
+static std::string get_upload_etag(const fs::path &base_path, const std::string &type);
+static void clear_upload_staging();
+
+// Files, XML and ETags are written to the response by the handlers (Custom), uploads take request_mutex themselves
+using SaveTitleIDParam = RequiredParam<"titleid", std::string, "TitleID", is_savedata_id>;
+using GetSaveInfo = Endpoint<"/v3kn/save_info", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Custom, SaveTitleIDParam>;
+using GetTrophiesInfo = Endpoint<"/v3kn/trophies_info", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Custom>;
+using DownloadFile = Endpoint<"/v3kn/download_file", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Custom>;
+using UploadFile = Endpoint<"/v3kn/upload_file", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::None, EndpointResponse::Custom>;
+using CheckTrophyConfData = Endpoint<"/v3kn/check_trophy_conf_data", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Custom>;
+using UploadTrophyConfData = Endpoint<"/v3kn/upload_trophy_conf_data", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+using CheckStitleInfo = Endpoint<"/v3kn/check_stitle_info", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text,
+    RequiredParam<"titleid", std::string, "TitleID">>;
+using UploadStitleInfo = Endpoint<"/v3kn/upload_stitle_info", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text>;
+
+// Savedata history endpoints
+using GetSaveVersions = Endpoint<"/v3kn/save_versions", EndpointMethod::Get, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Json, SaveTitleIDParam>;
+using RestoreSaveVersion = Endpoint<"/v3kn/restore_save_version", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request, EndpointResponse::Text,
+    SaveTitleIDParam, RequiredParam<"version", int64_t, "Version", is_positive>>;
+
 void register_storage_endpoints(httplib::Server &server) {
-    server.Get("/v3kn/save_info", handle_get_save_info);
-    server.Get("/v3kn/trophies_info", handle_get_trophies_info);
-    server.Get("/v3kn/download_file", handle_download_file);
-    server.Post("/v3kn/upload_file", handle_upload_file);
-    server.Get("/v3kn/check_trophy_conf_data", handle_check_trophy_conf_data);
-    server.Post("/v3kn/upload_trophy_conf_data", handle_upload_trophy_conf_data);
-    server.Get("/v3kn/check_stitle_info", handle_check_stitle_info);
-    server.Post("/v3kn/upload_stitle_info", handle_upload_stitle_info);
+    clear_upload_staging();
+
+    GetSaveInfo::register_handler<handle_get_save_info>(server);
+    GetTrophiesInfo::register_handler<handle_get_trophies_info>(server);
+    DownloadFile::register_handler<handle_download_file>(server);
+    UploadFile::register_handler<handle_upload_file>(server);
+    CheckTrophyConfData::register_handler<handle_check_trophy_conf_data>(server);
+    UploadTrophyConfData::register_handler<handle_upload_trophy_conf_data>(server);
+    CheckStitleInfo::register_handler<handle_check_stitle_info>(server);
+    UploadStitleInfo::register_handler<handle_upload_stitle_info>(server);
+    GetSaveVersions::register_handler<handle_get_save_versions>(server);
+    RestoreSaveVersion::register_handler<handle_restore_save_version>(server);
 }
 
-void handle_get_save_info(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "save info request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+std::string handle_get_save_info(const EndpointContext &ctx, const std::string &titleid) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
-    auto titleid = req.get_param_value("titleid");
-    if (titleid.empty()) {
-        log("Missing TitleID on save info request for online ID " + online_id);
-        res.set_content("ERR:MissingTitleID", "text/plain");
-        return;
-    }
-
-    const std::string savedata_path = "v3kn/Users/" + online_id + "/savedata/" + titleid;
+    const fs::path savedata_path = get_user_dir(online_id) / "savedata" / titleid;
     if (!fs::exists(savedata_path)) {
         log("No savedata for online ID " + online_id + " TitleID " + titleid);
-        res.set_content("WARN:NoSavedata", "text/plain");
-        return;
+        return "WARN:NoSavedata";
     }
 
     std::ifstream savedata_info_file(fs::path(savedata_path) / "savedata.xml");
     if (!savedata_info_file) {
         log("No savedata info file for online ID " + online_id + " TitleID " + titleid);
-        res.set_content("WARN:NoSavedataInfo", "text/plain");
-        return;
+        return "WARN:NoSavedataInfo";
     }
 
     std::string savedata_content((std::istreambuf_iterator<char>(savedata_info_file)),
         std::istreambuf_iterator<char>());
 
-    update_last_activity(req, account_id);
-    res.set_content(savedata_content, "application/xml");
-}
+    update_last_activity(ctx.req, account_id);
 
-void handle_get_trophies_info(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "trophies info request", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
+    // ETag of savedata.psvimg, sent back in If-Match when uploading
+    const std::string etag = get_upload_etag(savedata_path, "savedata");
+    if (!etag.empty())
+        ctx.res.set_header("ETag", etag);
+    ctx.res.set_content(savedata_content, "application/xml");
+    return {};
+}
 
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+std::string handle_get_trophies_info(const EndpointContext &ctx) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
-    std::ifstream trophies_info_file(fs::path("v3kn") / "Users" / online_id / "trophy" / "trophies.xml");
+    std::ifstream trophies_info_file(get_user_dir(online_id) / "trophy" / "trophies.xml");
     if (!trophies_info_file) {
         log("No trophies info file for online ID " + online_id);
-        res.set_content("WARN:NoTrophiesInfo", "text/plain");
-        return;
+        return "WARN:NoTrophiesInfo";
     }
 
     std::string trophies_content((std::istreambuf_iterator<char>(trophies_info_file)),
         std::istreambuf_iterator<char>());
 
-    update_last_activity(req, account_id);
-    res.set_content(trophies_content, "application/xml");
+    update_last_activity(ctx.req, account_id);
+    set_scheduled_content(ctx.res, std::move(trophies_content), "application/xml");
+    return {};
 }
 
-void handle_download_file(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "file download", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+std::string handle_download_file(const EndpointContext &ctx) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
 
-    const auto type = req.get_param_value("type");
+    const std::string type(get_param_view(ctx.req, "type"));
     if ((type != "savedata") && (type != "trophy")) {
         log("online_id " + online_id + " try to download with invalid type: " + type);
-        res.set_content("ERR:InvalidType", "text/plain");
-        return;
+        return "ERR:InvalidType";
     }
 
-    const auto id = req.get_param_value("id");
+    const std::string id(get_param_view(ctx.req, "id"));
     bool invalid_id = false;
     if (type == "savedata")
-        invalid_id = !id.starts_with("PCS") || (id.size() != 9);
+        invalid_id = !is_savedata_id(id);
     else if (type == "trophy")
-        invalid_id = !id.starts_with("NPWR") || (id.size() != 12);
+        invalid_id = !is_trophy_id(id);
 
     if (invalid_id) {
         log("online_id " + online_id + " try to download with invalid id: " + id);
-        res.set_content("ERR:InvalidID", "text/plain");
-        return;
+        return "ERR:InvalidID";
     }
 
     auto msg = "online ID: " + online_id + " type: " + type + " id: " + id;
 
     const auto path = (type == "savedata") ? "savedata.psvimg" : "TROPUSR.DAT";
-    const fs::path file_path{ fs::path("v3kn") / "Users" / online_id / type / id / path };
+    const fs::path file_path{ get_user_dir(online_id) / type / id / path };
 
     std::ifstream file(file_path, std::ios::binary);
     if (!file.is_open()) {
         log(msg + ", File not found: " + file_path.string());
-        res.set_content("ERR:FileNotFound", "text/plain");
-        return;
+        return "ERR:FileNotFound";
     }
 
     std::stringstream buffer;
     buffer << file.rdbuf();
 
+    const std::string etag = get_upload_etag(file_path.parent_path(), type);
+    if (!etag.empty())
+        ctx.res.set_header("ETag", etag);
+
     msg += "\nServing file: " + file_path.string() + " (" + std::to_string(buffer.str().size()) + " bytes)";
     log(msg);
 
-    update_last_activity(req, account_id);
-    res.set_content(buffer.str(), "application/octet-stream");
+    update_last_activity(ctx.req, account_id);
+    set_scheduled_content(ctx.res, buffer.str(), "application/octet-stream");
+    return {};
 }
 
 static std::mutex trophies_rarity_mutex;
-static void update_trophies_rarity(const std::string &online_id, const std::string &npcomm_id) {
-    std::lock_guard<std::mutex> lock(trophies_rarity_mutex);
-
-    // Locate the player's trophies.xml
-    fs::path trophy_xml_path = fs::path("v3kn") / "Users" / online_id / "trophy" / "trophies.xml";
-
-    if (!fs::exists(trophy_xml_path) || fs::is_empty(trophy_xml_path)) {
-        log("rarity: trophies.xml missing for online ID " + online_id);
-        return;
-    }
-
-    // Load the XML
-    pugi::xml_document doc;
-    auto result = doc.load_file(trophy_xml_path.string().c_str());
-    if (!result) {
-        log("rarity: failed to parse trophies.xml for online ID " + online_id + ": " + result.description());
-        return;
-    }
-
-    // Found the root <trophies>
-    pugi::xml_node trophies_root = doc.child("trophies");
-    if (!trophies_root) {
-        log("rarity: trophies.xml has no <trophies> root for online ID " + online_id);
-        return;
-    }
-
-    // 3) Load or create trophies_rarity.json
-    const fs::path rarity_file{ fs::path("v3kn") / "trophies_rarity.json" };
-    json rarity_json;
 
-    if (fs::exists(rarity_file) && !fs::is_empty(rarity_file)) {
-        try {
-            std::ifstream f(rarity_file);
-            f >> rarity_json;
-        } catch (...) {
-            log("rarity: invalid trophies_rarity.json, recreating");
-            rarity_json = json::object();
-        }
-    }
+// Helper: Ensure the two root objects of the rarity file
+static void ensure_trophies_rarity_roots(json &rarity_json) {
+    if (!rarity_json.is_object())
+        rarity_json = json::object();
 
-    // Ensure the two root objects
     if (!rarity_json.contains("players") || !rarity_json["players"].is_object())
         rarity_json["players"] = json::object();
 
     if (!rarity_json.contains("trophies") || !rarity_json["trophies"].is_object())
         rarity_json["trophies"] = json::object();
+}
 
+// Helper: Record a player of a trophy set
+static void add_trophies_rarity_player(json &rarity_json, const std::string &online_id, const std::string &npcomm_id) {
     json &players_obj = rarity_json["players"];
-    json &trophies_obj = rarity_json["trophies"];
 
     // Ensure players[npcomm_id] exists and is an array
     if (!players_obj.contains(npcomm_id) || !players_obj[npcomm_id].is_array())
@@ -202,13 +173,11 @@ static void update_trophies_rarity(const std::string &online_id, const std::stri
 
     if (std::find(players_array.begin(), players_array.end(), online_id) == players_array.end())
         players_array.push_back(online_id);
+}
 
-    // Find the <np commid="NPWRxxxxx_00">
-    const auto np_node = trophies_root.find_child_by_attribute("np", "commid", npcomm_id.c_str());
-    if (!np_node) {
-        log("rarity: no <np> node with commid " + npcomm_id + " for online ID " + online_id);
-        return;
-    }
+// Helper: Record the unlocked trophies of a <np> node
+static void add_trophies_rarity_unlocked(json &rarity_json, const std::string &online_id, const std::string &npcomm_id, const pugi::xml_node &np_node) {
+    json &trophies_obj = rarity_json["trophies"];
 
     // Ensure trophies[npcomm_id] exists
     if (!trophies_obj.contains(npcomm_id) || !trophies_obj[npcomm_id].is_object())
@@ -238,70 +207,510 @@ static void update_trophies_rarity(const std::string &online_id, const std::stri
         if (std::find(earned_array.begin(), earned_array.end(), online_id) == earned_array.end())
             earned_array.push_back(online_id);
     }
+}
+
+// Helper: Load the root <trophies> node of a player's trophies.xml
+static pugi::xml_node load_trophies_root(const std::string &online_id, pugi::xml_document &doc) {
+    // Locate the player's trophies.xml
+    fs::path trophy_xml_path = get_user_dir(online_id) / "trophy" / "trophies.xml";
+
+    if (!fs::exists(trophy_xml_path) || fs::is_empty(trophy_xml_path)) {
+        log("rarity: trophies.xml missing for online ID " + online_id);
+        return {};
+    }
+
+    // Load the XML
+    auto result = doc.load_file(trophy_xml_path.string().c_str());
+    if (!result) {
+        log("rarity: failed to parse trophies.xml for online ID " + online_id + ": " + result.description());
+        return {};
+    }
+
+    // Found the root <trophies>
+    pugi::xml_node trophies_root = doc.child("trophies");
+    if (!trophies_root)
+        log("rarity: trophies.xml has no <trophies> root for online ID " + online_id);
+
+    return trophies_root;
+}
+
+static void update_trophies_rarity(const std::string &online_id, const std::string &npcomm_id) {
+    std::lock_guard<std::mutex> lock(trophies_rarity_mutex);
+
+    pugi::xml_document doc;
+    const pugi::xml_node trophies_root = load_trophies_root(online_id, doc);
+    if (!trophies_root)
+        return;
+
+    // Load or create trophies_rarity.json
+    const fs::path rarity_file{ fs::path("v3kn") / "trophies_rarity.json" };
+    json rarity_json;
+
+    if (fs::exists(rarity_file) && !fs::is_empty(rarity_file)) {
+        try {
+            std::ifstream f(rarity_file);
+            f >> rarity_json;
+        } catch (...) {
+            log("rarity: invalid trophies_rarity.json, recreating");
+            rarity_json = json::object();
+        }
+    }
+
+    ensure_trophies_rarity_roots(rarity_json);
+    add_trophies_rarity_player(rarity_json, online_id, npcomm_id);
+
+    // Find the <np commid="NPWRxxxxx_00">
+    const auto np_node = trophies_root.find_child_by_attribute("np", "commid", npcomm_id.c_str());
+    if (!np_node) {
+        log("rarity: no <np> node with commid " + npcomm_id + " for online ID " + online_id);
+        return;
+    }
+
+    add_trophies_rarity_unlocked(rarity_json, online_id, npcomm_id, np_node);
 
     // Save the updated rarity data
     try {
-        std::ofstream f(rarity_file);
-        f << rarity_json.dump(2);
+        write_file_atomic(rarity_file, rarity_json.dump(2));
         log("rarity: updated rarity stats for online ID " + online_id);
     } catch (...) {
         log("rarity: failed to write trophies_rarity.json");
     }
 }
 
-void handle_upload_file(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+// Add every trophy set of a player's trophies.xml to a rarity document, used to rebuild the rarity file from ground truth
+void collect_trophies_rarity(const std::string &online_id, json &rarity_json) {
+    ensure_trophies_rarity_roots(rarity_json);
 
-    std::string err;
-    const auto account = get_valid_account(req, "file upload", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
+    pugi::xml_document doc;
+    const pugi::xml_node trophies_root = load_trophies_root(online_id, doc);
+    if (!trophies_root)
         return;
+
+    for (pugi::xml_node np_node : trophies_root.children("np")) {
+        const std::string npcomm_id = np_node.attribute("commid").as_string();
+        if (npcomm_id.empty())
+            continue;
+
+        add_trophies_rarity_player(rarity_json, online_id, npcomm_id);
+        add_trophies_rarity_unlocked(rarity_json, online_id, npcomm_id, np_node);
     }
+}
 
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+// Replace the rarity file
+void save_trophies_rarity(const json &rarity_json) {
+    std::lock_guard<std::mutex> lock(trophies_rarity_mutex);
+    write_file_atomic(fs::path("v3kn") / "trophies_rarity.json", rarity_json.dump(2));
+}
 
-    const auto type = req.get_param_value("type");
-    if ((type != "savedata") && (type != "trophy")) {
-        log("online ID " + online_id + " try to upload with invalid type: " + type);
-        res.set_content("ERR:InvalidType", "text/plain");
+// Remove a deleted account from every player and trophy list of the rarity file
+void purge_account_trophies_rarity(const std::string &online_id) {
+    std::lock_guard<std::mutex> lock(trophies_rarity_mutex);
+
+    const fs::path rarity_file{ fs::path("v3kn") / "trophies_rarity.json" };
+    if (!fs::exists(rarity_file) || fs::is_empty(rarity_file))
+        return;
+
+    json rarity_json;
+    try {
+        std::ifstream f(rarity_file);
+        f >> rarity_json;
+    } catch (...) {
+        log("rarity: invalid trophies_rarity.json, cannot purge online ID " + online_id);
         return;
     }
 
-    const auto id = req.get_param_value("id");
-    bool invalid_id = false;
-    if (type == "savedata")
-        invalid_id = !id.starts_with("PCS") || (id.size() != 9);
-    else if (type == "trophy")
-        invalid_id = !id.starts_with("NPWR") || (id.size() != 12);
+    const auto erase_online_id = [&](json &list) {
+        if (list.is_array())
+            list.erase(std::remove(list.begin(), list.end(), online_id), list.end());
+    };
 
-    if (invalid_id) {
-        log("online ID " + online_id + " try to upload with invalid id: " + id);
-        res.set_content("ERR:InvalidID", "text/plain");
-        return;
+    if (rarity_json.contains("players") && rarity_json["players"].is_object()) {
+        for (auto &[npcomm_id, players] : rarity_json["players"].items())
+            erase_online_id(players);
     }
 
-    auto msg = "online ID: " + online_id + " type: " + type + " id: " + id;
+    if (rarity_json.contains("trophies") && rarity_json["trophies"].is_object()) {
+        for (auto &[npcomm_id, trophies] : rarity_json["trophies"].items()) {
+            if (!trophies.is_object())
+                continue;
+            for (auto &[trophy_id, earned] : trophies.items())
+                erase_online_id(earned);
+        }
+    }
 
-    if (!req.form.has_file("file")) {
-        log(msg + ", missing file on upload attempt");
-        res.set_content("ERR:MissingFile", "text/plain");
+    try {
+        write_file_atomic(rarity_file, rarity_json.dump(2));
+        log("rarity: purged rarity stats for deleted online ID " + online_id);
+    } catch (...) {
+        log("rarity: failed to write trophies_rarity.json");
+    }
+}
+
+// Savedata history: each upload is an immutable file in versions/, savedata.psvimg and savedata.xml are hard links to the current one
+constexpr size_t SAVEDATA_VERSIONS_RETAINED = 5;
+
+// Helper: Point path to target with a hard link (a copy when the file system has none), swapped in with a rename
+static bool link_file(const fs::path &target, const fs::path &path) {
+    const fs::path tmp_path = path.string() + ".link";
+    std::error_code ec;
+    fs::remove(tmp_path, ec);
+    fs::create_hard_link(target, tmp_path, ec);
+    if (ec) {
+        ec.clear();
+        fs::copy_file(target, tmp_path, ec);
+        if (ec)
+            return false;
+    }
+
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+static fs::path get_savedata_version_path(const fs::path &savedata_dir, int64_t version, const std::string &extension) {
+    return savedata_dir / "versions" / (std::to_string(version) + extension);
+}
+
+static json load_savedata_versions(const fs::path &savedata_dir) {
+    std::ifstream file(savedata_dir / "versions.json");
+    if (file) {
+        json versions = json::parse(file, nullptr, false);
+        if (versions.is_object() && versions.contains("versions") && versions["versions"].is_array())
+            return versions;
+    }
+
+    return json{ { "current", 0 }, { "next", 1 }, { "versions", json::array() } };
+}
+
+// Helper: Bytes charged to the quota, a content shared by several versions is counted once
+static uint64_t get_versions_unique_size(const json &versions) {
+    std::set<std::string> contents;
+    uint64_t total = 0;
+    for (const auto &entry : versions["versions"]) {
+        if (contents.insert(entry.value("sha256", "")).second)
+            total += entry.value("size", uint64_t{ 0 });
+    }
+    return total;
+}
+
+uint64_t get_savedata_unique_size(const fs::path &savedata_dir) {
+    const json versions = load_savedata_versions(savedata_dir);
+    if (!versions["versions"].empty())
+        return get_versions_unique_size(versions);
+
+    std::error_code ec;
+    const uint64_t size = fs::file_size(savedata_dir / "savedata.psvimg", ec);
+    return ec ? 0 : size;
+}
+
+// Helper: A savedata uploaded before the history existed becomes its first version
+static void adopt_legacy_savedata(const fs::path &savedata_dir, json &versions) {
+    const fs::path file_path = savedata_dir / "savedata.psvimg";
+    std::error_code ec;
+    if (!versions["versions"].empty() || !fs::is_regular_file(file_path, ec))
         return;
+
+    std::ifstream file(file_path, std::ios::binary);
+    const std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const int64_t version = versions.value("next", int64_t{ 1 });
+    fs::create_directories(savedata_dir / "versions", ec);
+    if (!link_file(file_path, get_savedata_version_path(savedata_dir, version, ".psvimg")))
+        return;
+    if (fs::is_regular_file(savedata_dir / "savedata.xml", ec))
+        link_file(savedata_dir / "savedata.xml", get_savedata_version_path(savedata_dir, version, ".xml"));
+
+    versions["versions"].push_back({ { "version", version }, { "size", content.size() }, { "sha256", compute_sha256_hex(content) }, { "uploaded_at", std::time(0) } });
+    versions["current"] = version;
+    versions["next"] = version + 1;
+    write_file_atomic(savedata_dir / "versions.json", versions.dump(2));
+}
+
+// Helper: Swap savedata.psvimg and savedata.xml to the files of a version
+static bool switch_savedata_version(const fs::path &savedata_dir, int64_t version) {
+    if (!link_file(get_savedata_version_path(savedata_dir, version, ".psvimg"), savedata_dir / "savedata.psvimg"))
+        return false;
+
+    std::error_code ec;
+    const fs::path xml_path = get_savedata_version_path(savedata_dir, version, ".xml");
+    if (fs::is_regular_file(xml_path, ec))
+        link_file(xml_path, savedata_dir / "savedata.xml");
+    return true;
+}
+
+// Helper: Store the current version of the history, as a link to a retained version with the same content when there is one,
+// else by moving the staged upload in place
+static bool store_savedata_version(const fs::path &savedata_dir, const json &versions, std::optional<int64_t> same_content_version, const fs::path &staged_path, const std::string &content, const std::optional<std::string> &xml_content) {
+    const int64_t version = versions["current"];
+    const fs::path version_path = get_savedata_version_path(savedata_dir, version, ".psvimg");
+    std::error_code ec;
+    fs::create_directories(version_path.parent_path(), ec);
+
+    bool stored = same_content_version && link_file(get_savedata_version_path(savedata_dir, *same_content_version, ".psvimg"), version_path);
+    if (!stored && !staged_path.empty()) {
+        fs::rename(staged_path, version_path, ec);
+        stored = !ec;
+    }
+    if (!stored && !write_file_atomic(version_path, content))
+        return false;
+
+    // Without a new savedata.xml, the version keeps the current one
+    const fs::path version_xml_path = get_savedata_version_path(savedata_dir, version, ".xml");
+    if (xml_content)
+        write_file_atomic(version_xml_path, *xml_content);
+    else if (fs::is_regular_file(savedata_dir / "savedata.xml", ec))
+        link_file(savedata_dir / "savedata.xml", version_xml_path);
+
+    return switch_savedata_version(savedata_dir, version) && write_file_atomic(savedata_dir / "versions.json", versions.dump(2));
+}
+
+static void remove_savedata_versions(const fs::path &savedata_dir, const std::vector<json> &removed_versions) {
+    for (const auto &entry : removed_versions) {
+        const int64_t version = entry.value("version", int64_t{ 0 });
+        std::error_code ec;
+        fs::remove(get_savedata_version_path(savedata_dir, version, ".psvimg"), ec);
+        fs::remove(get_savedata_version_path(savedata_dir, version, ".xml"), ec);
+    }
+}
+
+static std::string make_etag(const std::string &sha256) {
+    return "\"" + sha256 + "\"";
+}
+
+// Helper: ETag of the current file of an upload target, empty when there is none
+static std::string get_upload_etag(const fs::path &base_path, const std::string &type) {
+    if (type == "savedata") {
+        const json versions = load_savedata_versions(base_path);
+        const int64_t current = versions.value("current", int64_t{ 0 });
+        for (const auto &entry : versions["versions"]) {
+            if (entry.value("version", int64_t{ 0 }) == current)
+                return make_etag(entry.value("sha256", ""));
+        }
+    }
+
+    std::ifstream file(base_path / ((type == "savedata") ? "savedata.psvimg" : "TROPUSR.DAT"), std::ios::binary);
+    if (!file)
+        return {};
+
+    const std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return make_etag(compute_sha256_hex(content));
+}
+
+// Helper: If-Match precondition, a request without the header is unconditional
+static bool matches_if_match(const httplib::Request &req, const std::string &etag) {
+    if (!req.has_header("If-Match"))
+        return true;
+
+    const std::string value = req.get_header_value("If-Match");
+    if (value == "*")
+        return !etag.empty();
+
+    size_t pos = 0;
+    while (pos < value.size()) {
+        const size_t comma = std::min(value.find(',', pos), value.size());
+        const size_t first = value.find_first_not_of(' ', pos);
+        const size_t last = value.find_last_not_of(' ', comma - 1);
+        if ((first < comma) && !etag.empty() && (value.compare(first, last - first + 1, etag) == 0))
+            return true;
+        pos = comma + 1;
+    }
+    return false;
+}
+
+// Helper: 412 with the current ETag, so the client can fetch the newer file and merge
+static std::string reject_stale_upload(httplib::Response &res, const std::string &msg, const std::string &etag) {
+    log(msg + ", upload rejected, If-Match does not match " + (etag.empty() ? std::string("a missing file") : etag));
+    increment_metric("storage.upload.conflicts");
+    res.status = 412;
+    if (!etag.empty())
+        res.set_header("ETag", etag);
+    return "ERR:VersionConflict";
+}
+
+// Per-file upload locks, uploads of the same file are queued while different files are received in parallel
+static std::mutex upload_locks_mutex;
+static std::map<std::string, std::shared_ptr<std::mutex>> upload_locks;
+
+class UploadFileLock {
+public:
+    explicit UploadFileLock(const std::string &key)
+        : key(key) {
+        {
+            std::lock_guard<std::mutex> lock(upload_locks_mutex);
+            auto &entry = upload_locks[key];
+            if (!entry)
+                entry = std::make_shared<std::mutex>();
+            file_mutex = entry;
+        }
+        file_mutex->lock();
+    }
+
+    ~UploadFileLock() {
+        file_mutex->unlock();
+        std::lock_guard<std::mutex> lock(upload_locks_mutex);
+        file_mutex.reset();
+        const auto it = upload_locks.find(key);
+        if ((it != upload_locks.end()) && (it->second.use_count() == 1))
+            upload_locks.erase(it);
+    }
+
+    UploadFileLock(const UploadFileLock &) = delete;
+    UploadFileLock &operator=(const UploadFileLock &) = delete;
+
+private:
+    std::string key;
+    std::shared_ptr<std::mutex> file_mutex;
+};
+
+// Uploads are staged outside of the user directories, then moved in place under request_mutex
+static const fs::path upload_staging_dir = fs::path("v3kn") / "uploads";
+
+// Helper: Write the upload to a new staging file, removed again by the destructor if it was not moved in place
+struct StagedUpload {
+    fs::path path;
+
+    explicit StagedUpload(const std::string &content) {
+        static std::atomic<uint64_t> counter = 0;
+        std::error_code ec;
+        fs::create_directories(upload_staging_dir, ec);
+        const fs::path staging_path = upload_staging_dir / (std::to_string(std::time(0)) + "-" + std::to_string(counter++) + ".upload");
+        if (write_file_atomic(staging_path, content))
+            path = staging_path;
+    }
+
+    ~StagedUpload() {
+        std::error_code ec;
+        if (!path.empty())
+            fs::remove(path, ec);
+    }
+
+    StagedUpload(const StagedUpload &) = delete;
+    StagedUpload &operator=(const StagedUpload &) = delete;
+};
+
+// Helper: Leftovers of uploads interrupted by a crash
+static void clear_upload_staging() {
+    std::error_code ec;
+    fs::remove_all(upload_staging_dir, ec);
+}
+
+// Uploads run in three steps: the request is validated under request_mutex, the content is hashed and staged under the
+// lock of its file only, then the If-Match precondition, the quota and the move in place are applied under request_mutex.
+// The endpoint is registered without the request lock, the handler takes it for the first and last steps.
+std::string handle_upload_file(const EndpointContext &ctx) {
+    std::string account_id = ctx.account.account_id, online_id = ctx.account.online_id, type, id, msg;
+    std::set<std::string> retained_contents;
+    {
+        std::lock_guard<std::mutex> req_lock(request_mutex);
+
+        type = get_param_view(ctx.req, "type");
+        if ((type != "savedata") && (type != "trophy")) {
+            log("online ID " + online_id + " try to upload with invalid type: " + type);
+            return "ERR:InvalidType";
+        }
+
+        id = get_param_view(ctx.req, "id");
+        bool invalid_id = false;
+        if (type == "savedata")
+            invalid_id = !is_savedata_id(id);
+        else if (type == "trophy")
+            invalid_id = !is_trophy_id(id);
+
+        if (invalid_id) {
+            log("online ID " + online_id + " try to upload with invalid id: " + id);
+            return "ERR:InvalidID";
+        }
+
+        msg = "online ID: " + online_id + " type: " + type + " id: " + id;
+
+        if (!ctx.req.form.has_file("file")) {
+            log(msg + ", missing file on upload attempt");
+            return "ERR:MissingFile";
+        }
+
+        // Early precondition check, so a stale upload is rejected before its content is written
+        const fs::path base_path{ get_user_dir(online_id) / type / id };
+        const std::string etag = get_upload_etag(base_path, type);
+        if (!matches_if_match(ctx.req, etag)) {
+            return reject_stale_upload(ctx.res, msg, etag);
+        }
+
+        if (type == "savedata") {
+            for (const auto &entry : load_savedata_versions(base_path)["versions"])
+                retained_contents.insert(entry.value("sha256", ""));
+        }
     }
 
-    const auto file = req.form.get_file("file");
+    const UploadFileLock file_lock(account_id + "/" + type + "/" + id);
+    const auto file = ctx.req.form.get_file("file");
     const uint64_t newSize = file.content.size();
+    meter_upload(newSize);
+    const std::string sha256 = compute_sha256_hex(file.content);
+
+    // A savedata identical to a retained version is linked to it, nothing needs to be staged
+    std::optional<StagedUpload> staged;
+    if (!retained_contents.contains(sha256))
+        staged.emplace(file.content);
+    const fs::path staged_path = staged ? staged->path : fs::path();
+
+    std::lock_guard<std::mutex> req_lock(request_mutex);
+
+    // The account may have changed its online ID or been deleted while the upload was staged
+    std::string err;
+    const auto account = get_valid_account(ctx.req, "file upload", err);
+    if (!account) {
+        return err;
+    }
+    online_id = account->online_id;
 
-    const fs::path base_path{ fs::path("v3kn") / "Users" / online_id / type / id };
+    const fs::path base_path{ get_user_dir(online_id) / type / id };
     const std::string path = (type == "savedata") ? "savedata.psvimg" : "TROPUSR.DAT";
     const fs::path file_path{ base_path / path };
 
-    uint64_t oldSize = 0;
-    if (fs::exists(file_path))
-        oldSize = fs::file_size(file_path);
+    // Savedata uploads add a version to the history instead of overwriting the current file
+    json versions;
+    if (type == "savedata") {
+        versions = load_savedata_versions(base_path);
+        adopt_legacy_savedata(base_path, versions);
+    }
+
+    const std::string etag = get_upload_etag(base_path, type);
+    if (!matches_if_match(ctx.req, etag)) {
+        return reject_stale_upload(ctx.res, msg, etag);
+    }
+    if (!ctx.req.has_header("If-Match"))
+        increment_metric("storage.upload.unconditional");
+
+    std::vector<json> removed_versions;
+    std::optional<int64_t> same_content_version;
+    int64_t delta = 0;
+    if (type == "savedata") {
+        const uint64_t old_unique_size = get_versions_unique_size(versions);
+        for (const auto &entry : versions["versions"]) {
+            if ((entry.value("sha256", "") == sha256) && (entry.value("size", uint64_t{ 0 }) == newSize))
+                same_content_version = entry.value("version", int64_t{ 0 });
+        }
+
+        const int64_t version = versions.value("next", int64_t{ 1 });
+        auto &list = versions["versions"];
+        list.push_back({ { "version", version }, { "size", newSize }, { "sha256", sha256 }, { "uploaded_at", std::time(0) } });
+        while (list.size() > SAVEDATA_VERSIONS_RETAINED) {
+            removed_versions.push_back(list.front());
+            list.erase(list.begin());
+        }
+        versions["current"] = version;
+        versions["next"] = version + 1;
+
+        delta = (int64_t)get_versions_unique_size(versions) - (int64_t)old_unique_size;
+    } else {
+        uint64_t oldSize = 0;
+        if (fs::exists(file_path))
+            oldSize = fs::file_size(file_path);
 
-    const int64_t delta = (int64_t)newSize - (int64_t)oldSize;
+        delta = (int64_t)newSize - (int64_t)oldSize;
+    }
 
     uint64_t new_used = 0;
     {
@@ -314,8 +723,7 @@ void handle_upload_file(const httplib::Request &req, httplib::Response &res) {
 
         if ((delta > 0) && (new_used > DEFAULT_QUOTA_TOTAL)) {
             log(msg + ", exceeded quota on upload attempt. Used: " + std::to_string(used) + ", New Used: " + std::to_string(new_used) + ", Total: " + std::to_string(DEFAULT_QUOTA_TOTAL));
-            res.set_content("ERR:QuotaExceeded", "text/plain");
-            return;
+            return "ERR:QuotaExceeded";
         }
 
         user["quota_used"] = new_used;
@@ -324,44 +732,94 @@ void handle_upload_file(const httplib::Request &req, httplib::Response &res) {
     }
 
     fs::create_directories(base_path);
-    {
-        std::ofstream out(file_path, std::ios::binary);
-        out << file.content;
-    }
+    if (type == "savedata") {
+        std::optional<std::string> xml_content;
+        if (ctx.req.form.has_field("xml"))
+            xml_content = ctx.req.form.get_field("xml");
+
+        // The current savedata is only replaced once the new version is complete, so a failed write keeps it intact
+        if (!store_savedata_version(base_path, versions, same_content_version, staged_path, file.content, xml_content)) {
+            log(msg + ", failed to store savedata version " + std::to_string(versions["current"].get<int64_t>()));
+            return "ERR:UploadFailed";
+        }
+        remove_savedata_versions(base_path, removed_versions);
+    } else {
+        std::error_code ec;
+        if (!staged_path.empty())
+            fs::rename(staged_path, file_path, ec);
+        if ((staged_path.empty() || ec) && !write_file_atomic(file_path, file.content)) {
+            log(msg + ", failed to store " + file_path.string());
+            return "ERR:UploadFailed";
+        }
 
-    if (req.form.has_field("xml")) {
-        const auto xml_content = req.form.get_field("xml");
-        const fs::path xml_path{ (type == "savedata") ? base_path / "savedata.xml" : base_path.parent_path() / "trophies.xml" };
-        std::ofstream xml_out(xml_path, std::ios::binary);
-        xml_out << xml_content;
+        if (ctx.req.form.has_field("xml"))
+            write_file_atomic(base_path.parent_path() / "trophies.xml", ctx.req.form.get_field("xml"));
     }
 
     if (type == "trophy")
         update_trophies_rarity(online_id, id);
 
+    add_stat("storage_bytes", delta);
+    add_daily_stat("uploads");
+    add_daily_stat("upload_bytes", newSize);
+
     log(msg + "\nUploaded file " + file_path.string() + " (" + std::to_string(newSize) + " bytes), quota: " + std::to_string(new_used) + " / " + std::to_string(DEFAULT_QUOTA_TOTAL));
-    res.set_content("OK:" + std::to_string(new_used) + ":" + std::to_string(DEFAULT_QUOTA_TOTAL), "text/plain");
+    ctx.res.set_header("ETag", make_etag(sha256));
+    return "OK:" + std::to_string(new_used) + ":" + std::to_string(DEFAULT_QUOTA_TOTAL);
 }
 
-void handle_check_trophy_conf_data(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-    std::string err;
-    const auto account = get_valid_account(req, "trophy conf data check", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
+std::string handle_get_save_versions(const EndpointContext &ctx, const std::string &titleid) {
+    const fs::path savedata_dir = get_user_dir(ctx.account.online_id) / "savedata" / titleid;
+    json versions = load_savedata_versions(savedata_dir);
+    adopt_legacy_savedata(savedata_dir, versions);
+    if (versions["versions"].empty()) {
+        log("No savedata for online ID " + ctx.account.online_id + " TitleID " + titleid);
+        return "ERR:NoSavedata";
+    }
+
+    json response = json::object();
+    response["current"] = versions["current"];
+    response["quota_used"] = get_versions_unique_size(versions);
+    response["versions"] = versions["versions"];
+
+    update_last_activity(ctx.req, ctx.account.account_id);
+    return response.dump();
+}
+
+std::string handle_restore_save_version(const EndpointContext &ctx, const std::string &titleid, int64_t version) {
+    const std::string msg = "online ID: " + ctx.account.online_id + " TitleID: " + titleid + " version: " + std::to_string(version);
+    const fs::path savedata_dir = get_user_dir(ctx.account.online_id) / "savedata" / titleid;
+    json versions = load_savedata_versions(savedata_dir);
+    adopt_legacy_savedata(savedata_dir, versions);
+
+    const auto &list = versions["versions"];
+    if (std::none_of(list.begin(), list.end(), [&](const json &entry) { return entry.value("version", int64_t{ 0 }) == version; })) {
+        log(msg + ", restore of a version not in the history");
+        return "ERR:VersionNotFound";
     }
 
-    const std::string account_id = account->account_id;
-    const std::string online_id = account->online_id;
+    // Restoring only moves the current pointers, the retained versions and the quota stay the same
+    versions["current"] = version;
+    if (!switch_savedata_version(savedata_dir, version) || !write_file_atomic(savedata_dir / "versions.json", versions.dump(2))) {
+        log(msg + ", failed to restore savedata version");
+        return "ERR:RestoreFailed";
+    }
+
+    log(msg + ", restored savedata version");
+    update_last_activity(ctx.req, ctx.account.account_id);
+    return "OK:" + std::to_string(version);
+}
 
-    const fs::path trophies_xml_path{ fs::path("v3kn") / "Users" / online_id / "trophy" / "trophies.xml" };
+std::string handle_check_trophy_conf_data(const EndpointContext &ctx) {
+    const std::string account_id = ctx.account.account_id;
+    const std::string online_id = ctx.account.online_id;
+
+    const fs::path trophies_xml_path{ get_user_dir(online_id) / "trophy" / "trophies.xml" };
 
     pugi::xml_document doc;
     if (!doc.load_file(trophies_xml_path.string().c_str())) {
         log("Failed to load trophies.xml for online ID " + online_id);
-        res.set_content("ERR:NoTrophiesInfo", "text/plain");
-        return;
+        return "ERR:NoTrophiesInfo";
     }
 
     pugi::xml_document response_doc;
@@ -374,7 +832,7 @@ void handle_check_trophy_conf_data(const httplib::Request &req, httplib::Respons
             log("online ID " + online_id + " " + reason + " for: " + commid);
         };
 
-        const fs::path conf_path = fs::path("v3kn") / "Trophies" / commid;
+        const fs::path conf_path = get_data_entry_path(DataTree::Trophies, commid);
         if (!fs::exists(conf_path) || fs::is_empty(conf_path)) {
             mark_missing("is missing trophy conf data");
             continue;
@@ -424,49 +882,40 @@ void handle_check_trophy_conf_data(const httplib::Request &req, httplib::Respons
         }
     }
 
-    update_last_activity(req, account_id);
+    update_last_activity(ctx.req, account_id);
 
     if (response.empty()) {
         log("online ID " + online_id + " has all trophy conf data");
-        res.set_content("OK", "text/plain");
-    } else {
-        std::stringstream ss;
-        response_doc.save(ss);
-        std::string missing_confs((std::istreambuf_iterator<char>(ss)),
-            std::istreambuf_iterator<char>());
-
-        res.set_content(missing_confs, "application/xml");
+        return "OK";
     }
-}
 
-void handle_upload_trophy_conf_data(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+    std::stringstream ss;
+    response_doc.save(ss);
+    std::string missing_confs((std::istreambuf_iterator<char>(ss)),
+        std::istreambuf_iterator<char>());
 
-    std::string err;
-    const auto account = get_valid_account(req, "trophy conf data upload", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
+    ctx.res.set_content(missing_confs, "application/xml");
+    return {};
+}
 
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_upload_trophy_conf_data(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    if (!req.form.has_file("file")) {
+    if (!ctx.req.form.has_file("file")) {
         log("online ID " + online_id + " try to upload trophy conf data with missing file");
-        res.set_content("ERR:MissingFile", "text/plain");
-        return;
+        return "ERR:MissingFile";
     }
 
-    const auto id = req.get_param_value("id");
-    if (!id.starts_with("NPWR") || (id.size() != 12)) {
+    const std::string id(get_param_view(ctx.req, "id"));
+    if (!is_trophy_id(id)) {
         log("online ID " + online_id + " try to upload trophy conf data with invalid id: " + id);
-        res.set_content("ERR:InvalidID", "text/plain");
-        return;
+        return "ERR:InvalidID";
     }
 
-    const auto file = req.form.get_file("file");
-    const fs::path base_path{ fs::path("v3kn") / "Trophies" / id };
+    const auto file = ctx.req.form.get_file("file");
+    meter_upload(file.content.size());
+    const fs::path base_path{ get_data_entry_path(DataTree::Trophies, id) };
     const fs::path file_path{ base_path / file.filename };
 
     fs::create_directories(base_path);
@@ -476,80 +925,51 @@ void handle_upload_trophy_conf_data(const httplib::Request &req, httplib::Respon
     }
 
     log("online ID " + online_id + " uploaded trophy conf data for " + id + " " + file.filename + " (" + std::to_string(file.content.size()) + " bytes)");
-    res.set_content("OK", "text/plain");
+    return "OK";
 }
 
-void handle_check_stitle_info(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
-
-    std::string err;
-    const auto account = get_valid_account(req, "stitle info check", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+std::string handle_check_stitle_info(const EndpointContext &ctx, const std::string &titleid) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    update_last_activity(req, account_id);
-
-    const std::string titleid = req.get_param_value("titleid");
-    if (titleid.empty()) {
-        log("Missing TitleID on short title info check for online ID " + online_id);
-        res.set_content("ERR:MissingTitleID", "text/plain");
-        return;
-    }
+    update_last_activity(ctx.req, account_id);
 
     if (has_stitle_info(titleid)) {
         log("Short Title info exists for TitleID " + titleid + ", online ID " + online_id);
-        res.set_content("OK:TitleInfoExists", "text/plain");
-        return;
+        return "OK:TitleInfoExists";
     }
 
     log("Short Title info missing for TitleID " + titleid + ", online ID " + online_id);
-    res.set_content("WARN:TitleInfoMissing", "text/plain");
+    return "WARN:TitleInfoMissing";
 }
 
-void handle_upload_stitle_info(const httplib::Request &req, httplib::Response &res) {
-    std::lock_guard<std::mutex> req_lock(request_mutex);
+std::string handle_upload_stitle_info(const EndpointContext &ctx) {
+    const std::string &account_id = ctx.account.account_id;
+    const std::string &online_id = ctx.account.online_id;
 
-    std::string err;
-    const auto account = get_valid_account(req, "short title info upload", err);
-    if (!account) {
-        res.set_content(err, "text/plain");
-        return;
-    }
-
-    const std::string &account_id = account->account_id;
-    const std::string &online_id = account->online_id;
+    update_last_activity(ctx.req, account_id);
 
-    update_last_activity(req, account_id);
-
-    if (req.body.empty()) {
+    if (ctx.req.body.empty()) {
         log("online ID " + online_id + " try to upload short title info with missing payload");
-        res.set_content("ERR:MissingPayload", "text/plain");
-        return;
+        return "ERR:MissingPayload";
     }
 
     json payload;
     try {
-        payload = json::parse(req.body);
+        payload = json::parse(ctx.req.body);
     } catch (...) {
         log("online ID " + online_id + " try to upload short title info with invalid JSON");
-        res.set_content("ERR:InvalidJson", "text/plain");
-        return;
+        return "ERR:InvalidJson";
     }
 
     const std::string titleid = payload.value("titleid", "");
     if (titleid.empty() || !payload.contains("names") || !payload["names"].is_object()) {
         log("online ID " + online_id + " try to upload short title info with invalid payload");
-        res.set_content("ERR:InvalidPayload", "text/plain");
-        return;
+        return "ERR:InvalidPayload";
     }
 
     update_stitle_info(titleid, payload["names"]);
 
     log("online ID " + online_id + " uploaded short title info for " + titleid);
-    res.set_content("OK:ShortTitleInfoSaved", "text/plain");
+    return "OK:ShortTitleInfoSaved";
 }
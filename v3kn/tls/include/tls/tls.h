@@ -0,0 +1,14 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <httplib.h>
+
+#include <memory>
+
+// Native TLS listener, enabled when V3KN_TLS_CERT and V3KN_TLS_KEY point to PEM files
+bool is_tls_enabled();
+int get_tls_port();
+std::unique_ptr<httplib::Server> create_tls_server();
+void start_tls_certificate_watcher();
@@ -0,0 +1,222 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#include "tls/tls.h"
+#include "utils/params.h"
+#include "utils/utils.h"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+// Stateful session cache shared by all connections, for clients without ticket support
+static constexpr long TLS_SESSION_CACHE_SIZE = 20000;
+static constexpr long TLS_SESSION_TIMEOUT_SECONDS = 2 * 60 * 60;
+static constexpr auto TLS_CERTIFICATE_CHECK_INTERVAL = std::chrono::seconds(60);
+
+// Certificate in use, replaced as a whole on reload and picked up by the next handshakes
+struct TlsCertificate {
+    X509 *cert = nullptr;
+    EVP_PKEY *key = nullptr;
+    STACK_OF(X509) *chain = nullptr;
+    fs::file_time_type cert_mtime;
+    fs::file_time_type key_mtime;
+
+    ~TlsCertificate() {
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        sk_X509_pop_free(chain, X509_free);
+    }
+};
+
+static std::mutex tls_certificate_mutex;
+static std::shared_ptr<const TlsCertificate> tls_certificate;
+static SSL_CTX *tls_context = nullptr;
+
+static std::string get_env_value(const char *name) {
+    const char *value = std::getenv(name);
+    return value ? value : "";
+}
+
+bool is_tls_enabled() {
+    return !get_env_value("V3KN_TLS_CERT").empty() && !get_env_value("V3KN_TLS_KEY").empty();
+}
+
+int get_tls_port() {
+    const std::string port = get_env_value("V3KN_TLS_PORT");
+    if (port.empty())
+        return 3000;
+
+    if (const auto value = parse_number<int>(port))
+        return *value;
+
+    log("Invalid V3KN_TLS_PORT value, using port 3000");
+    return 3000;
+}
+
+// Helper: Last OpenSSL error as text
+static std::string get_openssl_error() {
+    char buffer[256] = {};
+    ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+    return buffer;
+}
+
+// Helper: Load the leaf certificate, its chain and the private key from the PEM files
+static std::shared_ptr<const TlsCertificate> load_tls_certificate(const std::string &cert_path, const std::string &key_path) {
+    auto certificate = std::make_shared<TlsCertificate>();
+    std::error_code ec;
+    certificate->cert_mtime = fs::last_write_time(cert_path, ec);
+    certificate->key_mtime = fs::last_write_time(key_path, ec);
+
+    BIO *cert_bio = BIO_new_file(cert_path.c_str(), "r");
+    if (!cert_bio) {
+        log("TLS: failed to open certificate " + cert_path);
+        return nullptr;
+    }
+    certificate->cert = PEM_read_bio_X509(cert_bio, nullptr, nullptr, nullptr);
+    certificate->chain = sk_X509_new_null();
+    while (X509 *intermediate = PEM_read_bio_X509(cert_bio, nullptr, nullptr, nullptr))
+        sk_X509_push(certificate->chain, intermediate);
+    BIO_free(cert_bio);
+    ERR_clear_error();
+
+    BIO *key_bio = BIO_new_file(key_path.c_str(), "r");
+    if (!key_bio) {
+        log("TLS: failed to open private key " + key_path);
+        return nullptr;
+    }
+    certificate->key = PEM_read_bio_PrivateKey(key_bio, nullptr, nullptr, nullptr);
+    BIO_free(key_bio);
+
+    if (!certificate->cert || !certificate->key) {
+        log("TLS: failed to parse certificate or private key: " + get_openssl_error());
+        return nullptr;
+    }
+
+    if (X509_check_private_key(certificate->cert, certificate->key) != 1) {
+        log("TLS: private key " + key_path + " does not match certificate " + cert_path);
+        return nullptr;
+    }
+
+    return certificate;
+}
+
+// Helper: Install the current certificate on each new connection, so a reload never touches a context in use
+static int tls_certificate_callback(SSL *ssl, void *) {
+    std::shared_ptr<const TlsCertificate> certificate;
+    {
+        std::lock_guard<std::mutex> lock(tls_certificate_mutex);
+        certificate = tls_certificate;
+    }
+    if (!certificate)
+        return 0;
+
+    if (SSL_use_certificate(ssl, certificate->cert) != 1 || SSL_use_PrivateKey(ssl, certificate->key) != 1)
+        return 0;
+
+    return SSL_set1_chain(ssl, certificate->chain) == 1 ? 1 : 0;
+}
+
+// Helper: Count full and resumed handshakes
+static void tls_info_callback(const SSL *ssl, int where, int) {
+    if (!(where & SSL_CB_HANDSHAKE_DONE))
+        return;
+
+    increment_metric(SSL_session_reused(ssl) ? "tls.handshakes.resumed" : "tls.handshakes.full");
+}
+
+static bool setup_tls_context(SSL_CTX &ctx) {
+    // TLS 1.3 is preferred, TLS 1.2 is kept for older clients
+    SSL_CTX_set_min_proto_version(&ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(&ctx, SSL_OP_NO_COMPRESSION | SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION | SSL_OP_NO_RENEGOTIATION);
+
+    // Clients reconnect after every long-poll, resume them with tickets or from the shared session cache
+    static const unsigned char session_id_context[] = "v3kn";
+    SSL_CTX_set_session_id_context(&ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(&ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(&ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(&ctx, TLS_SESSION_TIMEOUT_SECONDS);
+    SSL_CTX_set_num_tickets(&ctx, 2);
+
+    SSL_CTX_set_cert_cb(&ctx, tls_certificate_callback, nullptr);
+    SSL_CTX_set_info_callback(&ctx, tls_info_callback);
+
+    tls_context = &ctx;
+    return true;
+}
+
+std::unique_ptr<httplib::Server> create_tls_server() {
+    const std::string cert_path = get_env_value("V3KN_TLS_CERT");
+    const std::string key_path = get_env_value("V3KN_TLS_KEY");
+
+    auto certificate = load_tls_certificate(cert_path, key_path);
+    if (!certificate) {
+        log("TLS: unable to load the certificate " + cert_path + " with key " + key_path);
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(tls_certificate_mutex);
+        tls_certificate = std::move(certificate);
+    }
+
+    auto server = std::make_unique<httplib::SSLServer>(setup_tls_context);
+    if (!server->is_valid()) {
+        log("TLS: failed to create the TLS context: " + get_openssl_error());
+        return nullptr;
+    }
+
+    log("TLS: listener enabled with certificate " + cert_path);
+    return server;
+}
+
+// Helper: Reload the certificate when one of its files changed, the previous one is kept on failure
+static void watch_tls_certificate() {
+    const std::string cert_path = get_env_value("V3KN_TLS_CERT");
+    const std::string key_path = get_env_value("V3KN_TLS_KEY");
+
+    while (true) {
+        std::this_thread::sleep_for(TLS_CERTIFICATE_CHECK_INTERVAL);
+
+        std::shared_ptr<const TlsCertificate> current;
+        {
+            std::lock_guard<std::mutex> lock(tls_certificate_mutex);
+            current = tls_certificate;
+        }
+
+        if (tls_context)
+            set_metric("tls.session_cache.entries", SSL_CTX_sess_number(tls_context));
+
+        std::error_code cert_ec, key_ec;
+        const auto cert_mtime = fs::last_write_time(cert_path, cert_ec);
+        const auto key_mtime = fs::last_write_time(key_path, key_ec);
+        if (cert_ec || key_ec || (current && cert_mtime == current->cert_mtime && key_mtime == current->key_mtime))
+            continue;
+
+        auto certificate = load_tls_certificate(cert_path, key_path);
+        if (!certificate) {
+            increment_metric("tls.certificate.reload_failures");
+            log("TLS: certificate reload failed, keeping the previous certificate");
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(tls_certificate_mutex);
+            tls_certificate = std::move(certificate);
+        }
+        increment_metric("tls.certificate.reloads");
+        log("TLS: certificate reloaded from " + cert_path);
+    }
+}
+
+void start_tls_certificate_watcher() {
+    static std::thread watcher_thread(watch_tls_certificate);
+    watcher_thread.detach();
+}
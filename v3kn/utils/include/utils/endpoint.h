@@ -0,0 +1,194 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <utils/params.h>
+#include <utils/utils.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+// Typed endpoint declarations: route, method, auth, lock, parameter schema and response type are template arguments,
+// and the dispatch wrapper doing auth, locking, parameter parsing and metrics is generated for each endpoint.
+//
+//  using LikeActivity = Endpoint<"/v3kn/activity/like", EndpointMethod::Post, EndpointAuth::Account, EndpointLock::Request,
+//      EndpointResponse::Text, RequiredParam<"created_at", int64_t, "CreatedAt", is_positive>>;
+//  LikeActivity::register_handler<handle_like_activity>(server);
+//
+// The handler gets the context followed by one argument per parameter, and returns the response body.
+// Bodies starting with "ERR:" or "WARN:" are always sent as text.
+// Custom responses (files, XML, headers, scheduled downloads) are written by the handler to ctx.res, it then returns an
+// empty body; a non-empty body is still sent as text, so errors keep a single return path.
+
+template <size_t N>
+struct FixedString {
+    char value[N]{};
+
+    constexpr FixedString(const char (&str)[N]) {
+        std::copy_n(str, N, value);
+    }
+
+    constexpr std::string_view view() const {
+        return { value, N - 1 };
+    }
+};
+
+enum class EndpointMethod {
+    Get,
+    Post,
+};
+
+enum class EndpointAuth {
+    None,
+    Account, // Valid Bearer token, the account is resolved in the context
+    Admin, // X-Admin-Token header, see is_admin_request
+};
+
+enum class EndpointLock {
+    None,
+    Request, // Serialized with the other requests on request_mutex
+};
+
+enum class EndpointResponse {
+    Text,
+    Json,
+    Custom,
+};
+
+struct EndpointContext {
+    const httplib::Request &req;
+    httplib::Response &res;
+    UserAccount account;
+};
+
+// Parameter schema entry: the name in the query/form, the parsed type, the suffix of its ERR:Missing/ERR:Invalid errors
+// and an optional validator. Supported types are std::string, std::string_view and arithmetic types.
+template <FixedString Name, typename T, FixedString Error, bool Required, auto Validate = nullptr>
+struct EndpointParam {
+    using value_type = T;
+    using type = std::conditional_t<Required, T, std::optional<T>>;
+    static constexpr std::string_view name = Name.view();
+    static constexpr std::string_view error = Error.view();
+    static constexpr bool required = Required;
+
+    static std::optional<T> parse(std::string_view value) {
+        std::optional<T> result;
+        if constexpr (std::is_arithmetic_v<T>)
+            result = parse_number<T>(value);
+        else
+            result = T(value);
+
+        if constexpr (!std::is_null_pointer_v<decltype(Validate)>) {
+            if (result && !Validate(*result))
+                result.reset();
+        }
+        return result;
+    }
+};
+
+template <FixedString Name, typename T, FixedString Error, auto Validate = nullptr>
+using RequiredParam = EndpointParam<Name, T, Error, true, Validate>;
+
+template <FixedString Name, typename T, FixedString Error, auto Validate = nullptr>
+using OptionalParam = EndpointParam<Name, T, Error, false, Validate>;
+
+constexpr bool is_positive(int64_t value) {
+    return value > 0;
+}
+
+template <FixedString Route, EndpointMethod Method, EndpointAuth Auth, EndpointLock Lock, EndpointResponse Response, typename... Params>
+struct Endpoint {
+    static constexpr std::string_view route = Route.view();
+
+    template <auto Handler>
+    static void dispatch(const httplib::Request &req, httplib::Response &res) {
+        static const std::string requests_metric = "endpoint." + std::string(route) + ".requests";
+        static const std::string errors_metric = "endpoint." + std::string(route) + ".errors";
+        static const std::string duration_metric = "endpoint." + std::string(route) + ".duration_us";
+
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> req_lock;
+        if constexpr (Lock == EndpointLock::Request)
+            req_lock = std::unique_lock<std::mutex>(request_mutex);
+
+        const std::string body = run<Handler>(req, res);
+        const bool is_error = body.starts_with("ERR:");
+        const bool is_text = (Response != EndpointResponse::Json) || is_error || body.starts_with("WARN:");
+        if ((Response != EndpointResponse::Custom) || !body.empty())
+            res.set_content(body, is_text ? "text/plain" : "application/json");
+
+        increment_metric(requests_metric);
+        if (is_error)
+            increment_metric(errors_metric);
+        increment_metric(duration_metric, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    template <auto Handler>
+    static void register_handler(httplib::Server &server) {
+        if constexpr (Method == EndpointMethod::Get)
+            server.Get(std::string(route), dispatch<Handler>);
+        else if constexpr (Auth == EndpointAuth::Account)
+            server.Post(std::string(route), with_idempotency(dispatch<Handler>));
+        else
+            server.Post(std::string(route), dispatch<Handler>);
+    }
+
+private:
+    template <typename Param>
+    static bool parse_param(const EndpointContext &ctx, typename Param::type &value, std::string &err) {
+        const auto raw = get_param_view(ctx.req, std::string(Param::name));
+        if (raw.empty()) {
+            if constexpr (Param::required) {
+                log(std::string(route) + " from online ID " + ctx.account.online_id + " with missing " + std::string(Param::name));
+                err = "ERR:Missing" + std::string(Param::error);
+                return false;
+            } else
+                return true;
+        }
+
+        auto parsed = Param::parse(raw);
+        if (!parsed) {
+            log(std::string(route) + " from online ID " + ctx.account.online_id + " with invalid " + std::string(Param::name));
+            err = "ERR:Invalid" + std::string(Param::error);
+            return false;
+        }
+        value = std::move(*parsed);
+        return true;
+    }
+
+    template <auto Handler>
+    static std::string run(const httplib::Request &req, httplib::Response &res) {
+        EndpointContext ctx{ req, res, {} };
+        std::string err;
+        if constexpr (Auth == EndpointAuth::Account) {
+            const auto account = get_valid_account(req, std::string(route), err);
+            if (!account)
+                return err;
+            ctx.account = *account;
+        } else if constexpr (Auth == EndpointAuth::Admin) {
+            if (!is_admin_request(req))
+                return "ERR:Unauthorized";
+        }
+
+        // Parameters are parsed in declaration order, the first error is returned
+        std::tuple<typename Params::type...> values;
+        const bool parsed = std::apply([&](auto &...value) {
+            return (parse_param<Params>(ctx, value, err) && ...);
+        },
+            values);
+        if (!parsed)
+            return err;
+
+        return std::apply([&](auto &...value) {
+            return Handler(ctx, value...);
+        },
+            values);
+    }
+};
@@ -0,0 +1,122 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+
+#pragma once
+
+#include <httplib.h>
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+
+// Request parameter access without copies: the views point into the request and stay valid while it lives
+inline std::string_view get_param_view(const httplib::Request &req, const std::string &name) {
+    const auto it = req.params.find(name);
+    return it == req.params.end() ? std::string_view{} : std::string_view{ it->second };
+}
+
+// Integer parsing with std::from_chars, the whole value must be consumed and no exception is thrown.
+// Integers only: floating-point from_chars is missing from older libc++ (Apple), see parse_decimal
+template <typename T>
+std::optional<T> parse_number(std::string_view value) {
+    static_assert(std::is_integral_v<T>, "parse_number only supports integer types");
+    T result{};
+    const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (value.empty() || ec != std::errc() || end != value.data() + value.size())
+        return std::nullopt;
+
+    return result;
+}
+
+template <typename T>
+std::optional<T> get_number_param(const httplib::Request &req, const std::string &name) {
+    return parse_number<T>(get_param_view(req, name));
+}
+
+// Character classes, built at compile time
+using CharClass = std::array<bool, 256>;
+
+constexpr CharClass make_char_class(std::string_view chars, bool letters = false, bool digits = false) {
+    CharClass table{};
+    for (const char c : chars)
+        table[static_cast<unsigned char>(c)] = true;
+    for (int c = 0; c < 256; ++c) {
+        if (letters && ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')))
+            table[c] = true;
+        if (digits && c >= '0' && c <= '9')
+            table[c] = true;
+    }
+    return table;
+}
+
+constexpr bool matches_char_class(std::string_view value, const CharClass &table) {
+    for (const char c : value) {
+        if (!table[static_cast<unsigned char>(c)])
+            return false;
+    }
+    return true;
+}
+
+inline constexpr CharClass LETTER_CHARS = make_char_class("", true, false);
+inline constexpr CharClass DIGIT_CHARS = make_char_class("", false, true);
+inline constexpr CharClass ONLINE_ID_CHARS = make_char_class("_-", true, true);
+inline constexpr CharClass ID_CHARS = make_char_class("_", true, true);
+
+// Plain decimal numbers such as client versions ("0.01"), at most 15 fraction digits. Both parts are parsed as
+// integers and divided once, which rounds like strtod without depending on the locale
+inline std::optional<double> parse_decimal(std::string_view value) {
+    const size_t dot = value.find('.');
+    const std::string_view integer_part = value.substr(0, dot);
+    const std::string_view fraction_part = (dot == std::string_view::npos) ? std::string_view{} : value.substr(dot + 1);
+    if ((dot != std::string_view::npos && fraction_part.empty()) || fraction_part.size() > 15
+        || !matches_char_class(integer_part, DIGIT_CHARS) || !matches_char_class(fraction_part, DIGIT_CHARS))
+        return std::nullopt;
+
+    const auto integer = parse_number<uint64_t>(integer_part);
+    if (!integer)
+        return std::nullopt;
+    if (fraction_part.empty())
+        return static_cast<double>(*integer);
+
+    uint64_t scale = 1;
+    for (size_t i = 0; i < fraction_part.size(); ++i)
+        scale *= 10;
+    const uint64_t fraction = *parse_number<uint64_t>(fraction_part);
+    return static_cast<double>(*integer) + static_cast<double>(fraction) / static_cast<double>(scale);
+}
+
+// Online ID: a letter followed by 2 to 15 letters, digits, '_' or '-'
+constexpr bool is_online_id_format(std::string_view online_id) {
+    return (online_id.size() >= 3) && (online_id.size() <= 16) && LETTER_CHARS[static_cast<unsigned char>(online_id[0])]
+        && matches_char_class(online_id.substr(1), ONLINE_ID_CHARS);
+}
+
+// Fixed size identifiers with a known prefix, e.g. PCSE00000 or NPWR00000_00
+struct IdFormat {
+    std::string_view prefix;
+    size_t size;
+
+    constexpr bool matches(std::string_view id) const {
+        return (id.size() == size) && id.starts_with(prefix) && matches_char_class(id, ID_CHARS);
+    }
+};
+
+inline constexpr IdFormat SAVEDATA_ID_FORMAT{ "PCS", 9 };
+inline constexpr IdFormat TROPHY_ID_FORMAT{ "NPWR", 12 };
+
+constexpr bool is_savedata_id(std::string_view id) {
+    return SAVEDATA_ID_FORMAT.matches(id);
+}
+
+constexpr bool is_trophy_id(std::string_view id) {
+    return TROPHY_ID_FORMAT.matches(id);
+}
+
+static_assert(is_online_id_format("Vita3K") && is_online_id_format("a_-") && !is_online_id_format("3ds") && !is_online_id_format("ab"));
+static_assert(is_savedata_id("PCSE00000") && !is_savedata_id("PCSE0000") && !is_savedata_id("PCSE0000/"));
+static_assert(is_trophy_id("NPWR00000_00") && !is_trophy_id("NPWR00000.00"));
@@ -6,6 +6,7 @@
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 
+#include <array>
 #include <condition_variable>
 #include <filesystem>
 #include <functional>
@@ -19,6 +20,8 @@ namespace fs = std::filesystem;
 
 // Constants
 constexpr uint64_t DEFAULT_QUOTA_TOTAL = 50 * 1024 * 1024; // 50 MB
+constexpr size_t MAX_POLL_EVENTS_PER_ACCOUNT = 200; // Oldest events are dropped beyond this
+constexpr size_t DEFAULT_MEMORY_BUDGET = 512 * 1024 * 1024; // 512 MB, override with V3KN_MEMORY_BUDGET_MB
 
 // Mutexes
 extern std::mutex account_mutex;
@@ -54,14 +57,68 @@ extern std::unordered_map<std::string, std::string> online_id_cache; // online_i
 // Account ID cache to speed up lookups (not persisted to disk, built on server start and updated on demand)
 extern std::unordered_map<std::string, std::string> account_id_cache; // account_id -> online_id
 
+// Memory accounting: every in-memory structure reports its usage, evictable caches also provide an eviction callback
+struct MemoryUsage {
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+struct MemoryConsumer {
+    std::string name;
+    std::function<MemoryUsage()> usage;
+    std::function<size_t(size_t bytes_to_free)> evict; // Returns the bytes freed, empty for structures that are the only copy of their data
+    size_t floor_bytes = 0; // Not evicted while below this size, overridden by V3KN_MEMORY_FLOOR_<NAME>_MB (e.g. V3KN_MEMORY_FLOOR_PROFILE_CACHE_MB)
+    uint32_t cost = 1; // Relative cost of rebuilding an evicted byte, the cheapest caches are evicted first
+};
+
+void register_memory_consumer(MemoryConsumer consumer);
+void start_memory_budget_monitor();
+void enforce_memory_budget();
+size_t get_memory_budget();
+json get_memory_usage_report();
+size_t estimate_string_bytes(const std::string &str);
+size_t estimate_json_bytes(const json &value);
+size_t estimate_string_map_bytes(const std::unordered_map<std::string, std::string> &map);
+
+// Metrics: named counters and gauges exposed by the admin endpoints
+void increment_metric(const std::string &name, int64_t delta = 1);
+void set_metric(const std::string &name, int64_t value);
+json get_metrics_snapshot();
+
 struct UserAccount {
     std::string account_id;
     std::string online_id;
 };
 
+// File operations
+bool write_file_atomic(const fs::path &path, const std::string &content);
+
+// Data directory layout: entries of the Users, conversations and Trophies trees live under two hashed levels
+// (v3kn/Users/3f/a2/<online_id>), entries still in the old flat layout are resolved until they are migrated
+enum class DataTree {
+    Users,
+    Conversations,
+    Trophies,
+};
+
+fs::path get_data_tree_root(DataTree tree);
+fs::path get_hashed_entry_path(DataTree tree, const std::string &name);
+fs::path get_data_entry_path(DataTree tree, const std::string &name);
+std::vector<std::string> list_data_entries(DataTree tree);
+bool rename_data_entry(DataTree tree, const std::string &name, const std::string &new_name);
+// Entries are moved by v3kn-admin --migrate-layout only: requests resolve and use paths without a common lock
+// (get_user_dir is called outside request_mutex), so nothing may move while the server runs
+size_t migrate_data_layout();
+void check_data_layout();
+
+inline fs::path get_user_dir(const std::string &online_id) {
+    return get_data_entry_path(DataTree::Users, online_id);
+}
+
 // Database operations
 json load_profile(const std::string &online_id);
 void save_profile(const std::string &online_id, const json &profile);
+void invalidate_profile_cache(const std::string &online_id);
 json load_users();
 void save_users(const json &db);
 json load_stitles();
@@ -80,10 +137,27 @@ std::string get_online_id_from_account_id(const std::string &account_id);
 std::string get_account_id_from_online_id(const std::string &online_id);
 std::optional<UserAccount> get_valid_account(const httplib::Request &req, const std::string &request, std::string &err);
 std::optional<UserAccount> get_valid_target_account(const httplib::Request &req, const std::string &request, std::string &err, const std::string &online_id);
+bool is_admin_request(const httplib::Request &req);
+
+// Wraps a mutating handler so requests carrying an Idempotency-Key header are executed once per account and key,
+// a key reused with another path, parameters or body gets a 422
+httplib::Server::Handler with_idempotency(httplib::Server::Handler handler);
+
+// Transfer scheduler: large responses are streamed through a per-connection token bucket whose rate is the weighted
+// fair share of the global rate, and through a shared global bucket (V3KN_TRANSFER_RATE_KB,
+// V3KN_TRANSFER_CONNECTION_RATE_KB, 0 disables a limit). Pacing holds the connection's pool worker, so at most
+// MAX_PACED_TRANSFERS run paced and the extra ones get a 503 ERR:TransferBusy with Retry-After
+constexpr size_t TRANSFER_SCHEDULER_MIN_BYTES = 64 * 1024; // Smaller responses bypass the scheduler
+void set_scheduled_content(httplib::Response &res, std::string content, const std::string &content_type, int weight = 1);
+void meter_upload(size_t bytes);
 
 // Crypto operations
 std::vector<unsigned char> generate_salt();
 std::vector<unsigned char> compute_server_hash(const std::string &client_hash, const std::vector<unsigned char> &salt);
+std::vector<unsigned char> generate_random_bytes(size_t length);
+std::array<unsigned char, 32> compute_hmac_sha256(const std::vector<unsigned char> &key, const unsigned char *data, size_t size);
+bool constant_time_equals(const unsigned char *a, const unsigned char *b, size_t size);
+std::string compute_sha256_hex(const std::string &data);
 
 // String operations
 std::string base64_encode(const std::string &input);
@@ -1,17 +1,30 @@
 // v3knr project
 // Copyright (C) 2026 Vita3K team
 
+#include "utils/params.h"
 #include "utils/utils.h"
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cstdlib>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
 #include <random>
+#include <thread>
+#include <unordered_set>
 
 // Global mutexes
 std::mutex account_mutex;
@@ -42,6 +55,85 @@ static std::mutex poll_events_mutex;
 static std::mutex poll_events_file_mutex;
 
 static json stitles_cache = json{ { "titles", json::object() } };
+static bool stitles_cache_loaded = false; // The cache can be evicted under memory pressure and is reloaded on next access
+
+static std::vector<MemoryConsumer> memory_consumers;
+static std::unordered_map<std::string, size_t> memory_evicted_bytes; // consumer name -> total bytes evicted
+static std::mutex memory_consumers_mutex;
+
+static std::map<std::string, int64_t> metrics; // Sorted for stable output
+static std::mutex metrics_mutex;
+
+// Idempotency keys: responses of mutating requests are kept per (account, key) so a retried request
+// gets the stored response instead of being executed again. Completed entries are journaled to survive restarts.
+static constexpr size_t MAX_IDEMPOTENCY_ENTRIES = 10000;
+static constexpr size_t MAX_IDEMPOTENCY_KEY_LENGTH = 128;
+static constexpr size_t MAX_IDEMPOTENCY_BODY_BYTES = 64 * 1024;
+static constexpr uint64_t IDEMPOTENCY_TTL_MS = 24 * 60 * 60 * 1000ULL;
+static constexpr std::array<const char *, 1> IDEMPOTENCY_REPLAYED_HEADERS = { "ETag" }; // Needed by the client for its next If-Match
+
+struct IdempotencyEntry {
+    std::string path;
+    bool in_flight = true;
+    int status = 200;
+    std::string content_type;
+    std::string body;
+    json headers = json::object(); // Replayed response headers
+    std::string fingerprint; // Hash of the request parameters and body, empty for entries journaled without it
+    uint64_t created_at = 0;
+};
+
+static std::mutex idempotency_mutex;
+static std::unordered_map<std::string, IdempotencyEntry> idempotency_entries; // account_id + '\n' + key -> entry
+static std::list<std::string> idempotency_order; // Completed entries, oldest first
+static bool idempotency_journal_loaded = false;
+static size_t idempotency_journal_lines = 0;
+static const fs::path idempotency_journal_path{ fs::path("v3kn") / "idempotency.journal" };
+
+// Helper: Key identifying events that supersede each other, empty if the event is never coalesced
+static std::string get_poll_event_coalesce_key(const json &event) {
+    if (!event.is_object())
+        return {};
+
+    const std::string type = event.value("type", "");
+    if (type == "friend")
+        return type + ":" + event.value("group", "") + ":" + event.value("account_id", "");
+    if (type == "activity")
+        return type + ":" + event.value("group", "") + ":" + std::to_string(event.value("created_at", int64_t{ 0 })) + ":" + event.value("account_id", "");
+
+    return {};
+}
+
+// Helper: Keep only the latest of duplicate events and drop the oldest ones beyond the per-account cap
+static void bound_poll_events(json &events) {
+    std::unordered_set<std::string> seen;
+    json bounded = json::array();
+    size_t coalesced = 0;
+    for (auto it = events.rbegin(); it != events.rend(); ++it) {
+        const std::string key = get_poll_event_coalesce_key(*it);
+        if (!key.empty() && !seen.insert(key).second) {
+            ++coalesced;
+            continue;
+        }
+        bounded.push_back(*it);
+    }
+
+    size_t dropped = 0;
+    if (bounded.size() > MAX_POLL_EVENTS_PER_ACCOUNT) {
+        dropped = bounded.size() - MAX_POLL_EVENTS_PER_ACCOUNT;
+        bounded.erase(bounded.begin() + MAX_POLL_EVENTS_PER_ACCOUNT, bounded.end());
+    }
+
+    if (coalesced == 0 && dropped == 0)
+        return;
+
+    std::reverse(bounded.begin(), bounded.end());
+    events = std::move(bounded);
+    if (coalesced > 0)
+        increment_metric("poll_events.coalesced", static_cast<int64_t>(coalesced));
+    if (dropped > 0)
+        increment_metric("poll_events.dropped", static_cast<int64_t>(dropped));
+}
 
 void load_poll_events_from_disk() {
     std::ifstream f("v3kn/events.json");
@@ -56,8 +148,12 @@ void load_poll_events_from_disk() {
     std::lock_guard<std::mutex> lock(poll_events_mutex);
     poll_events.clear();
     for (auto it = data.begin(); it != data.end(); ++it) {
-        if (it.value().is_array())
-            poll_events[it.key()] = it.value().get<std::vector<json>>();
+        if (!it.value().is_array())
+            continue;
+
+        json events = it.value();
+        bound_poll_events(events);
+        poll_events[it.key()] = events.get<std::vector<json>>();
     }
 }
 
@@ -68,8 +164,7 @@ static void save_poll_events_to_disk() {
         data[account_id] = events;
     }
 
-    std::ofstream f("v3kn/events.json");
-    f << data.dump(2);
+    write_file_atomic("v3kn/events.json", data.dump(2));
 }
 
 bool update_poll_events(const std::string &account_id, const std::function<void(json &events)> &updater) {
@@ -81,6 +176,7 @@ bool update_poll_events(const std::string &account_id, const std::function<void(
 
     const json before = events;
     updater(events);
+    bound_poll_events(events);
     if (events == before)
         return false;
 
@@ -135,16 +231,235 @@ void cleanup_old_poll_events(int64_t max_age_seconds) {
         save_poll_events_to_disk();
 }
 
+// File operations
+// Write to a temporary file next to the target then rename it over, a crash mid-write leaves the previous file intact
+bool write_file_atomic(const fs::path &path, const std::string &content) {
+    const fs::path tmp_path = path.string() + ".tmp" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!f.is_open()) {
+            log("Failed to open " + tmp_path.string() + " for writing");
+            return false;
+        }
+        f << content;
+        f.flush();
+        if (!f) {
+            log("Failed to write " + tmp_path.string());
+            f.close();
+            std::error_code ec;
+            fs::remove(tmp_path, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        log("Failed to replace " + path.string() + ": " + ec.message());
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+// Data directory layout
+static const fs::path data_layout_marker_path{ fs::path("v3kn") / "layout.json" };
+static constexpr int HASHED_DATA_LAYOUT_VERSION = 2;
+
+// Cleared once the migration found no flat entry left, resolving then never touches the flat paths
+static std::atomic<bool> legacy_data_layout_present{ true };
+static std::once_flag data_layout_marker_checked;
+
+fs::path get_data_tree_root(DataTree tree) {
+    switch (tree) {
+    case DataTree::Users: return fs::path("v3kn") / "Users";
+    case DataTree::Conversations: return fs::path("v3kn") / "conversations";
+    case DataTree::Trophies: return fs::path("v3kn") / "Trophies";
+    }
+    return fs::path("v3kn");
+}
+
+// Helper: Two hex characters bucket names never clash with entries, online IDs start with a letter and have 3+ characters
+static bool is_data_bucket_name(const std::string &name) {
+    return (name.size() == 2) && std::isxdigit(static_cast<unsigned char>(name[0])) && std::isxdigit(static_cast<unsigned char>(name[1]));
+}
+
+fs::path get_hashed_entry_path(DataTree tree, const std::string &name) {
+    // FNV-1a, stable across platforms and releases unlike std::hash
+    uint32_t hash = 2166136261u;
+    for (const char c : name)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+
+    static constexpr char hex[] = "0123456789abcdef";
+    const std::string level1{ hex[(hash >> 28) & 0xf], hex[(hash >> 24) & 0xf] };
+    const std::string level2{ hex[(hash >> 20) & 0xf], hex[(hash >> 16) & 0xf] };
+    return get_data_tree_root(tree) / level1 / level2 / name;
+}
+
+fs::path get_data_entry_path(DataTree tree, const std::string &name) {
+    std::call_once(data_layout_marker_checked, [] {
+        std::error_code ec;
+        if (fs::exists(data_layout_marker_path, ec))
+            legacy_data_layout_present = false;
+    });
+
+    const fs::path hashed_path = get_hashed_entry_path(tree, name);
+    if (!legacy_data_layout_present)
+        return hashed_path;
+
+    std::error_code ec;
+    if (!name.empty() && !fs::exists(hashed_path, ec)) {
+        const fs::path legacy_path = get_data_tree_root(tree) / name;
+        if (fs::exists(legacy_path, ec))
+            return legacy_path;
+    }
+    return hashed_path;
+}
+
+// Entries of both layouts, hashed first
+std::vector<std::string> list_data_entries(DataTree tree) {
+    std::vector<std::string> hashed_entries, legacy_entries;
+    std::error_code ec;
+    for (const auto &level1 : fs::directory_iterator(get_data_tree_root(tree), ec)) {
+        const std::string level1_name = level1.path().filename().string();
+        if (!level1.is_directory(ec))
+            continue;
+
+        if (!is_data_bucket_name(level1_name)) {
+            legacy_entries.push_back(level1_name);
+            continue;
+        }
+
+        for (const auto &level2 : fs::directory_iterator(level1.path(), ec)) {
+            if (!level2.is_directory(ec))
+                continue;
+            for (const auto &entry : fs::directory_iterator(level2.path(), ec)) {
+                if (entry.is_directory(ec))
+                    hashed_entries.push_back(entry.path().filename().string());
+            }
+        }
+    }
+    hashed_entries.insert(hashed_entries.end(), legacy_entries.begin(), legacy_entries.end());
+    return hashed_entries;
+}
+
+// Renamed entries always land in the hashed layout
+bool rename_data_entry(DataTree tree, const std::string &name, const std::string &new_name) {
+    const fs::path from = get_data_entry_path(tree, name);
+    const fs::path to = get_hashed_entry_path(tree, new_name);
+    std::error_code ec;
+    if (!fs::exists(from, ec))
+        return false;
+
+    fs::create_directories(to.parent_path(), ec);
+    fs::rename(from, to, ec);
+    if (ec) {
+        log("Failed to rename " + from.string() + " to " + to.string() + ": " + ec.message());
+        return false;
+    }
+    return true;
+}
+
+// Helper: Directories of a tree still in the flat layout
+static std::vector<std::string> list_legacy_data_entries(DataTree tree) {
+    std::vector<std::string> legacy_entries;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(get_data_tree_root(tree), ec)) {
+        const std::string name = entry.path().filename().string();
+        if (entry.is_directory(ec) && !is_data_bucket_name(name))
+            legacy_entries.push_back(name);
+    }
+    return legacy_entries;
+}
+
+// Helper: Move the flat entries of a tree under their hashed path, returns the number of entries left behind
+static size_t migrate_data_tree(DataTree tree) {
+    size_t migrated = 0, left = 0;
+    for (const auto &name : list_legacy_data_entries(tree)) {
+        const fs::path legacy_path = get_data_tree_root(tree) / name;
+        const fs::path hashed_path = get_hashed_entry_path(tree, name);
+        std::error_code ec;
+        if (fs::exists(hashed_path, ec)) {
+            log("Data layout migration: " + hashed_path.string() + " already exists, leaving " + legacy_path.string() + " in place");
+            ++left;
+            continue;
+        }
+
+        fs::create_directories(hashed_path.parent_path(), ec);
+        fs::rename(legacy_path, hashed_path, ec);
+        if (ec) {
+            log("Data layout migration: failed to move " + legacy_path.string() + ": " + ec.message());
+            ++left;
+            continue;
+        }
+        ++migrated;
+    }
+
+    if (migrated > 0)
+        log("Data layout migration: moved " + std::to_string(migrated) + " entries to " + get_data_tree_root(tree).string());
+    return left;
+}
+
+// Helper: Record that no flat entry is left, resolving then never touches the flat paths
+static void mark_data_layout_migrated() {
+    write_file_atomic(data_layout_marker_path, json{ { "version", HASHED_DATA_LAYOUT_VERSION } }.dump(2));
+    legacy_data_layout_present = false;
+}
+
+size_t migrate_data_layout() {
+    size_t left = 0;
+    for (const auto tree : { DataTree::Users, DataTree::Conversations, DataTree::Trophies })
+        left += migrate_data_tree(tree);
+
+    if (left > 0) {
+        log("Data layout migration: " + std::to_string(left) + " entries left in the flat layout");
+        return left;
+    }
+
+    mark_data_layout_migrated();
+    log("Data layout migration complete");
+    return 0;
+}
+
+void check_data_layout() {
+    std::error_code ec;
+    if (fs::exists(data_layout_marker_path, ec)) {
+        legacy_data_layout_present = false;
+        return;
+    }
+
+    // Only counted here, new entries are always created in the hashed layout
+    size_t legacy = 0;
+    for (const auto tree : { DataTree::Users, DataTree::Conversations, DataTree::Trophies })
+        legacy += list_legacy_data_entries(tree).size();
+
+    set_metric("data_layout.legacy_entries", static_cast<int64_t>(legacy));
+    if (legacy == 0) {
+        mark_data_layout_migrated();
+        return;
+    }
+
+    log("Data layout: " + std::to_string(legacy) + " entries are still in the flat layout, stop the server and run v3kn-admin --migrate-layout");
+}
+
 // Database operations
 std::mutex profile_mutex;
+// Profiles read from disk, kept in sync by save_profile (not persisted, evictable under memory pressure)
+static std::unordered_map<std::string, json> profile_cache; // online_id -> profile
+
 json load_profile(const std::string &online_id) {
     std::lock_guard<std::mutex> lock(profile_mutex);
-    const fs::path profile_path{ fs::path("v3kn") / "Users" / online_id / "profile.json" };
+    const auto cached = profile_cache.find(online_id);
+    if (cached != profile_cache.end())
+        return cached->second;
+
+    const fs::path profile_path{ get_user_dir(online_id) / "profile.json" };
     if (fs::exists(profile_path)) {
         std::ifstream profile_file(profile_path);
         try {
             json profile;
             profile_file >> profile;
+            profile_cache[online_id] = profile;
             return profile;
         } catch (...) {
             // If the file is corrupted -> recreate a clean profile
@@ -164,9 +479,17 @@ json load_profile(const std::string &online_id) {
 
 void save_profile(const std::string &online_id, const json &profile) {
     std::lock_guard<std::mutex> lock(profile_mutex);
-    const fs::path profile_path{ fs::path("v3kn") / "Users" / online_id / "profile.json" };
-    std::ofstream profile_file_out(profile_path);
-    profile_file_out << profile.dump(2);
+    const fs::path profile_path{ get_user_dir(online_id) / "profile.json" };
+    if (write_file_atomic(profile_path, profile.dump(2)))
+        profile_cache[online_id] = profile;
+    else
+        profile_cache.erase(online_id);
+}
+
+// Must be called when a user directory is renamed or removed outside of save_profile
+void invalidate_profile_cache(const std::string &online_id) {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profile_cache.erase(online_id);
 }
 
 json load_users() {
@@ -179,8 +502,7 @@ json load_users() {
 }
 
 void save_users(const json &db) {
-    std::ofstream f("v3kn/users.json");
-    f << db.dump(2);
+    write_file_atomic("v3kn/users.json", db.dump(2));
 }
 
 json load_stitles() {
@@ -196,22 +518,33 @@ json load_stitles() {
 }
 
 void save_stitles(const json &db) {
-    std::ofstream f("v3kn/stitles.json");
-    f << db.dump(2);
+    write_file_atomic("v3kn/stitles.json", db.dump(2));
 }
 
 void reload_stitles_cache() {
     std::lock_guard<std::mutex> lock(stitles_cache_mutex);
     stitles_cache = load_stitles();
+    stitles_cache_loaded = true;
+}
+
+// Helper: Reload the short titles cache if it was evicted (stitles_cache_mutex must be held)
+static void ensure_stitles_cache_loaded() {
+    if (stitles_cache_loaded)
+        return;
+
+    stitles_cache = load_stitles();
+    stitles_cache_loaded = true;
 }
 
 bool has_stitle_info(const std::string &titleid) {
     std::lock_guard<std::mutex> lock(stitles_cache_mutex);
+    ensure_stitles_cache_loaded();
     return stitles_cache.contains("stitles") && stitles_cache["stitles"].contains(titleid);
 }
 
 void update_stitle_info(const std::string &titleid, const json &names) {
     std::lock_guard<std::mutex> lock(stitles_cache_mutex);
+    ensure_stitles_cache_loaded();
     if (!stitles_cache.contains("stitles") || !stitles_cache["stitles"].is_object())
         stitles_cache["stitles"] = json::object();
 
@@ -222,6 +555,7 @@ void update_stitle_info(const std::string &titleid, const json &names) {
 
 std::string get_stitle_name(const std::string &titleid, const std::string &language) {
     std::lock_guard<std::mutex> lock(stitles_cache_mutex);
+    ensure_stitles_cache_loaded();
     if (!stitles_cache.contains("stitles") || !stitles_cache["stitles"].contains(titleid))
         return titleid;
 
@@ -240,6 +574,7 @@ std::string get_stitle_name(const std::string &titleid, const std::string &langu
 
 size_t get_stitles_cache_size() {
     std::lock_guard<std::mutex> lock(stitles_cache_mutex);
+    ensure_stitles_cache_loaded();
     if (!stitles_cache.contains("stitles") || !stitles_cache["stitles"].is_object())
         return 0;
     return stitles_cache["stitles"].size();
@@ -326,7 +661,7 @@ std::optional<UserAccount> get_valid_account(const httplib::Request &req, const
 
 std::optional<UserAccount> get_valid_target_account(const httplib::Request &req, const std::string &request, std::string &err, const std::string &online_id) {
     // Get target online_id from parameters
-    std::string target_online_id = req.get_param_value("target_online_id");
+    std::string target_online_id(get_param_view(req, "target_online_id"));
     if (target_online_id.empty()) {
         log("Online ID " + online_id + " try to get activities with missing target online ID");
         err = "ERR:MissingTargetOnlineID";
@@ -350,6 +685,15 @@ std::optional<UserAccount> get_valid_target_account(const httplib::Request &req,
     return UserAccount{ target_account_id, target_online_id };
 }
 
+// Admin endpoints are disabled unless V3KN_ADMIN_TOKEN is set, requests must send it in the X-Admin-Token header
+bool is_admin_request(const httplib::Request &req) {
+    static const char *admin_token = std::getenv("V3KN_ADMIN_TOKEN");
+    if (!admin_token || !*admin_token)
+        return false;
+
+    return req.get_header_value("X-Admin-Token") == admin_token;
+}
+
 std::string get_online_id_from_account_id(const std::string &account_id) {
     std::lock_guard<std::mutex> lock(account_id_cache_mutex);
     auto it = account_id_cache.find(account_id);
@@ -391,6 +735,39 @@ std::vector<unsigned char> compute_server_hash(const std::string &client_hash, c
     return hash;
 }
 
+// Cryptographically secure random bytes from OpenSSL
+std::vector<unsigned char> generate_random_bytes(size_t length) {
+    std::vector<unsigned char> bytes(length);
+    if (RAND_bytes(bytes.data(), static_cast<int>(length)) != 1)
+        throw std::runtime_error("RAND_bytes failed");
+    return bytes;
+}
+
+std::array<unsigned char, 32> compute_hmac_sha256(const std::vector<unsigned char> &key, const unsigned char *data, size_t size) {
+    std::array<unsigned char, 32> mac{};
+    unsigned int mac_size = 0;
+    HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()), data, size, mac.data(), &mac_size);
+    return mac;
+}
+
+bool constant_time_equals(const unsigned char *a, const unsigned char *b, size_t size) {
+    return CRYPTO_memcmp(a, b, size) == 0;
+}
+
+std::string compute_sha256_hex(const std::string &data) {
+    std::array<unsigned char, SHA256_DIGEST_LENGTH> hash{};
+    EVP_Digest(data.data(), data.size(), hash.data(), nullptr, EVP_sha256(), nullptr);
+
+    static constexpr char hex[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(hash.size() * 2);
+    for (const unsigned char c : hash) {
+        result += hex[c >> 4];
+        result += hex[c & 0xf];
+    }
+    return result;
+}
+
 // String operations
 static const char b64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 std::string base64_decode(const std::string &encoded) {
@@ -472,7 +849,34 @@ void update_remote_addr(const httplib::Request &req, json &user) {
     }
 }
 
+// Last activity is only written to users.json once per interval, or when the request comes from a new address
+constexpr int64_t LAST_ACTIVITY_WRITE_INTERVAL = 300; // 5 minutes
+static std::unordered_map<std::string, std::pair<int64_t, std::string>> last_activity_written; // account_id -> (written at, remote address)
+static int64_t last_activity_pruned_at = 0;
+static std::mutex last_activity_mutex;
+
+// Helper: Whether the activity of an account is due to be written, recorded as written when it is
+static bool should_write_last_activity(const std::string &account_id, const std::string &remote_addr, int64_t now) {
+    std::lock_guard<std::mutex> lock(last_activity_mutex);
+
+    // Entries older than the interval no longer throttle anything, so the map only holds the recently active accounts
+    if ((now - last_activity_pruned_at) >= LAST_ACTIVITY_WRITE_INTERVAL) {
+        std::erase_if(last_activity_written, [&](const auto &entry) { return (now - entry.second.first) >= LAST_ACTIVITY_WRITE_INTERVAL; });
+        last_activity_pruned_at = now;
+    }
+
+    auto &written = last_activity_written[account_id];
+    if ((now - written.first) < LAST_ACTIVITY_WRITE_INTERVAL && written.second == remote_addr)
+        return false;
+
+    written = { now, remote_addr };
+    return true;
+}
+
 void update_last_activity(const httplib::Request &req, const std::string &account_id) {
+    if (!should_write_last_activity(account_id, get_remote_addr(req), std::time(0)))
+        return;
+
     std::lock_guard<std::mutex> lock(account_mutex);
     json db = load_users();
     if (!db.contains("users") || !db["users"].contains(account_id))
@@ -527,3 +931,605 @@ void log(const std::string &msg) {
 uint64_t get_current_time_ms() {
     return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
+
+// Memory accounting
+// Helper: Floor of a consumer from its environment variable, the default when unset
+static size_t get_memory_floor(const std::string &name, size_t default_floor) {
+    std::string variable = "V3KN_MEMORY_FLOOR_";
+    for (const char c : name)
+        variable += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    variable += "_MB";
+
+    const char *floor_mb = std::getenv(variable.c_str());
+    if (floor_mb && *floor_mb) {
+        if (const auto value = parse_number<size_t>(floor_mb))
+            return *value * 1024 * 1024;
+        log("Invalid " + variable + " value, using default memory floor");
+    }
+    return default_floor;
+}
+
+void register_memory_consumer(MemoryConsumer consumer) {
+    consumer.floor_bytes = get_memory_floor(consumer.name, consumer.floor_bytes);
+    std::lock_guard<std::mutex> lock(memory_consumers_mutex);
+    memory_consumers.push_back(std::move(consumer));
+}
+
+size_t get_memory_budget() {
+    static const size_t budget = [] {
+        const char *budget_mb = std::getenv("V3KN_MEMORY_BUDGET_MB");
+        if (budget_mb && *budget_mb) {
+            if (const auto value = parse_number<size_t>(budget_mb))
+                return *value * 1024 * 1024;
+            log("Invalid V3KN_MEMORY_BUDGET_MB value, using default memory budget");
+        }
+        return DEFAULT_MEMORY_BUDGET;
+    }();
+    return budget;
+}
+
+size_t estimate_string_bytes(const std::string &str) {
+    // Short strings live inside the object (SSO)
+    return sizeof(std::string) + (str.capacity() > 15 ? str.capacity() + 1 : 0);
+}
+
+size_t estimate_json_bytes(const json &value) {
+    size_t bytes = sizeof(json);
+    switch (value.type()) {
+    case json::value_t::string:
+        bytes += estimate_string_bytes(value.get_ref<const std::string &>());
+        break;
+    case json::value_t::array:
+        bytes += sizeof(json::array_t);
+        for (const auto &element : value)
+            bytes += estimate_json_bytes(element);
+        break;
+    case json::value_t::object:
+        bytes += sizeof(json::object_t);
+        for (const auto &[key, element] : value.items())
+            bytes += 32 + estimate_string_bytes(key) + estimate_json_bytes(element); // 32: tree node links
+        break;
+    default:
+        break;
+    }
+    return bytes;
+}
+
+size_t estimate_string_map_bytes(const std::unordered_map<std::string, std::string> &map) {
+    size_t bytes = map.bucket_count() * sizeof(void *);
+    for (const auto &[key, value] : map)
+        bytes += 2 * sizeof(void *) + estimate_string_bytes(key) + estimate_string_bytes(value); // 2 pointers: node link and cached hash
+    return bytes;
+}
+
+static void register_utils_memory_consumers() {
+    const auto string_map_consumer = [](const std::string &name, const std::unordered_map<std::string, std::string> &map, std::mutex &mutex) {
+        MemoryConsumer consumer;
+        consumer.name = name;
+        consumer.usage = [&map, &mutex] {
+            std::lock_guard<std::mutex> lock(mutex);
+            return MemoryUsage{ map.size(), estimate_string_map_bytes(map) };
+        };
+        return consumer;
+    };
+
+    // Identity caches are never evicted, they are the only token/online ID index
+    register_memory_consumer(string_map_consumer("token_cache", token_cache, token_cache_mutex));
+    register_memory_consumer(string_map_consumer("online_id_cache", online_id_cache, online_id_cache_mutex));
+    register_memory_consumer(string_map_consumer("account_id_cache", account_id_cache, account_id_cache_mutex));
+
+    MemoryConsumer stitles;
+    stitles.name = "stitles_cache";
+    stitles.usage = [] {
+        std::lock_guard<std::mutex> lock(stitles_cache_mutex);
+        const size_t entries = stitles_cache.contains("stitles") ? stitles_cache["stitles"].size() : 0;
+        return MemoryUsage{ entries, estimate_json_bytes(stitles_cache) };
+    };
+    stitles.evict = [](size_t) {
+        std::lock_guard<std::mutex> lock(stitles_cache_mutex);
+        const size_t freed = estimate_json_bytes(stitles_cache);
+        stitles_cache = json{ { "stitles", json::object() } };
+        stitles_cache_loaded = false;
+        return freed;
+    };
+    stitles.floor_bytes = 8 * 1024 * 1024; // Dropped whole, so the usual title list is never evicted
+    stitles.cost = 4;
+    register_memory_consumer(std::move(stitles));
+
+    MemoryConsumer profiles;
+    profiles.name = "profile_cache";
+    profiles.usage = [] {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        MemoryUsage usage;
+        usage.entries = profile_cache.size();
+        for (const auto &[online_id, profile] : profile_cache)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(online_id) + estimate_json_bytes(profile);
+        return usage;
+    };
+    profiles.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        size_t freed = 0;
+        for (auto it = profile_cache.begin(); it != profile_cache.end() && freed < bytes_to_free;) {
+            freed += 2 * sizeof(void *) + estimate_string_bytes(it->first) + estimate_json_bytes(it->second);
+            it = profile_cache.erase(it);
+        }
+        return freed;
+    };
+    profiles.floor_bytes = 2 * 1024 * 1024;
+    profiles.cost = 3;
+    register_memory_consumer(std::move(profiles));
+
+    MemoryConsumer events;
+    events.name = "poll_events";
+    events.usage = [] {
+        std::lock_guard<std::mutex> lock(poll_events_mutex);
+        MemoryUsage usage;
+        for (const auto &[account_id, account_events] : poll_events) {
+            usage.entries += account_events.size();
+            usage.bytes += estimate_string_bytes(account_id) + sizeof(std::vector<json>);
+            for (const auto &event : account_events)
+                usage.bytes += estimate_json_bytes(event);
+        }
+        return usage;
+    };
+    register_memory_consumer(std::move(events));
+
+    // Dropping an entry only lets the next request of the account write its activity again
+    MemoryConsumer activity;
+    activity.name = "last_activity_throttle";
+    activity.usage = [] {
+        std::lock_guard<std::mutex> lock(last_activity_mutex);
+        MemoryUsage usage;
+        usage.entries = last_activity_written.size();
+        for (const auto &[account_id, written] : last_activity_written)
+            usage.bytes += 2 * sizeof(void *) + estimate_string_bytes(account_id) + sizeof(written.first) + estimate_string_bytes(written.second);
+        return usage;
+    };
+    activity.evict = [](size_t bytes_to_free) {
+        std::lock_guard<std::mutex> lock(last_activity_mutex);
+        size_t freed = 0;
+        for (auto it = last_activity_written.begin(); it != last_activity_written.end() && freed < bytes_to_free;) {
+            freed += 2 * sizeof(void *) + estimate_string_bytes(it->first) + sizeof(it->second.first) + estimate_string_bytes(it->second.second);
+            it = last_activity_written.erase(it);
+        }
+        return freed;
+    };
+    register_memory_consumer(std::move(activity));
+
+    // Bounded by MAX_IDEMPOTENCY_ENTRIES, evicting would let retried requests execute again
+    MemoryConsumer idempotency;
+    idempotency.name = "idempotency_cache";
+    idempotency.usage = [] {
+        std::lock_guard<std::mutex> lock(idempotency_mutex);
+        MemoryUsage usage;
+        usage.entries = idempotency_entries.size();
+        for (const auto &[cache_key, entry] : idempotency_entries)
+            usage.bytes += 2 * estimate_string_bytes(cache_key) + sizeof(IdempotencyEntry) + entry.path.size() + entry.content_type.size() + entry.body.size() + estimate_json_bytes(entry.headers) + entry.fingerprint.size();
+        return usage;
+    };
+    register_memory_consumer(std::move(idempotency));
+}
+
+// Evict the cheapest caches first until the total usage fits in the budget, never below each cache floor
+void enforce_memory_budget() {
+    std::lock_guard<std::mutex> lock(memory_consumers_mutex);
+
+    std::vector<size_t> usages(memory_consumers.size());
+    size_t total = 0;
+    for (size_t i = 0; i < memory_consumers.size(); ++i) {
+        usages[i] = memory_consumers[i].usage().bytes;
+        total += usages[i];
+    }
+
+    const size_t budget = get_memory_budget();
+    set_metric("memory.total_bytes", static_cast<int64_t>(total));
+    set_metric("memory.budget_bytes", static_cast<int64_t>(budget));
+    if (total <= budget)
+        return;
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < memory_consumers.size(); ++i) {
+        if (memory_consumers[i].evict && usages[i] > memory_consumers[i].floor_bytes)
+            order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (memory_consumers[a].cost != memory_consumers[b].cost)
+            return memory_consumers[a].cost < memory_consumers[b].cost;
+        return usages[a] > usages[b];
+    });
+
+    size_t to_free = total - budget;
+    for (const size_t i : order) {
+        if (to_free == 0)
+            break;
+
+        auto &consumer = memory_consumers[i];
+        const size_t freed = consumer.evict(std::min(to_free, usages[i] - consumer.floor_bytes));
+        memory_evicted_bytes[consumer.name] += freed;
+        increment_metric("memory.evicted_bytes", static_cast<int64_t>(freed));
+        to_free -= std::min(to_free, freed);
+        log("Memory budget exceeded, evicted " + std::to_string(freed) + " bytes from " + consumer.name);
+    }
+}
+
+json get_memory_usage_report() {
+    std::lock_guard<std::mutex> lock(memory_consumers_mutex);
+    json report = json::object();
+    json consumers = json::object();
+    size_t total = 0;
+    for (const auto &consumer : memory_consumers) {
+        const MemoryUsage usage = consumer.usage();
+        total += usage.bytes;
+
+        json entry;
+        entry["entries"] = usage.entries;
+        entry["bytes"] = usage.bytes;
+        entry["evictable"] = static_cast<bool>(consumer.evict);
+        entry["floor_bytes"] = consumer.floor_bytes;
+        entry["cost"] = consumer.cost;
+        entry["evicted_bytes"] = memory_evicted_bytes.contains(consumer.name) ? memory_evicted_bytes[consumer.name] : 0;
+        consumers[consumer.name] = entry;
+    }
+    report["budget_bytes"] = get_memory_budget();
+    report["total_bytes"] = total;
+    report["consumers"] = consumers;
+    return report;
+}
+
+void start_memory_budget_monitor() {
+    register_utils_memory_consumers();
+    log("Memory budget: " + std::to_string(get_memory_budget() / (1024 * 1024)) + " MB");
+
+    std::thread([] {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(30));
+            enforce_memory_budget();
+        }
+    }).detach();
+}
+
+// Metrics
+void increment_metric(const std::string &name, int64_t delta) {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    metrics[name] += delta;
+}
+
+void set_metric(const std::string &name, int64_t value) {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    metrics[name] = value;
+}
+
+json get_metrics_snapshot() {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    json snapshot = json::object();
+    for (const auto &[name, value] : metrics)
+        snapshot[name] = value;
+    return snapshot;
+}
+
+// Transfer scheduler
+constexpr size_t DEFAULT_TRANSFER_RATE = 10 * 1024 * 1024; // 10 MB/s for all the scheduled transfers
+constexpr size_t DEFAULT_TRANSFER_CONNECTION_RATE = 0; // No cap per transfer beyond its fair share
+constexpr size_t TRANSFER_CHUNK_BYTES = 16 * 1024;
+// Pacing sleeps on the connection's pool worker (httplib content providers are synchronous), so only a few transfers
+// are paced at once and the others are asked to retry rather than starving the pool or bypassing the buckets
+constexpr int64_t MAX_PACED_TRANSFERS = 8;
+constexpr int TRANSFER_RETRY_AFTER_SECONDS = 5;
+
+struct ScheduledTransfer {
+    std::string content;
+    int weight = 1;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+};
+
+static std::mutex transfer_mutex;
+static int64_t active_transfer_weight = 0;
+static int64_t active_transfers = 0;
+// Shared global bucket: every paced chunk reserves its slot on this clock, the aggregate never exceeds the global rate
+static std::chrono::steady_clock::time_point global_transfer_clock = std::chrono::steady_clock::now();
+
+// Helper: Rate in bytes per second from an environment variable in KB/s
+static size_t get_transfer_rate_setting(const char *name, size_t default_rate) {
+    const char *rate_kb = std::getenv(name);
+    if (rate_kb && *rate_kb) {
+        if (const auto value = parse_number<size_t>(rate_kb))
+            return *value * 1024;
+        log(std::string("Invalid ") + name + " value, using default transfer rate");
+    }
+    return default_rate;
+}
+
+static size_t get_global_transfer_rate() {
+    static const size_t rate = get_transfer_rate_setting("V3KN_TRANSFER_RATE_KB", DEFAULT_TRANSFER_RATE);
+    return rate;
+}
+
+static size_t get_connection_transfer_rate() {
+    static const size_t rate = get_transfer_rate_setting("V3KN_TRANSFER_CONNECTION_RATE_KB", DEFAULT_TRANSFER_CONNECTION_RATE);
+    return rate;
+}
+
+// Helper: Current rate of a transfer, its weighted share of the global rate capped by the connection rate (0 when unlimited)
+static double get_transfer_rate(int weight) {
+    double rate = 0;
+    if (const size_t global_rate = get_global_transfer_rate()) {
+        std::lock_guard<std::mutex> lock(transfer_mutex);
+        rate = static_cast<double>(global_rate) * weight / std::max<int64_t>(active_transfer_weight, weight);
+    }
+    if (const size_t connection_rate = get_connection_transfer_rate())
+        rate = (rate > 0) ? std::min(rate, static_cast<double>(connection_rate)) : connection_rate;
+    return rate;
+}
+
+// Helper: Wait until both the transfer bucket and the global bucket allow the next chunk
+static void wait_for_transfer_tokens(ScheduledTransfer &transfer, size_t bytes) {
+    const auto now = std::chrono::steady_clock::now();
+    auto ready = now;
+
+    // Per transfer bucket, at most one chunk of burst so an idle connection does not build up credit
+    if (const double rate = get_transfer_rate(transfer.weight); rate > 0) {
+        const double elapsed = std::chrono::duration<double>(now - transfer.last_refill).count();
+        transfer.tokens = std::min<double>(transfer.tokens + elapsed * rate, TRANSFER_CHUNK_BYTES) - static_cast<double>(bytes);
+        transfer.last_refill = now;
+        if (transfer.tokens < 0) {
+            ready += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-transfer.tokens / rate));
+            transfer.tokens = 0;
+            transfer.last_refill = ready;
+        }
+    }
+
+    // Global bucket, the chunk is sent at the start of the slot it reserves
+    if (const size_t global_rate = get_global_transfer_rate()) {
+        std::lock_guard<std::mutex> lock(transfer_mutex);
+        global_transfer_clock = std::max(global_transfer_clock, ready);
+        ready = global_transfer_clock;
+        global_transfer_clock += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(static_cast<double>(bytes) / global_rate));
+    }
+
+    if (ready <= now)
+        return;
+
+    std::this_thread::sleep_until(ready);
+    increment_metric("transfer.download.throttled_us", std::chrono::duration_cast<std::chrono::microseconds>(ready - now).count());
+}
+
+void set_scheduled_content(httplib::Response &res, std::string content, const std::string &content_type, int weight) {
+    if ((content.size() < TRANSFER_SCHEDULER_MIN_BYTES) || (!get_global_transfer_rate() && !get_connection_transfer_rate())) {
+        increment_metric("transfer.download.bypassed");
+        increment_metric("transfer.download.bytes", static_cast<int64_t>(content.size()));
+        res.set_content(std::move(content), content_type);
+        return;
+    }
+
+    const int transfer_weight = std::max(weight, 1);
+    {
+        std::lock_guard<std::mutex> lock(transfer_mutex);
+        if (active_transfers >= MAX_PACED_TRANSFERS) {
+            increment_metric("transfer.download.rejected");
+            res.status = 503;
+            res.set_header("Retry-After", std::to_string(TRANSFER_RETRY_AFTER_SECONDS));
+            res.set_content("ERR:TransferBusy", "text/plain");
+            return;
+        }
+        active_transfer_weight += transfer_weight;
+        set_metric("transfer.active", ++active_transfers);
+    }
+
+    auto transfer = std::make_shared<ScheduledTransfer>();
+    transfer->content = std::move(content);
+    transfer->weight = transfer_weight;
+
+    const size_t size = transfer->content.size();
+    res.set_content_provider(
+        size, content_type,
+        [transfer](size_t offset, size_t length, httplib::DataSink &sink) {
+            const size_t chunk = std::min(length, TRANSFER_CHUNK_BYTES);
+            wait_for_transfer_tokens(*transfer, chunk);
+            if (!sink.write(transfer->content.data() + offset, chunk))
+                return false;
+
+            increment_metric("transfer.download.bytes", static_cast<int64_t>(chunk));
+            return true;
+        },
+        [transfer](bool) {
+            std::lock_guard<std::mutex> lock(transfer_mutex);
+            active_transfer_weight -= transfer->weight;
+            set_metric("transfer.active", --active_transfers);
+        });
+}
+
+// The request body is already received when the handler runs, so uploads are accounted but not shaped
+void meter_upload(size_t bytes) {
+    increment_metric("transfer.upload.bytes", static_cast<int64_t>(bytes));
+}
+
+// Idempotency keys
+static json idempotency_entry_to_json(const std::string &cache_key, const IdempotencyEntry &entry) {
+    return json{ { "key", cache_key }, { "path", entry.path }, { "status", entry.status }, { "content_type", entry.content_type }, { "body", entry.body }, { "headers", entry.headers }, { "fingerprint", entry.fingerprint }, { "created_at", entry.created_at } };
+}
+
+// Helper: Hash of what a request carries (parameters, body, multipart fields and files), a key reused with another one is rejected
+static std::string compute_request_fingerprint(const httplib::Request &req) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    const auto append = [&](const std::string &value) {
+        const std::string size = std::to_string(value.size()) + ":";
+        EVP_DigestUpdate(ctx, size.data(), size.size());
+        EVP_DigestUpdate(ctx, value.data(), value.size());
+    };
+    for (const auto &[name, value] : req.params) {
+        append(name);
+        append(value);
+    }
+    append(req.body);
+    for (const auto &[name, field] : req.form.fields) {
+        append(name);
+        append(field.content);
+    }
+    for (const auto &[name, file] : req.form.files) {
+        append(name);
+        append(file.filename);
+        append(file.content);
+    }
+
+    std::array<unsigned char, SHA256_DIGEST_LENGTH> hash{};
+    EVP_DigestFinal_ex(ctx, hash.data(), nullptr);
+    EVP_MD_CTX_free(ctx);
+    return base64_encode(std::string(hash.begin(), hash.end()));
+}
+
+// Helper: Drop the expired entries and the oldest ones over the cap (idempotency_mutex must be held)
+static void prune_idempotency_entries() {
+    const uint64_t now = get_current_time_ms();
+    while (!idempotency_order.empty()) {
+        const auto it = idempotency_entries.find(idempotency_order.front());
+        const bool expired = it == idempotency_entries.end() || it->second.created_at + IDEMPOTENCY_TTL_MS < now;
+        if (!expired && idempotency_order.size() <= MAX_IDEMPOTENCY_ENTRIES)
+            break;
+
+        if (it != idempotency_entries.end())
+            idempotency_entries.erase(it);
+        idempotency_order.pop_front();
+    }
+}
+
+// Helper: Rewrite the journal with the live entries only (idempotency_mutex must be held)
+static void compact_idempotency_journal() {
+    std::string content;
+    for (const auto &cache_key : idempotency_order)
+        content += idempotency_entry_to_json(cache_key, idempotency_entries[cache_key]).dump() + "\n";
+    write_file_atomic(idempotency_journal_path, content);
+    idempotency_journal_lines = idempotency_order.size();
+}
+
+// Helper: Replay the journal on first use, a torn last line from a crash is skipped (idempotency_mutex must be held)
+static void ensure_idempotency_journal_loaded() {
+    if (idempotency_journal_loaded)
+        return;
+
+    idempotency_journal_loaded = true;
+    std::ifstream f(idempotency_journal_path);
+    std::string line;
+    while (std::getline(f, line)) {
+        ++idempotency_journal_lines;
+        try {
+            const json record = json::parse(line);
+            const std::string cache_key = record.at("key").get<std::string>();
+            if (idempotency_entries.contains(cache_key))
+                continue;
+
+            IdempotencyEntry entry;
+            entry.path = record.at("path").get<std::string>();
+            entry.in_flight = false;
+            entry.status = record.at("status").get<int>();
+            entry.content_type = record.at("content_type").get<std::string>();
+            entry.body = record.at("body").get<std::string>();
+            entry.headers = record.value("headers", json::object());
+            entry.fingerprint = record.value("fingerprint", "");
+            entry.created_at = record.at("created_at").get<uint64_t>();
+            idempotency_entries[cache_key] = std::move(entry);
+            idempotency_order.push_back(cache_key);
+        } catch (...) {
+            continue;
+        }
+    }
+    prune_idempotency_entries();
+    log("Loaded " + std::to_string(idempotency_order.size()) + " idempotency keys from journal");
+}
+
+// Helper: Store a completed response and append it to the journal
+static void complete_idempotency_entry(const std::string &cache_key, const httplib::Response &res) {
+    std::lock_guard<std::mutex> lock(idempotency_mutex);
+    auto it = idempotency_entries.find(cache_key);
+    if (it == idempotency_entries.end())
+        return;
+
+    // Server errors may succeed on retry, large responses are not worth keeping
+    if (res.status >= 500 || res.body.size() > MAX_IDEMPOTENCY_BODY_BYTES) {
+        idempotency_entries.erase(it);
+        return;
+    }
+
+    auto &entry = it->second;
+    entry.in_flight = false;
+    entry.status = res.status == -1 ? 200 : res.status;
+    entry.content_type = res.get_header_value("Content-Type");
+    entry.body = res.body;
+    for (const char *header : IDEMPOTENCY_REPLAYED_HEADERS) {
+        if (res.has_header(header))
+            entry.headers[header] = res.get_header_value(header);
+    }
+    entry.created_at = get_current_time_ms();
+    idempotency_order.push_back(cache_key);
+    prune_idempotency_entries();
+
+    if (idempotency_journal_lines >= 2 * MAX_IDEMPOTENCY_ENTRIES) {
+        compact_idempotency_journal();
+        return;
+    }
+
+    std::ofstream journal(idempotency_journal_path, std::ios::app);
+    journal << idempotency_entry_to_json(cache_key, entry).dump() << "\n";
+    ++idempotency_journal_lines;
+}
+
+httplib::Server::Handler with_idempotency(httplib::Server::Handler handler) {
+    return [handler = std::move(handler)](const httplib::Request &req, httplib::Response &res) {
+        const std::string key = req.get_header_value("Idempotency-Key");
+        const std::string account_id = key.empty() ? "" : get_account_id_from_token(get_token_from_request(req));
+        if (account_id.empty()) {
+            // No key, or no valid token to scope it to: the handler reports its own errors
+            handler(req, res);
+            return;
+        }
+
+        if (key.size() > MAX_IDEMPOTENCY_KEY_LENGTH) {
+            res.status = 400;
+            res.set_content("ERR:InvalidIdempotencyKey", "text/plain");
+            return;
+        }
+
+        const std::string cache_key = account_id + "\n" + key;
+        const std::string fingerprint = compute_request_fingerprint(req);
+        {
+            std::lock_guard<std::mutex> lock(idempotency_mutex);
+            ensure_idempotency_journal_loaded();
+
+            const auto it = idempotency_entries.find(cache_key);
+            if (it != idempotency_entries.end()) {
+                const auto &entry = it->second;
+                if (entry.path != req.path || (!entry.fingerprint.empty() && entry.fingerprint != fingerprint)) {
+                    res.status = 422;
+                    res.set_content("ERR:IdempotencyKeyReused", "text/plain");
+                } else if (entry.in_flight) {
+                    increment_metric("idempotency.conflicts");
+                    res.status = 409;
+                    res.set_content("ERR:RequestInProgress", "text/plain");
+                } else {
+                    increment_metric("idempotency.replays");
+                    res.status = entry.status;
+                    res.set_content(entry.body, entry.content_type.empty() ? "text/plain" : entry.content_type);
+                    for (const auto &[header, value] : entry.headers.items())
+                        res.set_header(header, value.get<std::string>());
+                    res.set_header("Idempotent-Replayed", "true");
+                }
+                return;
+            }
+
+            IdempotencyEntry entry;
+            entry.path = req.path;
+            entry.fingerprint = fingerprint;
+            idempotency_entries[cache_key] = std::move(entry);
+        }
+
+        try {
+            handler(req, res);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(idempotency_mutex);
+            idempotency_entries.erase(cache_key);
+            throw;
+        }
+        complete_idempotency_entry(cache_key, res);
+    };
+}
@@ -0,0 +1,84 @@
+// v3knr project
+// Copyright (C) 2026 Vita3K team
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#include "maintenance/maintenance.h"
+#include "utils/params.h"
+#include "utils/utils.h"
+
+#include <iostream>
+
+static void print_usage() {
+    std::cout << "Usage: v3kn-admin [options]\n"
+                 "Checks the v3kn data directory for inconsistencies, the server must be stopped.\n\n"
+                 "  --dir <path>         Server working directory (containing v3kn/), default is the current directory\n"
+                 "  --fix                Repair the inconsistencies found\n"
+                 "  --rebuild-rarity     Regenerate trophies_rarity.json from every trophies.xml\n"
+                 "  --rebuild-indexes    Regenerate conversation summaries and search indexes\n"
+                 "  --migrate-layout     Move the Users, conversations and Trophies entries into the hashed layout\n"
+                 "  --jobs <n>           Worker threads, default is one per hardware thread\n"
+                 "  --help               Show this help\n";
+}
+
+int main(int argc, char *argv[]) {
+    MaintenanceOptions options;
+    bool migrate_layout = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--fix")
+            options.fix = true;
+        else if (arg == "--rebuild-rarity")
+            options.rebuild_rarity = true;
+        else if (arg == "--rebuild-indexes")
+            options.rebuild_indexes = true;
+        else if (arg == "--migrate-layout")
+            migrate_layout = true;
+        else if (arg == "--jobs" && i + 1 < argc) {
+            const auto jobs = parse_number<unsigned>(argv[++i]);
+            if (!jobs) {
+                std::cerr << "Invalid --jobs value\n";
+                return 2;
+            }
+            options.jobs = *jobs;
+        } else if (arg == "--dir" && i + 1 < argc) {
+            std::error_code ec;
+            fs::current_path(argv[++i], ec);
+            if (ec) {
+                std::cerr << "Cannot enter " << argv[i] << ": " << ec.message() << "\n";
+                return 2;
+            }
+        } else if (arg == "--help") {
+            print_usage();
+            return 0;
+        } else {
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (!fs::exists(fs::path("v3kn") / "users.json")) {
+        std::cerr << "No v3kn/users.json in " << fs::current_path().string() << "\n";
+        return 2;
+    }
+
+    // Moved first so the checks below see the final paths
+    const size_t layout_left = migrate_layout ? migrate_data_layout() : 0;
+    if (layout_left > 0)
+        std::cerr << layout_left << " entries could not be moved to the hashed layout, see the log\n";
+
+    const MaintenanceReport report = run_maintenance(options);
+    return (report.issues == report.fixed && layout_left == 0) ? 0 : 1;
+}